@@ -1,11 +1,14 @@
 #include "AgalTranslator.h"
+#include "OutputFile.h"
 #include <SPIRV/spirv.hpp>
 #include "../glslang/glslang/Public/ShaderLang.h"
 #include <algorithm>
 #include <fstream>
 #include <map>
+#include <stdlib.h>
 #include <string.h>
 #include <sstream>
+#include <stdexcept>
 
 using namespace krafix;
 
@@ -188,7 +191,7 @@ namespace {
 		}
 	}
 
-	void assignRegisterNumber(Register& reg, std::map<unsigned, Register>& assigned, int& nextTemporary, int& nextAttribute, int& nextConstant, int& nextSampler) {
+	void assignRegisterNumber(Register& reg, std::map<unsigned, Register>& assigned, int& nextAttribute, int& nextConstant, int& nextSampler) {
 		if (reg.type == Unused) return;
 
 		if (reg.spirIndex != 0 && assigned.find(reg.spirIndex) != assigned.end()) {
@@ -198,9 +201,8 @@ namespace {
 		else {
 			switch (reg.type) {
 			case Temporary:
-				reg.number = nextTemporary;
+				// Numbered by allocateTemporaries
 				if (reg.spirIndex != 0) assigned[reg.spirIndex] = reg;
-				nextTemporary += reg.size;
 				break;
 			case Attribute:
 				reg.number = nextAttribute;
@@ -260,7 +262,6 @@ namespace {
 	}
 
 	void assignRegisterNumbers(std::vector<Agal>& agal, std::map<unsigned, Register>& assigned, std::map<unsigned, Name>& names) {
-		int nextTemporary = 0;
 		int nextAttribute = 0;
 		int nextConstant = 0;
 		int nextSampler = 0;
@@ -310,9 +311,9 @@ namespace {
 
 		for (unsigned i = 0; i < agal.size(); ++i) {
 			Agal& instruction = agal[i];
-			assignRegisterNumber(instruction.destination, assigned, nextTemporary, nextAttribute, nextConstant, nextSampler);
-			assignRegisterNumber(instruction.source1, assigned, nextTemporary, nextAttribute, nextConstant, nextSampler);
-			assignRegisterNumber(instruction.source2, assigned, nextTemporary, nextAttribute, nextConstant, nextSampler);
+			assignRegisterNumber(instruction.destination, assigned, nextAttribute, nextConstant, nextSampler);
+			assignRegisterNumber(instruction.source1, assigned, nextAttribute, nextConstant, nextSampler);
+			assignRegisterNumber(instruction.source2, assigned, nextAttribute, nextConstant, nextSampler);
 		}
 	}
 
@@ -362,6 +363,690 @@ namespace {
 		invalid.size = 0;
 		return invalid;
 	}
+
+	// Flash's baseline profiles run AGAL 1, standard profiles AGAL 2 and standard extended AGAL 3
+	int agalVersion(const Target& target) {
+		return target.version == 2 || target.version == 3 ? target.version : 1;
+	}
+
+	// vt and ft registers, the same number for both stages
+	int maxTemporaries(int agalVersion) {
+		return agalVersion >= 2 ? 26 : 8;
+	}
+
+	unsigned componentIndex(char component) {
+		switch (component) {
+		case 'y':
+			return 1;
+		case 'z':
+			return 2;
+		case 'w':
+			return 3;
+		default:
+			return 0;
+		}
+	}
+
+	// A source swizzle with less than four components repeats its last component
+	std::string expandSwizzle(const std::string& swizzle) {
+		std::string expanded = swizzle.substr(0, 4);
+		while (expanded.size() < 4) expanded += expanded.empty() ? 'x' : expanded[expanded.size() - 1];
+		return expanded;
+	}
+
+	unsigned writeMask(const std::string& swizzle) {
+		unsigned mask = 0;
+		for (char component : swizzle) mask |= 1 << componentIndex(component);
+		return mask;
+	}
+
+	std::string maskString(unsigned mask) {
+		std::string swizzle;
+		for (unsigned i = 0; i < 4; ++i) {
+			if (mask & (1 << i)) swizzle += indexName(i);
+		}
+		return swizzle;
+	}
+
+	// Components a source register provides to the written destination components
+	unsigned readMask(const std::string& swizzle, unsigned written) {
+		std::string expanded = expandSwizzle(swizzle);
+		unsigned mask = 0;
+		for (unsigned i = 0; i < 4; ++i) {
+			if (written & (1 << i)) mask |= 1 << componentIndex(expanded[i]);
+		}
+		return mask;
+	}
+
+	unsigned componentCount(unsigned mask) {
+		unsigned count = 0;
+		for (unsigned i = 0; i < 4; ++i) {
+			if (mask & (1 << i)) ++count;
+		}
+		return count;
+	}
+
+	// Destination component i only depends on source component i
+	bool isComponentwise(const Agal& instruction) {
+		if (instruction.destination.size > 1) return false;
+		switch (instruction.opcode) {
+		case add:
+		case sub:
+		case mul:
+		case Opcode::div:
+		case mov:
+		case Opcode::cos:
+		case Opcode::sin:
+		case Opcode::min:
+		case Opcode::max:
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	bool sameRegister(const Register& a, const Register& b) {
+		if (a.type != b.type) return false;
+		if (a.type == Output) return a.number == b.number;
+		return a.spirIndex == b.spirIndex;
+	}
+
+	bool writes(const Agal& instruction, const Register& reg) {
+		if (instruction.opcode == con || instruction.opcode == unknown) return false;
+		return sameRegister(instruction.destination, reg);
+	}
+
+	bool reads(const Agal& instruction, const Register& reg) {
+		if (instruction.opcode == con || instruction.opcode == unknown) return false;
+		return sameRegister(instruction.source1, reg) || sameRegister(instruction.source2, reg);
+	}
+
+	// Index of the last instruction before end which writes the component of reg
+	int lastWrite(std::vector<Agal>& agal, int end, const Register& reg, unsigned component) {
+		for (int i = end - 1; i >= 0; --i) {
+			if (!writes(agal[i], reg)) continue;
+			if (agal[i].destination.size > 1 || (writeMask(agal[i].destination.swizzle) & (1 << component))) return i;
+		}
+		return -1;
+	}
+
+	bool writtenBetween(std::vector<Agal>& agal, int start, int end, const Register& reg) {
+		for (int i = start; i < end; ++i) {
+			if (writes(agal[i], reg)) return true;
+		}
+		return false;
+	}
+
+	// Reads through the movs which wrote the read components of a temporary when they all
+	// copied from one register which did not change since, composing the swizzles.
+	bool forwardSource(std::vector<Agal>& agal, int index, Register& source, unsigned written) {
+		if (source.type != Temporary || source.size != 1) return false;
+		std::string expanded = expandSwizzle(source.swizzle);
+		std::string swizzle = expanded;
+		Register forwarded;
+		for (unsigned component = 0; component < 4; ++component) {
+			if (!(written & (1 << component))) continue;
+			unsigned read = componentIndex(expanded[component]);
+			int definition = lastWrite(agal, index, source, read);
+			if (definition < 0) return false;
+			Agal& move = agal[definition];
+			if (move.opcode != mov || move.destination.size != 1 || move.source1.size != 1) return false;
+			if (move.source1.type == Output || move.source1.type == Sampler || move.source1.type == Unused) return false;
+			if (forwarded.type == Unused) forwarded = move.source1;
+			else if (!sameRegister(forwarded, move.source1)) return false;
+			if (writtenBetween(agal, definition, index, move.source1)) return false;
+			swizzle[component] = expandSwizzle(move.source1.swizzle)[read];
+		}
+		if (forwarded.type == Unused) return false;
+		// Components which are not written by a componentwise instruction are never read
+		for (unsigned component = 0; component < 4; ++component) {
+			if (written & (1 << component)) {
+				for (unsigned other = 0; other < 4; ++other) {
+					if (!(written & (1 << other))) swizzle[other] = swizzle[component];
+				}
+				break;
+			}
+		}
+		forwarded.swizzle = swizzle;
+		source = forwarded;
+		return true;
+	}
+
+	// Copy propagation over the movs created for loads, stores, access chains and composites.
+	// Sources are read through the movs which wrote them and the result of an instruction which
+	// is only moved to another register is written there directly. Movs to temporaries which are
+	// no longer read afterwards are removed by allocateTemporaries.
+	void propagateCopies(std::vector<Agal>& agal) {
+		for (int i = 0; i < (int)agal.size(); ++i) {
+			Agal& instruction = agal[i];
+			if (instruction.opcode == con || instruction.opcode == unknown) continue;
+			unsigned written = isComponentwise(instruction) ? writeMask(instruction.destination.swizzle) : 0xf;
+			Register source1 = instruction.source1;
+			Register source2 = instruction.source2;
+			forwardSource(agal, i, source1, written);
+			forwardSource(agal, i, source2, written);
+			// Two constants in one instruction are not allowed
+			if (source1.type == Constant && source2.type == Constant) {
+				if (instruction.source1.type != Constant) source1 = instruction.source1;
+				else source2 = instruction.source2;
+			}
+			if (instruction.opcode == tex && source1.type == Constant) source1 = instruction.source1;
+			instruction.source1 = source1;
+			instruction.source2 = source2;
+		}
+
+		std::vector<bool> removed(agal.size(), false);
+		for (int i = 0; i < (int)agal.size(); ++i) {
+			Agal& move = agal[i];
+			if (move.opcode != mov || move.destination.size != 1 || move.destination.swizzle != "xyzw") continue;
+			const Register& value = move.source1;
+			if (value.type != Temporary || value.size != 1 || expandSwizzle(value.swizzle) != "xyzw") continue;
+			int definition = lastWrite(agal, i, value, 0);
+			if (definition < 0 || removed[definition]) continue;
+			Agal& instruction = agal[definition];
+			if (!isComponentwise(instruction) || instruction.destination.swizzle != "xyzw") continue;
+			if (writtenBetween(agal, definition + 1, i, value) || writtenBetween(agal, definition + 1, i, move.destination)) continue;
+			bool otherReads = false;
+			for (int i2 = definition + 1; i2 < (int)agal.size(); ++i2) {
+				if (i2 == i || removed[i2]) continue;
+				if (reads(agal[i2], value) || (i2 < i && reads(agal[i2], move.destination))) otherReads = true;
+			}
+			if (otherReads) continue;
+			Register destination = move.destination;
+			instruction.destination = destination;
+			removed[i] = true;
+		}
+
+		std::vector<Agal> propagated;
+		for (unsigned i = 0; i < agal.size(); ++i) {
+			if (!removed[i]) propagated.push_back(agal[i]);
+		}
+		agal = propagated;
+	}
+
+	struct TemporaryValue {
+		int size;
+		// Has to keep its components in place because it is written by a non componentwise instruction
+		bool fixed;
+		// Components which are written and read
+		unsigned used;
+		int start;
+		int end;
+		bool startsWithWrite;
+		int number;
+		unsigned components[4];
+
+		TemporaryValue() : size(1), fixed(false), used(0), start(-1), end(-1), startsWithWrite(false), number(0) {
+			for (unsigned i = 0; i < 4; ++i) components[i] = i;
+		}
+
+		// Swizzle of the register for a swizzle of the value
+		std::string map(const std::string& swizzle) {
+			unsigned fallback = 0;
+			while (fallback < 3 && !(used & (1 << fallback))) ++fallback;
+			std::string mapped;
+			for (char component : swizzle) {
+				unsigned index = componentIndex(component);
+				mapped += indexName(components[(used & (1 << index)) ? index : fallback]);
+			}
+			return mapped;
+		}
+	};
+
+	// Computes which components of which temporaries are live, removes writes nobody reads and
+	// packs the temporaries into as few vt/ft registers as possible using linear scan over their
+	// live ranges, several small values can share one register when they use different components.
+	// Returns nonzero and describes the problem in error when the AGAL version has too few registers.
+	int allocateTemporaries(std::vector<Agal>& agal, std::map<unsigned, Register>& assigned, ShaderStage stage, int agalVersion, std::string& error) {
+		std::map<unsigned, TemporaryValue> values;
+		std::map<unsigned, unsigned> live;
+		std::vector<bool> dead(agal.size(), false);
+
+		for (int i = (int)agal.size() - 1; i >= 0; --i) {
+			Agal& instruction = agal[i];
+			if (instruction.opcode == con || instruction.opcode == unknown) continue;
+			bool componentwise = isComponentwise(instruction);
+			unsigned written = writeMask(instruction.destination.swizzle);
+
+			if (instruction.destination.type == Temporary) {
+				unsigned index = instruction.destination.spirIndex;
+				TemporaryValue& value = values[index];
+				value.size = std::max(value.size, instruction.destination.size);
+				if (componentwise) {
+					written &= live[index];
+					if (written == 0) {
+						dead[i] = true;
+						continue;
+					}
+					instruction.destination.swizzle = maskString(written);
+				}
+				else {
+					value.fixed = true;
+				}
+				live[index] &= ~written;
+				value.used |= written;
+				value.start = i;
+				value.startsWithWrite = true;
+				if (value.end < 0) value.end = i;
+			}
+
+			Register* sources[] = { &instruction.source1, &instruction.source2 };
+			for (Register* source : sources) {
+				if (source->type != Temporary) continue;
+				TemporaryValue& value = values[source->spirIndex];
+				unsigned read = readMask(source->swizzle, componentwise ? written : 0xf);
+				value.size = std::max(value.size, source->size);
+				live[source->spirIndex] |= read;
+				value.used |= read;
+				value.start = i;
+				value.startsWithWrite = false;
+				if (value.end < 0) value.end = i;
+			}
+		}
+
+		std::vector<unsigned> order;
+		for (auto& value : values) {
+			if (value.second.size > 1) {
+				value.second.fixed = true;
+				value.second.used = 0xf;
+			}
+			if (value.second.used != 0) order.push_back(value.first);
+		}
+		std::sort(order.begin(), order.end(), [&](unsigned a, unsigned b) {
+			return values[a].start < values[b].start || (values[a].start == values[b].start && a < b);
+		});
+
+		// Enough registers for every value to get its own, the limit is checked afterwards to report how many are needed
+		int capacity = 0;
+		for (unsigned index : order) capacity += values[index].size;
+
+		// Index of the last instruction using each register component
+		std::vector<std::vector<int>> busy(capacity, std::vector<int>(4, -1));
+		int registerCount = 0;
+		for (unsigned index : order) {
+			TemporaryValue& value = values[index];
+			// The last read of another value and this write can share a component within one instruction
+			bool shareable = value.startsWithWrite && isComponentwise(agal[value.start]);
+			auto available = [&](int reg, unsigned component) {
+				return busy[reg][component] < value.start || (shareable && busy[reg][component] == value.start);
+			};
+
+			int chosen = -1;
+			if (value.fixed) {
+				for (int reg = 0; reg + value.size <= capacity && chosen < 0; ++reg) {
+					bool fits = true;
+					for (int reg2 = reg; reg2 < reg + value.size; ++reg2) {
+						for (unsigned component = 0; component < 4; ++component) {
+							if ((value.used & (1 << component)) && !available(reg2, component)) fits = false;
+						}
+					}
+					if (fits) chosen = reg;
+				}
+			}
+			else {
+				// Best fit, prefer registers which are already partly in use
+				unsigned needed = componentCount(value.used);
+				unsigned bestFree = 5;
+				for (int reg = 0; reg < capacity; ++reg) {
+					unsigned free = 0;
+					for (unsigned component = 0; component < 4; ++component) {
+						if (available(reg, component)) ++free;
+					}
+					if (free >= needed && free < bestFree) {
+						chosen = reg;
+						bestFree = free;
+					}
+				}
+				if (chosen >= 0) {
+					unsigned component = 0;
+					for (unsigned i = 0; i < 4; ++i) {
+						if (!(value.used & (1 << i))) continue;
+						while (!available(chosen, component)) ++component;
+						value.components[i] = component++;
+					}
+				}
+			}
+
+			value.number = chosen;
+			for (int reg = chosen; reg < chosen + value.size; ++reg) {
+				for (unsigned i = 0; i < 4; ++i) {
+					if (value.used & (1 << i)) busy[reg][value.components[i]] = value.end;
+				}
+			}
+			registerCount = std::max(registerCount, chosen + value.size);
+		}
+
+		if (registerCount > maxTemporaries(agalVersion)) {
+			std::stringstream message;
+			message << "The " << (stage == StageVertex ? "vertex" : "fragment") << " shader needs " << registerCount << " temporary registers, AGAL "
+				<< agalVersion << " only provides " << maxTemporaries(agalVersion) << ".";
+			error = message.str();
+			return 1;
+		}
+
+		std::vector<Agal> allocated;
+		for (unsigned i = 0; i < agal.size(); ++i) {
+			if (dead[i]) continue;
+			Agal instruction = agal[i];
+			if (instruction.opcode == con || instruction.opcode == unknown) {
+				allocated.push_back(instruction);
+				continue;
+			}
+
+			if (instruction.destination.type == Temporary) {
+				TemporaryValue& value = values[instruction.destination.spirIndex];
+				unsigned written = writeMask(instruction.destination.swizzle);
+				if (isComponentwise(instruction)) {
+					// Source components have to follow their destination components
+					Register* sources[] = { &instruction.source1, &instruction.source2 };
+					for (Register* source : sources) {
+						if (source->type == Unused || source->type == Sampler) continue;
+						std::string expanded = expandSwizzle(source->swizzle);
+						std::string moved = expanded;
+						for (unsigned component = 0; component < 4; ++component) {
+							if (written & (1 << component)) moved[value.components[component]] = expanded[component];
+						}
+						source->swizzle = moved;
+					}
+				}
+				unsigned mask = 0;
+				for (unsigned component = 0; component < 4; ++component) {
+					if (written & (1 << component)) mask |= 1 << value.components[component];
+				}
+				instruction.destination.number = value.number;
+				instruction.destination.swizzle = maskString(mask);
+			}
+
+			Register* sources[] = { &instruction.source1, &instruction.source2 };
+			for (Register* source : sources) {
+				if (source->type == Temporary) {
+					TemporaryValue& value = values[source->spirIndex];
+					source->number = value.number;
+					source->swizzle = value.map(source->swizzle);
+				}
+				if (source->swizzle.size() == 4 && source->swizzle.find_first_not_of(source->swizzle[0]) == std::string::npos) {
+					source->swizzle = source->swizzle.substr(0, 1);
+				}
+			}
+			allocated.push_back(instruction);
+		}
+		agal = allocated;
+
+		for (auto it = assigned.begin(); it != assigned.end();) {
+			if (it->second.type == Temporary && values.find(it->first) == values.end()) {
+				// Optimized away
+				it = assigned.erase(it);
+				continue;
+			}
+			if (it->second.type == Temporary) it->second.number = values[it->first].number;
+			++it;
+		}
+		return 0;
+	}
+}
+
+namespace {
+	struct PooledConstant {
+		int number;
+		unsigned count;
+		unsigned components[4];
+	};
+
+	struct ConstantPool {
+		std::vector<std::vector<std::string>> registers;
+		std::vector<unsigned> used;
+
+		int freeComponents(int reg) {
+			return 4 - (int)componentCount(used[reg]);
+		}
+
+		int find(const std::string& value) {
+			for (int reg = 0; reg < (int)registers.size(); ++reg) {
+				for (unsigned component = 0; component < 4; ++component) {
+					if ((used[reg] & (1 << component)) && registers[reg][component] == value) return reg * 4 + component;
+				}
+			}
+			return -1;
+		}
+
+		// Fills free components of the fullest register that has room, prefers a new register for vec3 and vec4
+		PooledConstant add(const std::vector<std::string>& values) {
+			PooledConstant pooled;
+			pooled.count = (unsigned)values.size();
+			pooled.number = -1;
+			if (values.size() <= 2) {
+				int bestFree = 5;
+				for (int reg = 0; reg < (int)registers.size(); ++reg) {
+					int free = freeComponents(reg);
+					if (free >= (int)values.size() && free < bestFree) {
+						pooled.number = reg;
+						bestFree = free;
+					}
+				}
+			}
+			if (pooled.number < 0) {
+				pooled.number = (int)registers.size();
+				registers.push_back(std::vector<std::string>(4, "0.0"));
+				used.push_back(0);
+			}
+			unsigned component = 0;
+			for (unsigned i = 0; i < values.size() && i < 4; ++i) {
+				while (used[pooled.number] & (1 << component)) ++component;
+				registers[pooled.number][component] = values[i];
+				used[pooled.number] |= 1 << component;
+				pooled.components[i] = component++;
+			}
+			return pooled;
+		}
+	};
+
+	std::string poolSwizzle(const PooledConstant& pooled, const std::string& swizzle) {
+		std::string mapped;
+		for (char component : swizzle) {
+			mapped += indexName(pooled.components[std::min(componentIndex(component), pooled.count - 1)]);
+		}
+		if (mapped.size() == 4 && mapped.find_first_not_of(mapped[0]) == std::string::npos) mapped = mapped.substr(0, 1);
+		return mapped;
+	}
+
+	// Places the hard coded constants which are still read into as few registers as possible.
+	// Identical values are shared and scalars and vec2s fill the free components of other
+	// constants. Uniforms are moved down to follow the pool.
+	ConstantPool packConstants(std::vector<Agal>& agal, std::map<unsigned, Register>& assigned) {
+		std::map<unsigned, ConstantVariable> hardCoded;
+		std::map<unsigned, ConstantVariable> uniforms;
+		int oldRegisters = 0;
+		for (unsigned i = 0; i < constants.size(); ++i) {
+			if (constants[i].hardCoded) {
+				hardCoded[constants[i].id] = constants[i];
+				oldRegisters += constants[i].size;
+			}
+			else {
+				uniforms[constants[i].id] = constants[i];
+			}
+		}
+
+		std::vector<unsigned> referenced;
+		for (Agal& instruction : agal) {
+			if (instruction.opcode == con || instruction.opcode == unknown) continue;
+			Register* sources[] = { &instruction.source1, &instruction.source2 };
+			for (Register* source : sources) {
+				if (source->type == Constant && hardCoded.find(source->spirIndex) != hardCoded.end()
+					&& std::find(referenced.begin(), referenced.end(), source->spirIndex) == referenced.end()) {
+					referenced.push_back(source->spirIndex);
+				}
+			}
+		}
+		// Bigger constants first so the small ones can fill the gaps
+		std::stable_sort(referenced.begin(), referenced.end(), [&](unsigned a, unsigned b) {
+			return hardCoded[a].operands.size() > hardCoded[b].operands.size();
+		});
+
+		ConstantPool pool;
+		std::map<unsigned, PooledConstant> placed;
+		std::map<std::vector<std::string>, PooledConstant> vectors;
+		for (unsigned id : referenced) {
+			std::vector<std::string> values = hardCoded[id].operands;
+			if (values.size() > 4) values.resize(4);
+			if (values.size() == 1) {
+				int found = pool.find(values[0]);
+				if (found >= 0) {
+					PooledConstant pooled;
+					pooled.number = found / 4;
+					pooled.count = 1;
+					pooled.components[0] = found % 4;
+					placed[id] = pooled;
+					continue;
+				}
+			}
+			else if (vectors.find(values) != vectors.end()) {
+				placed[id] = vectors[values];
+				continue;
+			}
+			placed[id] = pool.add(values);
+			if (values.size() > 1) vectors[values] = placed[id];
+		}
+
+		int shift = (int)pool.registers.size() - oldRegisters;
+		auto relocate = [&](Register& reg, bool source) {
+			if (reg.type != Constant) return;
+			if (placed.find(reg.spirIndex) != placed.end()) {
+				reg.number = placed[reg.spirIndex].number;
+				if (source) reg.swizzle = poolSwizzle(placed[reg.spirIndex], reg.swizzle);
+			}
+			else if (uniforms.find(reg.spirIndex) != uniforms.end()) {
+				reg.number += shift;
+			}
+		};
+		for (Agal& instruction : agal) {
+			if (instruction.opcode == con || instruction.opcode == unknown) continue;
+			relocate(instruction.source1, true);
+			relocate(instruction.source2, true);
+		}
+		for (auto it = assigned.begin(); it != assigned.end();) {
+			if (it->second.type == Constant && hardCoded.find(it->first) != hardCoded.end() && placed.find(it->first) == placed.end()) {
+				it = assigned.erase(it);
+				continue;
+			}
+			relocate(it->second, false);
+			++it;
+		}
+		return pool;
+	}
+
+	void writeByte(std::ostream& out, unsigned value) {
+		out.put((char)(value & 0xff));
+	}
+
+	void writeShort(std::ostream& out, unsigned value) {
+		writeByte(out, value);
+		writeByte(out, value >> 8);
+	}
+
+	void writeInt(std::ostream& out, unsigned value) {
+		writeShort(out, value);
+		writeShort(out, value >> 16);
+	}
+
+	unsigned opcodeCode(Opcode opcode) {
+		switch (opcode) {
+		case mov:
+			return 0x00;
+		case add:
+			return 0x01;
+		case sub:
+			return 0x02;
+		case mul:
+			return 0x03;
+		case Opcode::div:
+			return 0x04;
+		case Opcode::min:
+			return 0x06;
+		case Opcode::max:
+			return 0x07;
+		case nrm:
+			return 0x0e;
+		case Opcode::sin:
+			return 0x0f;
+		case Opcode::cos:
+			return 0x10;
+		case m44:
+			return 0x18;
+		case tex:
+			return 0x28;
+		default:
+			return 0xff;
+		}
+	}
+
+	unsigned registerTypeCode(RegisterType type) {
+		switch (type) {
+		case Attribute:
+			return 0;
+		case Constant:
+			return 1;
+		case Temporary:
+			return 2;
+		case Output:
+			return 3;
+		case Varying:
+			return 4;
+		case Sampler:
+			return 5;
+		default:
+			return 0;
+		}
+	}
+
+	unsigned swizzleCode(const std::string& swizzle) {
+		std::string expanded = expandSwizzle(swizzle);
+		unsigned code = 0;
+		for (unsigned i = 0; i < 4; ++i) code |= componentIndex(expanded[i]) << (i * 2);
+		return code;
+	}
+
+	// Same layout as the tokens written by AGALMiniAssembler
+	void writeBytecode(std::ostream& out, std::vector<Agal>& agal, ShaderStage stage, int agalVersion) {
+		writeByte(out, 0xa0);
+		writeInt(out, agalVersion);
+		writeByte(out, 0xa1);
+		writeByte(out, stage == StageVertex ? 0 : 1);
+
+		for (unsigned i = 0; i < agal.size(); ++i) {
+			Agal& instruction = agal[i];
+			if (instruction.opcode == con || instruction.opcode == unknown) continue;
+			for (int i2 = 0; i2 < instruction.destination.size; ++i2) {
+				writeInt(out, opcodeCode(instruction.opcode));
+
+				writeShort(out, instruction.destination.number + i2);
+				writeByte(out, writeMask(instruction.destination.swizzle));
+				writeByte(out, registerTypeCode(instruction.destination.type));
+
+				Register* sources[] = { &instruction.source1, &instruction.source2 };
+				for (Register* source : sources) {
+					if (source->type == Unused) {
+						writeInt(out, 0);
+						writeInt(out, 0);
+					}
+					else if (source->type == Sampler) {
+						// 2d, wrap, linear, no mipmaps
+						writeShort(out, source->number);
+						writeByte(out, 0);
+						writeByte(out, 0);
+						writeInt(out, registerTypeCode(Sampler) | (1 << 20) | (1 << 28));
+					}
+					else {
+						writeShort(out, source->number + i2);
+						writeByte(out, 0);
+						writeByte(out, swizzleCode(source->swizzle));
+						writeByte(out, registerTypeCode(source->type));
+						writeByte(out, 0);
+						writeShort(out, 0);
+					}
+				}
+			}
+		}
+	}
 }
 
 void AgalTranslator::outputCode(const Target& target, const char* sourcefilename, const char* filename, char* output, std::map<std::string, int>& attributes) {
@@ -376,7 +1061,7 @@ void AgalTranslator::outputCode(const Target& target, const char* sourcefilename
 
 	std::vector<Agal> agal;
 
-	if (stage == StageVertex) {
+	if (stage == StageVertex && clipSpaceFixup) {
 		//clip space constant
 		Register reg(stage, 99999);
 		reg.type = Constant;
@@ -472,15 +1157,11 @@ void AgalTranslator::outputCode(const Target& target, const char* sourcefilename
 			reg.size = 1;
 			agal.push_back(Agal(con, reg, Register()));
 
-			//todo: clean out the unused constants at the end (for example, because they are used in a composite constant).
 			ConstantVariable variable;
 			variable.id = inst.operands[1];
 			variable.size = 1;
 			variable.type = inst.operands[0];
 			variable.operands.push_back(value);
-			variable.operands.push_back(value);
-			variable.operands.push_back(value);
-			variable.operands.push_back(value);
 			constants.insert(constants.begin(),variable);
 
 			break;
@@ -861,19 +1542,21 @@ void AgalTranslator::outputCode(const Target& target, const char* sourcefilename
 		}
 	}
 
-	//adjust clip space
 	if (stage == StageVertex) {
-		Register poszzzz(stage, vertexOutput, "zzzz");
-		poszzzz.type = Temporary;
-		Register poswwww(stage, vertexOutput, "wwww");
-		poswwww.type = Temporary;
-		agal.push_back(Agal(add, Register(stage, 99998, "xxxx"), poszzzz, poswwww));
-		Register posz(stage, vertexOutput, "z");
-		posz.type = Temporary;
-		Register reg(stage, 99999);
-		reg.type = Constant;
-		reg.swizzle = "x";
-		agal.push_back(Agal(mul, posz, reg, Register(stage, 99998, "x")));
+		//adjust clip space
+		if (clipSpaceFixup) {
+			Register poszzzz(stage, vertexOutput, "zzzz");
+			poszzzz.type = Temporary;
+			Register poswwww(stage, vertexOutput, "wwww");
+			poswwww.type = Temporary;
+			agal.push_back(Agal(add, Register(stage, 99998, "xxxx"), poszzzz, poswwww));
+			Register posz(stage, vertexOutput, "z");
+			posz.type = Temporary;
+			Register reg(stage, 99999);
+			reg.type = Constant;
+			reg.swizzle = "x";
+			agal.push_back(Agal(mul, posz, reg, Register(stage, 99998, "x")));
+		}
 
 		Register op(stage, 0);
 		op.type = Output;
@@ -889,124 +1572,16 @@ void AgalTranslator::outputCode(const Target& target, const char* sourcefilename
 	}
 	assignRegisterNumbers(agal, assigned, names);
 
-	//Optimize, todo: optimize this optimize pass
-	std::map<int, int> firstUsed;
-	std::map<int, int> lastUsed;
-	for (int i = agal.size() - 1; i >= 0; i--)
-	{
-		Agal& instruction = agal[i];
-		if (instruction.opcode == unknown) {
-			continue;
-		}
+	propagateCopies(agal);
 
-		if (instruction.source1.type == Temporary)
-		{
-			firstUsed[instruction.source1.spirIndex] = i;
-			if (lastUsed.find(instruction.source1.spirIndex) == lastUsed.end())
-			{
-				lastUsed[instruction.source1.spirIndex] = i;
-			}
-		}
-
-		if (instruction.source2.type == Temporary)
-		{
-			firstUsed[instruction.source2.spirIndex] = i;
-			if (lastUsed.find(instruction.source2.spirIndex) == lastUsed.end())
-			{
-				lastUsed[instruction.source2.spirIndex] = i;
-			}
-		}
-
-		if (instruction.destination.type == Temporary)
-		{
-			firstUsed[instruction.destination.spirIndex] = i;
-			if (lastUsed.find(instruction.destination.spirIndex) == lastUsed.end())
-			{
-				lastUsed[instruction.destination.spirIndex] = i;
-			}
-		}
+	std::string error;
+	if (allocateTemporaries(agal, assigned, stage, agalVersion(target), error) != 0) {
+		throw std::runtime_error(error);
 	}
 
-	std::map<int, int> currentlyUsed;
-	std::vector<bool> tempRegisters;
-	for (unsigned i = 0; i < 26; i++)
-	{
-		tempRegisters.push_back(false);
-	}
-
-	auto free_register = [&](int size = 1) {
-		for (int i = 0; i < 26; i++)
-		{
-			bool found = true;
-			for (int j = 0; j < size; j++)
-			{
-				if (tempRegisters[i + j])
-				{
-					found = false;
-					break;
-				}
-			}
-
-			if (found)
-				return i;
-		}
-
-		return -1;
-	};
-
-	for (unsigned i = 0; i < agal.size(); ++i) {
-		Agal& instruction = agal[i];
-
-		if (instruction.opcode == unknown) {
-			continue;
-		}
-
-		if (instruction.source1.type == Temporary) {
-			instruction.source1.number = currentlyUsed[instruction.source1.spirIndex];
-			if (i == lastUsed[instruction.source1.spirIndex]) {
-				for (int j = 0; j < instruction.source1.size; j++)
-					tempRegisters[currentlyUsed[instruction.source1.spirIndex] + j] = false;
-			}
-		}
-
-		if (instruction.source2.type == Temporary) {
-			instruction.source2.number = currentlyUsed[instruction.source2.spirIndex];
-			if (i == lastUsed[instruction.source2.spirIndex]) {
-				for (int j = 0; j < instruction.source2.size; j++)
-					tempRegisters[currentlyUsed[instruction.source2.spirIndex] + j] = false;
-			}
-		}
+	ConstantPool pool = packConstants(agal, assigned);
 
-		if (instruction.destination.type == Temporary) {
-			if (currentlyUsed.find(instruction.destination.spirIndex) == currentlyUsed.end()) {
-				int tmpRegister = free_register(instruction.destination.size);
-				//todo: handle out of temporaries
-
-				currentlyUsed[instruction.destination.spirIndex] = tmpRegister;
-
-				for (int j = 0; j < instruction.destination.size; ++j)
-					tempRegisters[tmpRegister + j] = true;
-			}
-
-			instruction.destination.number = currentlyUsed[instruction.destination.spirIndex];
-			if (i == lastUsed[instruction.destination.spirIndex]) {
-				for (int j = 0; j < instruction.destination.size; ++j)
-					tempRegisters[currentlyUsed[instruction.destination.spirIndex] + j] = false;
-			}
-		}
-	}
-
-	for (auto it = assigned.begin(); it != assigned.end(); ++it) {
-		if (names.find(it->first) != names.end()) {
-			if (it->second.type == Temporary)
-				it->second.number = currentlyUsed[it->second.spirIndex];
-		}
-	}
-
-	//Optimize
-
-	std::ofstream out;
-	out.open(filename, std::ios::binary | std::ios::out);
+	OutputFile out(filename);
 
 	out << "{\n";
 
@@ -1026,31 +1601,20 @@ void AgalTranslator::outputCode(const Target& target, const char* sourcefilename
 	}
 	out << "\n\t},\n";
 
-	out << "\t\"consts\": {\n";
-	int counter = 0;
-	for (unsigned i = 0; i < constants.size(); ++i) {
-		if (!constants[i].hardCoded) {
-			break;
-		}
-		for (int j = 0; j < constants[i].size; ++j) { //fill all the registers to avoid overlap			
-			if (stage == StageVertex) {
-				out << "\t\t\"vc" << counter << "\": [";
-			}
-			else {
-				out << "\t\t\"fc" << counter << "\": [";
-			}
-
-			for (unsigned j = 0; j < constants[i].operands.size(); ++j) {
-				if (j != 0) out << ", ";
-				out << constants[i].operands[j];
-			}
-			out << "]";
-
-			if (i < constants.size() - 1 && constants[i+1].hardCoded) out << ",";
-			out << "\n";
-			++counter;
-		}
+	if (stage == StageVertex && !clipSpaceFixup) {
+		out << "\t\"projection\": \"" << clipSpaceProjection << "\",\n";
+	}
 
+	out << "\t\"consts\": {\n";
+	for (unsigned i = 0; i < pool.registers.size(); ++i) {
+		out << "\t\t\"" << (stage == StageVertex ? "vc" : "fc") << i << "\": [";
+		for (unsigned j = 0; j < 4; ++j) {
+			if (j != 0) out << ", ";
+			out << pool.registers[i][j];
+		}
+		out << "]";
+		if (i < pool.registers.size() - 1) out << ",";
+		out << "\n";
 	}
 	out << "\t},\n";
 
@@ -1123,4 +1687,22 @@ void AgalTranslator::outputCode(const Target& target, const char* sourcefilename
 	out << "}\n";
 
 	out.close();
+
+	if (bytecode) {
+		OutputFile binary(std::string(filename) + ".bin");
+
+		writeShort(binary, 0);
+		writeShort(binary, (unsigned)pool.registers.size());
+		for (unsigned i = 0; i < pool.registers.size(); ++i) {
+			for (unsigned j = 0; j < 4; ++j) {
+				float value = (float)atof(pool.registers[i][j].c_str());
+				unsigned word;
+				memcpy(&word, &value, 4);
+				writeInt(binary, word);
+			}
+		}
+
+		writeBytecode(binary, agal, stage, agalVersion(target));
+		binary.close();
+	}
 }
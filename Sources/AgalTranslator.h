@@ -4,9 +4,18 @@
 #include <SPIRV/GLSL.std.450.h>
 
 namespace krafix {
+	// Targets AGAL 2 or 3 when the target version is 2 or 3 and AGAL 1 otherwise,
+	// shaders which need more temporary registers than the version provides fail.
 	class AgalTranslator : public Translator {
 	public:
-		AgalTranslator(std::vector<unsigned>& spirv, ShaderStage stage) : Translator(spirv, stage) {}
+		AgalTranslator(std::vector<unsigned>& spirv, ShaderStage stage, bool bytecode, bool clipSpaceFixup) : Translator(spirv, stage), bytecode(bytecode), clipSpaceFixup(clipSpaceFixup) {}
 		void outputCode(const Target& target, const char* sourcefilename, const char* filename, char* output, std::map<std::string, int>& attributes) override;
+
+	private:
+		// Also writes filename.bin - the first constant register and the number of constant registers
+		// as 16 bit values, four floats per constant register and then the assembled AGAL program.
+		// Everything is little endian.
+		bool bytecode;
+		bool clipSpaceFixup;
 	};
 }
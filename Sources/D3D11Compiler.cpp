@@ -10,6 +10,7 @@
 #include <fstream>
 #include <iostream>
 #include <strstream>
+#include "OutputFile.h"
 #endif
 
 namespace {
@@ -87,7 +88,7 @@ int compileHLSLToD3D11(const char* fromRelative, const char* to, const char* sou
 	if (hr != S_OK) hr = D3DCompile(data, length, from, nullptr, nullptr, "main", shaderString(stage, 5), flags, 0, &shaderBuffer, &errorMessage);
 	if (hr == S_OK) {
 		std::ostream* file;
-		std::ofstream actualfile;
+		krafix::OutputFile actualfile(output ? std::string() : std::string(to));
 		std::ostrstream arrayout(output, 1024 * 1024);
 		*outputlength = 0;
 
@@ -95,7 +96,6 @@ int compileHLSLToD3D11(const char* fromRelative, const char* to, const char* sou
 			file = &arrayout;
 		}
 		else {
-			actualfile.open(to, std::ios_base::binary);
 			file = &actualfile;
 		}
 
@@ -9,6 +9,7 @@
 #include <d3dx9.h>
 #include <fstream>
 #include <iostream>
+#include "OutputFile.h"
 
 typedef HRESULT (WINAPI *D3DXCompileShaderFromFileAType)(LPCSTR pSrcFile, CONST D3DXMACRO* pDefines, LPD3DXINCLUDE pInclude, LPCSTR pFunctionName, LPCSTR pProfile,
 	DWORD Flags, LPD3DXBUFFER* ppShader, LPD3DXBUFFER* ppErrorMsgs, LPD3DXCONSTANTTABLE* ppConstantTable);
@@ -34,7 +35,7 @@ int compileHLSLToD3D9(const char* from, const char* to, const char* source, char
 	if (FAILED(hr)) hr = CompileShaderFromFileA(from, nullptr, nullptr, "main", stage == EShLangVertex ? "vs_3_0" : "ps_3_0", 0, &shader, &errors, &table);
 	if (errors != nullptr) std::cerr << (char*)errors->GetBufferPointer();
 	if (!FAILED(hr)) {
-		std::ofstream file(to, std::ios_base::binary);
+		krafix::OutputFile file(to);
 
 		file.put((char)attributes.size());
 		for (std::map<std::string, int>::const_iterator attribute = attributes.begin(); attribute != attributes.end(); ++attribute) {
@@ -0,0 +1,272 @@
+#include "GlslMinifier.h"
+#include <map>
+#include <set>
+#include <string.h>
+#include <vector>
+
+using namespace krafix;
+
+namespace {
+	enum TokenKind {
+		WordToken,
+		NumberToken,
+		OperatorToken,
+		DirectiveToken
+	};
+
+	struct Token {
+		TokenKind kind;
+		std::string text;
+	};
+
+	const char* longOperators[] = { "<<=", ">>=", "++", "--", "+=", "-=", "*=", "/=", "%=", "<<", ">>", "<=", ">=", "==", "!=", "&&", "||", "^^", "&=", "|=", "^=" };
+
+	// Keywords, types and the short built-in functions, generated names have to avoid all of them
+	const std::set<std::string> reserved = {
+		"attribute", "const", "uniform", "varying", "buffer", "shared", "coherent", "volatile", "restrict", "readonly", "writeonly",
+		"layout", "centroid", "flat", "smooth", "noperspective", "patch", "sample", "break", "continue", "do", "for", "while",
+		"switch", "case", "default", "if", "else", "subroutine", "in", "out", "inout", "true", "false", "invariant", "precise",
+		"discard", "return", "lowp", "mediump", "highp", "precision", "struct", "void", "bool", "int", "uint", "float", "double",
+		"asm", "class", "union", "enum", "typedef", "template", "this", "goto", "inline", "noinline", "public", "static", "extern",
+		"external", "interface", "long", "short", "half", "fixed", "unsigned", "superp", "input", "output", "filter", "sizeof",
+		"cast", "namespace", "using", "common", "partition", "active", "resource", "main",
+		"abs", "all", "any", "cos", "dot", "exp", "fma", "log", "max", "min", "mix", "mod", "not", "pow", "sin", "tan",
+		"acos", "asin", "atan", "ceil", "cosh", "dFdx", "dFdy", "exp2", "log2", "modf", "sign", "sinh", "sqrt", "step", "tanh"
+	};
+
+	bool isWordStart(char c) {
+		return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+	}
+
+	bool isDigit(char c) {
+		return c >= '0' && c <= '9';
+	}
+
+	bool isWordChar(char c) {
+		return isWordStart(c) || isDigit(c);
+	}
+
+	bool hasPrefix(const std::string& word, const char* prefix) {
+		return word.compare(0, strlen(prefix), prefix) == 0;
+	}
+
+	bool isBuiltinType(const std::string& word) {
+		if (word == "void" || word == "bool" || word == "int" || word == "uint" || word == "float" || word == "double" || word == "atomic_uint") return true;
+		const char* vectors[] = { "vec", "bvec", "ivec", "uvec", "dvec", "mat", "dmat" };
+		for (auto prefix : vectors) {
+			size_t length = strlen(prefix);
+			if (hasPrefix(word, prefix) && word.size() > length && word[length] >= '2' && word[length] <= '4') {
+				if (word.size() == length + 1) return true;
+				if (prefix[strlen(prefix) - 1] == 't' && word.size() == length + 3 && word[length + 1] == 'x') return true;
+			}
+		}
+		const char* opaque[] = { "sampler", "isampler", "usampler", "image", "iimage", "uimage" };
+		for (auto prefix : opaque) {
+			if (hasPrefix(word, prefix) && word.size() > strlen(prefix) && isWordChar(word[strlen(prefix)]) && !hasPrefix(word, "imageLoad")
+				&& !hasPrefix(word, "imageStore") && !hasPrefix(word, "imageSize") && !hasPrefix(word, "imageAtomic")) return true;
+		}
+		return false;
+	}
+
+	bool isStorageQualifier(const std::string& word) {
+		return word == "uniform" || word == "in" || word == "out" || word == "attribute" || word == "varying" || word == "buffer" || word == "shared";
+	}
+
+	std::vector<Token> tokenize(const std::string& glsl) {
+		std::vector<Token> tokens;
+		bool lineStart = true;
+		size_t i = 0;
+		while (i < glsl.size()) {
+			char c = glsl[i];
+			if (c == '\n') {
+				lineStart = true;
+				++i;
+				continue;
+			}
+			if (c == ' ' || c == '\t' || c == '\r') {
+				++i;
+				continue;
+			}
+			if (glsl.compare(i, 2, "//") == 0) {
+				i = glsl.find('\n', i);
+				if (i == std::string::npos) i = glsl.size();
+				continue;
+			}
+			if (glsl.compare(i, 2, "/*") == 0) {
+				size_t end = glsl.find("*/", i + 2);
+				i = end == std::string::npos ? glsl.size() : end + 2;
+				continue;
+			}
+			Token token;
+			size_t start = i;
+			if (c == '#' && lineStart) {
+				// Directives continue over escaped line ends
+				for (;;) {
+					i = glsl.find('\n', i);
+					if (i == std::string::npos) {
+						i = glsl.size();
+						break;
+					}
+					if (glsl[i - 1] != '\\') break;
+					++i;
+				}
+				token.kind = DirectiveToken;
+				token.text = glsl.substr(start, i - start);
+				while (token.text.size() > 0 && (token.text.back() == ' ' || token.text.back() == '\t' || token.text.back() == '\r')) token.text.pop_back();
+				tokens.push_back(token);
+				continue;
+			}
+			lineStart = false;
+			if (isWordStart(c)) {
+				while (i < glsl.size() && isWordChar(glsl[i])) ++i;
+				token.kind = WordToken;
+			}
+			else if (isDigit(c) || (c == '.' && i + 1 < glsl.size() && isDigit(glsl[i + 1]))) {
+				bool hex = glsl.compare(i, 2, "0x") == 0 || glsl.compare(i, 2, "0X") == 0;
+				while (i < glsl.size()) {
+					char d = glsl[i];
+					if (isWordChar(d) || d == '.') ++i;
+					else if ((d == '+' || d == '-') && !hex && (glsl[i - 1] == 'e' || glsl[i - 1] == 'E')) ++i;
+					else break;
+				}
+				token.kind = NumberToken;
+			}
+			else {
+				size_t length = 1;
+				for (auto op : longOperators) {
+					if (strlen(op) > length && glsl.compare(i, strlen(op), op) == 0) length = strlen(op);
+				}
+				i += length;
+				token.kind = OperatorToken;
+			}
+			token.text = glsl.substr(start, i - start);
+			tokens.push_back(token);
+		}
+		return tokens;
+	}
+
+	bool endsDeclarator(const Token& token) {
+		return token.kind == OperatorToken && (token.text == "=" || token.text == ";" || token.text == "," || token.text == "(" || token.text == "[" || token.text == ")");
+	}
+
+	// Names for the index-th renamed identifier: a-z, A-Z, then longer ones
+	std::string shortName(unsigned index) {
+		const char* first = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+		const char* rest = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_";
+		std::string name(1, first[index % 52]);
+		index /= 52;
+		while (index > 0) {
+			--index;
+			name += rest[index % 63];
+			index /= 63;
+		}
+		return name;
+	}
+
+	bool needsSpace(const Token& previous, const Token& next) {
+		if (isWordChar(previous.text.back()) && isWordChar(next.text.front())) return true;
+		if (previous.kind != OperatorToken || next.kind != OperatorToken) return false;
+		std::string joined = std::string(1, previous.text.back()) + next.text.front();
+		for (auto op : longOperators) {
+			if (joined == op) return true;
+		}
+		return joined == "//" || joined == "/*";
+	}
+}
+
+std::string krafix::minifyGlsl(const std::string& glsl) {
+	std::vector<Token> tokens = tokenize(glsl);
+
+	// Find the declared names and which occurrences of names may be renamed
+	std::set<std::string> declared;
+	std::set<std::string> preserved;
+	std::set<std::string> structs;
+	std::vector<bool> renamable(tokens.size(), false);
+	std::vector<bool> breakAfter(tokens.size(), false);
+	int depth = 0;
+	int parens = 0;
+	bool interfaceStatement = false;
+	bool structStatement = false;
+	bool memberBody = false;
+	for (size_t i = 0; i < tokens.size(); ++i) {
+		Token& token = tokens[i];
+		if (token.kind == DirectiveToken) continue;
+		if (token.kind == OperatorToken) {
+			if (token.text == "(") ++parens;
+			else if (token.text == ")") --parens;
+			else if (token.text == "{") {
+				if (depth == 0) memberBody = interfaceStatement || structStatement;
+				++depth;
+			}
+			else if (token.text == "}") {
+				--depth;
+				if (depth == 0 && !memberBody) {
+					breakAfter[i] = true;
+					interfaceStatement = structStatement = false;
+				}
+			}
+			else if (token.text == ";" && depth == 0 && parens == 0) {
+				breakAfter[i] = true;
+				interfaceStatement = structStatement = memberBody = false;
+			}
+			continue;
+		}
+		if (token.kind != WordToken) continue;
+
+		if (depth == 0 && parens == 0 && isStorageQualifier(token.text)) interfaceStatement = true;
+		if (token.text == "struct") {
+			structStatement = true;
+			if (i + 1 < tokens.size() && tokens[i + 1].kind == WordToken) structs.insert(tokens[i + 1].text);
+		}
+		if (interfaceStatement) {
+			preserved.insert(token.text);
+			continue;
+		}
+		if (depth > 0 && memberBody) continue;
+
+		const Token* previous = i > 0 ? &tokens[i - 1] : nullptr;
+		if (previous != nullptr && previous->kind == OperatorToken && previous->text == ".") continue;
+		renamable[i] = true;
+		if (previous != nullptr && previous->kind == WordToken && (isBuiltinType(previous->text) || structs.count(previous->text) > 0)
+			&& i + 1 < tokens.size() && endsDeclarator(tokens[i + 1]) && reserved.count(token.text) == 0) {
+			declared.insert(token.text);
+		}
+	}
+
+	// Every name which stays has to be avoided by the new names
+	std::set<std::string> used = reserved;
+	for (size_t i = 0; i < tokens.size(); ++i) {
+		if (tokens[i].kind == DirectiveToken) {
+			for (auto& word : tokenize(tokens[i].text.substr(1))) used.insert(word.text);
+		}
+		else if (tokens[i].kind == WordToken && (!renamable[i] || declared.count(tokens[i].text) == 0 || preserved.count(tokens[i].text) > 0)) {
+			used.insert(tokens[i].text);
+		}
+	}
+
+	std::map<std::string, std::string> names;
+	unsigned next = 0;
+	for (size_t i = 0; i < tokens.size(); ++i) {
+		Token& token = tokens[i];
+		if (token.kind != WordToken || !renamable[i] || declared.count(token.text) == 0 || preserved.count(token.text) > 0 || token.text == "main") continue;
+		auto name = names.find(token.text);
+		if (name == names.end()) {
+			std::string shortened;
+			do {
+				shortened = shortName(next++);
+			} while (used.count(shortened) > 0 || shortened.find("__") != std::string::npos);
+			name = names.insert(std::make_pair(token.text, shortened)).first;
+		}
+		token.text = name->second;
+	}
+
+	std::string minified;
+	for (size_t i = 0; i < tokens.size(); ++i) {
+		if (i > 0) {
+			if (tokens[i].kind == DirectiveToken || tokens[i - 1].kind == DirectiveToken || breakAfter[i - 1]) minified += '\n';
+			else if (needsSpace(tokens[i - 1], tokens[i])) minified += ' ';
+		}
+		minified += tokens[i].text;
+	}
+	return minified + "\n";
+}
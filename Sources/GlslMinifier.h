@@ -0,0 +1,11 @@
+#pragma once
+
+#include <string>
+
+namespace krafix {
+	// Strips comments and whitespace from GLSL and gives the functions, parameters, locals and
+	// temporaries it declares short names in the order they first appear, so equal programs
+	// produce equal text. Names of the interface (uniforms, uniform blocks and their members,
+	// inputs and outputs), struct members, built-ins and main stay the same.
+	std::string minifyGlsl(const std::string& glsl);
+}
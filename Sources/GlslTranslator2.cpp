@@ -1,5 +1,7 @@
 #include "GlslTranslator2.h"
 #include "../SPIRV-Cross/spirv_glsl.hpp"
+#include "GlslMinifier.h"
+#include "OutputFile.h"
 #include <fstream>
 
 using namespace krafix;
@@ -45,12 +47,12 @@ void GlslTranslator2::outputCode(const Target& target, const char* sourcefilenam
 	compiler->set_options(opts);
 
 	std::string glsl = compiler->compile();
+	if (minify) glsl = minifyGlsl(glsl);
 	if (output) {
 		strcpy(output, glsl.c_str());
 	}
 	else {
-		std::ofstream out;
-		out.open(filename, std::ios::binary | std::ios::out);
+		OutputFile out(filename);
 		out << glsl;
 		out.close();
 	}
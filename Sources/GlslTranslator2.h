@@ -5,9 +5,10 @@
 namespace krafix {
 	class GlslTranslator2 : public Translator {
 	public:
-		GlslTranslator2(std::vector<unsigned>& spirv, ShaderStage stage, bool relax) : Translator(spirv, stage), relax(relax) {}
+		GlslTranslator2(std::vector<unsigned>& spirv, ShaderStage stage, bool relax, bool minify) : Translator(spirv, stage), relax(relax), minify(minify) {}
 		void outputCode(const Target& target, const char* sourcefilename, const char* filename, char* output, std::map<std::string, int>& attributes) override;
 	private:
 		bool relax;
+		bool minify;
 	};
 }
@@ -0,0 +1,334 @@
+#include "HalfPrecision.h"
+#include <SPIRV/spirv.hpp>
+#include <SPIRV/GLSL.std.450.h>
+#include <set>
+#include <sstream>
+
+using namespace krafix;
+
+namespace {
+	using namespace spv;
+
+	bool isHalfSafeExtInst(unsigned instruction) {
+		switch (instruction) {
+		case GLSLstd450FAbs:
+		case GLSLstd450Floor:
+		case GLSLstd450Ceil:
+		case GLSLstd450Fract:
+		case GLSLstd450Sin:
+		case GLSLstd450Cos:
+		case GLSLstd450Pow:
+		case GLSLstd450Exp:
+		case GLSLstd450Exp2:
+		case GLSLstd450Sqrt:
+		case GLSLstd450InverseSqrt:
+		case GLSLstd450FMin:
+		case GLSLstd450FMax:
+		case GLSLstd450FClamp:
+		case GLSLstd450FMix:
+		case GLSLstd450Step:
+		case GLSLstd450SmoothStep:
+		case GLSLstd450Length:
+		case GLSLstd450Normalize:
+		case GLSLstd450Reflect:
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	// Index of the first value operand of an arithmetic instruction which can be lowered, 0 otherwise
+	unsigned firstValueOperand(SpirVInstruction& inst, unsigned glslSet) {
+		switch (inst.opcode) {
+		case OpFNegate:
+		case OpFAdd:
+		case OpFSub:
+		case OpFMul:
+		case OpFDiv:
+		case OpFMod:
+		case OpVectorTimesScalar:
+		case OpDot:
+			return 2;
+		case OpExtInst:
+			if (inst.operands[2] == glslSet && isHalfSafeExtInst(inst.operands[3])) return 4;
+			return 0;
+		default:
+			return 0;
+		}
+	}
+
+	const char* interfaceKind(StorageClass storage, ShaderStage stage) {
+		switch (storage) {
+		case StorageClassInput:
+			return stage == StageVertex ? "attribute" : "varying";
+		case StorageClassOutput:
+			return stage == StageFragment ? "output" : "varying";
+		default:
+			return "local";
+		}
+	}
+
+	// Relaxed values of a module and the variables which can change their storage type
+	struct RelaxedValues {
+		RelaxedValues(SpirVModule& module) : floatType(0), glslSet(0) {
+			for (unsigned i = 0; i < module.instructions.size(); ++i) {
+				SpirVInstruction& inst = module.instructions[i];
+				switch (inst.opcode) {
+				case OpDecorate:
+					if (inst.operands[1] == DecorationRelaxedPrecision) relaxed.insert(inst.operands[0]);
+					if (inst.operands[1] == DecorationBuiltIn) builtins.insert(inst.operands[0]);
+					break;
+				case OpExtInstImport:
+					if (SpirVModule::readString(inst.operands, 1) == "GLSL.std.450") glslSet = inst.operands[0];
+					break;
+				case OpTypeFloat:
+					if (inst.operands[1] == 32 && floatType == 0) floatType = inst.operands[0];
+					break;
+				case OpTypeVector:
+					if (inst.operands[1] == floatType && floatType != 0) vectorSizes[inst.operands[0]] = inst.operands[2];
+					break;
+				case OpTypePointer:
+					pointers[inst.operands[0]] = std::make_pair((StorageClass)inst.operands[1], inst.operands[2]);
+					break;
+				}
+			}
+			if (floatType == 0 || relaxed.empty()) return;
+
+			for (unsigned i = 0; i < module.instructions.size(); ++i) {
+				SpirVInstruction& inst = module.instructions[i];
+				if (inst.opcode != OpVariable || inst.operands.size() > 3) continue;
+				unsigned id = inst.operands[1];
+				StorageClass storage = (StorageClass)inst.operands[2];
+				if (storage != StorageClassInput && storage != StorageClassOutput && storage != StorageClassFunction && storage != StorageClassPrivate) continue;
+				if (relaxed.find(id) == relaxed.end() || builtins.find(id) != builtins.end()) continue;
+				if (!isFloat(pointers[inst.operands[0]].second)) continue;
+				lowerable.insert(id);
+				storages[id] = storage;
+			}
+
+			for (auto id : lowerable) pointerRoots[id] = id;
+			for (unsigned i = module.functionsStart(); i < module.instructions.size(); ++i) {
+				SpirVInstruction& inst = module.instructions[i];
+				if (inst.opcode == OpLoad) {
+					continue;
+				}
+				if (inst.opcode == OpStore) {
+					auto root = pointerRoots.find(inst.operands[1]);
+					if (root != pointerRoots.end()) lowerable.erase(root->second);
+					continue;
+				}
+				if (inst.opcode == OpAccessChain && pointerRoots.find(inst.operands[2]) != pointerRoots.end()) {
+					pointerRoots[inst.operands[1]] = pointerRoots[inst.operands[2]];
+					for (unsigned i2 = 3; i2 < inst.operands.size(); ++i2) {
+						auto root = pointerRoots.find(inst.operands[i2]);
+						if (root != pointerRoots.end()) lowerable.erase(root->second);
+					}
+					continue;
+				}
+				for (unsigned i2 = 0; i2 < inst.operands.size(); ++i2) {
+					auto root = pointerRoots.find(inst.operands[i2]);
+					if (root != pointerRoots.end()) lowerable.erase(root->second);
+				}
+			}
+		}
+
+		bool isFloat(unsigned type) {
+			return type == floatType || vectorSizes.find(type) != vectorSizes.end();
+		}
+
+		// Names of the lowerable variables of a storage class
+		std::set<std::string> lowerableNames(SpirVModule& module, StorageClass storage) {
+			std::map<unsigned, std::string> names = module.names();
+			std::set<std::string> found;
+			for (auto id : lowerable) {
+				if (storages[id] == storage && names.find(id) != names.end()) found.insert(names[id]);
+			}
+			return found;
+		}
+
+		std::set<unsigned> relaxed;
+		std::set<unsigned> builtins;
+		unsigned floatType;
+		unsigned glslSet;
+		std::map<unsigned, unsigned> vectorSizes;
+		std::map<unsigned, std::pair<StorageClass, unsigned>> pointers;
+		std::set<unsigned> lowerable;
+		std::map<unsigned, StorageClass> storages;
+		std::map<unsigned, unsigned> pointerRoots;
+	};
+}
+
+std::set<std::string> krafix::halfVaryings(SpirVModule& vertex, SpirVModule& fragment) {
+	std::set<std::string> outputs = RelaxedValues(vertex).lowerableNames(vertex, StorageClassOutput);
+	std::set<std::string> inputs = RelaxedValues(fragment).lowerableNames(fragment, StorageClassInput);
+	std::set<std::string> varyings;
+	for (auto& name : outputs) {
+		if (inputs.find(name) != inputs.end()) varyings.insert(name);
+	}
+	return varyings;
+}
+
+void krafix::lowerRelaxedPrecision(SpirVModule& module, ShaderStage stage, const std::set<std::string>& varyings, std::vector<std::string>& report) {
+	RelaxedValues values(module);
+	std::set<unsigned>& relaxed = values.relaxed;
+	unsigned floatType = values.floatType;
+	unsigned glslSet = values.glslSet;
+	std::map<unsigned, unsigned>& vectorSizes = values.vectorSizes;
+	std::map<unsigned, std::pair<StorageClass, unsigned>>& pointers = values.pointers;
+	std::set<unsigned>& lowerable = values.lowerable;
+	std::map<unsigned, unsigned>& pointerRoots = values.pointerRoots;
+	std::map<unsigned, unsigned> resultTypes = module.resultTypes();
+	std::map<unsigned, std::string> names = module.names();
+
+	if (floatType == 0 || relaxed.empty()) return;
+
+	auto isFloat = [&](unsigned type) {
+		return values.isFloat(type);
+	};
+
+	// Both stages have to agree on the types of the varyings, all other inputs and outputs stay 32 bit
+	for (auto id : std::set<unsigned>(lowerable)) {
+		StorageClass storage = values.storages[id];
+		if (storage != StorageClassInput && storage != StorageClassOutput) continue;
+		bool varying = (stage == StageVertex && storage == StorageClassOutput) || (stage == StageFragment && storage == StorageClassInput);
+		if (!varying || names.find(id) == names.end() || varyings.find(names[id]) == varyings.end()) lowerable.erase(id);
+	}
+
+	// Half versions of the float types and of the pointers used by lowered variables
+	unsigned halfType = module.newId();
+	std::map<unsigned, unsigned> halfTypes;
+	halfTypes[floatType] = halfType;
+	for (auto vector : vectorSizes) halfTypes[vector.first] = module.newId();
+	std::map<unsigned, unsigned> halfPointers;
+	bool interfaceLowered = false;
+	for (auto root : pointerRoots) {
+		if (lowerable.find(root.second) == lowerable.end()) continue;
+		unsigned pointerType = resultTypes[root.first];
+		if (halfPointers.find(pointerType) == halfPointers.end()) halfPointers[pointerType] = module.newId();
+		StorageClass storage = pointers[pointerType].first;
+		if (storage == StorageClassInput || storage == StorageClassOutput) interfaceLowered = true;
+	}
+
+	for (auto id : lowerable) {
+		std::stringstream line;
+		line << (names.find(id) != names.end() ? names[id] : "_" + std::to_string(id)) << " (" << interfaceKind(pointers[resultTypes[id]].first, stage) << ")";
+		report.push_back(line.str());
+	}
+
+	std::vector<SpirVInstruction> instructions;
+	std::map<unsigned, unsigned> halfValues;
+	std::map<unsigned, unsigned> blockConversions;
+	unsigned loweredArithmetic = 0;
+	bool capabilitiesAdded = false;
+
+	auto getHalf = [&](unsigned value) {
+		if (halfValues.find(value) != halfValues.end()) return halfValues[value];
+		if (blockConversions.find(value) != blockConversions.end()) return blockConversions[value];
+		unsigned half = module.newId();
+		instructions.push_back(SpirVInstruction(OpFConvert, { halfTypes[resultTypes[value]], half, value }));
+		blockConversions[value] = half;
+		return half;
+	};
+
+	auto isLoweredPointer = [&](unsigned pointer) {
+		auto root = pointerRoots.find(pointer);
+		return root != pointerRoots.end() && lowerable.find(root->second) != lowerable.end();
+	};
+
+	for (unsigned i = 0; i < module.instructions.size(); ++i) {
+		SpirVInstruction inst = module.instructions[i];
+
+		if (inst.opcode == OpCapability) {
+			instructions.push_back(inst);
+			if (!capabilitiesAdded && (i + 1 >= module.instructions.size() || module.instructions[i + 1].opcode != OpCapability)) {
+				instructions.push_back(SpirVInstruction(OpCapability, { CapabilityFloat16 }));
+				if (interfaceLowered) {
+					instructions.push_back(SpirVInstruction(OpCapability, { CapabilityStorageInputOutput16 }));
+					SpirVInstruction extension(OpExtension);
+					SpirVModule::appendString(extension.operands, "SPV_KHR_16bit_storage");
+					instructions.push_back(extension);
+				}
+				capabilitiesAdded = true;
+			}
+			continue;
+		}
+
+		switch (inst.opcode) {
+		case OpTypeFloat:
+			instructions.push_back(inst);
+			if (inst.operands[0] == floatType) instructions.push_back(SpirVInstruction(OpTypeFloat, { halfType, 16 }));
+			break;
+		case OpTypeVector:
+			instructions.push_back(inst);
+			if (halfTypes.find(inst.operands[0]) != halfTypes.end()) {
+				instructions.push_back(SpirVInstruction(OpTypeVector, { halfTypes[inst.operands[0]], halfType, inst.operands[2] }));
+			}
+			break;
+		case OpTypePointer:
+			instructions.push_back(inst);
+			if (halfPointers.find(inst.operands[0]) != halfPointers.end()) {
+				instructions.push_back(SpirVInstruction(OpTypePointer, { halfPointers[inst.operands[0]], inst.operands[1], halfTypes[inst.operands[2]] }));
+			}
+			break;
+		case OpVariable:
+		case OpAccessChain:
+			if (isLoweredPointer(inst.operands[1])) inst.operands[0] = halfPointers[inst.operands[0]];
+			instructions.push_back(inst);
+			break;
+		case OpLabel:
+			blockConversions.clear();
+			instructions.push_back(inst);
+			break;
+		case OpLoad:
+			if (isLoweredPointer(inst.operands[2])) {
+				unsigned type = inst.operands[0];
+				unsigned half = module.newId();
+				instructions.push_back(SpirVInstruction(OpLoad, { halfTypes[type], half, inst.operands[2] }));
+				instructions.push_back(SpirVInstruction(OpFConvert, { type, inst.operands[1], half }));
+				halfValues[inst.operands[1]] = half;
+			}
+			else {
+				instructions.push_back(inst);
+			}
+			break;
+		case OpStore:
+			if (isLoweredPointer(inst.operands[0])) {
+				unsigned half = getHalf(inst.operands[1]);
+				instructions.push_back(SpirVInstruction(OpStore, { inst.operands[0], half }));
+			}
+			else {
+				instructions.push_back(inst);
+			}
+			break;
+		default: {
+			unsigned first = firstValueOperand(inst, glslSet);
+			bool lower = first > 0 && relaxed.find(inst.operands[1]) != relaxed.end() && isFloat(inst.operands[0]);
+			for (unsigned i2 = first; lower && i2 < inst.operands.size(); ++i2) {
+				lower = isFloat(resultTypes[inst.operands[i2]]);
+			}
+			if (lower) {
+				SpirVInstruction half(inst.opcode, inst.operands);
+				half.operands[0] = halfTypes[inst.operands[0]];
+				half.operands[1] = module.newId();
+				for (unsigned i2 = first; i2 < inst.operands.size(); ++i2) {
+					half.operands[i2] = getHalf(inst.operands[i2]);
+				}
+				instructions.push_back(half);
+				instructions.push_back(SpirVInstruction(OpFConvert, { inst.operands[0], inst.operands[1], half.operands[1] }));
+				halfValues[inst.operands[1]] = half.operands[1];
+				++loweredArithmetic;
+			}
+			else {
+				instructions.push_back(inst);
+			}
+			break;
+		}
+		}
+	}
+
+	module.instructions = instructions;
+
+	if (loweredArithmetic > 0) {
+		report.push_back(std::to_string(loweredArithmetic) + " arithmetic instructions");
+	}
+}
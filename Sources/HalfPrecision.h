@@ -0,0 +1,18 @@
+#pragma once
+
+#include "SpirVModule.h"
+#include "Translator.h"
+#include <set>
+
+namespace krafix {
+	// Names of the varyings which can be lowered in the vertex shader's outputs as well as
+	// in the fragment shader's inputs, only those may use 16 bit types in a linked pipeline.
+	std::set<std::string> halfVaryings(SpirVModule& vertex, SpirVModule& fragment);
+
+	// Rewrites RelaxedPrecision decorated float values to 16 bit floats so that SPIRV-Cross
+	// emits half (Metal) or min16float (HLSL) for them. Local variables are only lowered when
+	// they are exclusively accessed via loads, stores and access chains, inputs and outputs
+	// additionally have to be varyings listed in varyings. Appends a description of every
+	// lowered value to report.
+	void lowerRelaxedPrecision(SpirVModule& module, ShaderStage stage, const std::set<std::string>& varyings, std::vector<std::string>& report);
+}
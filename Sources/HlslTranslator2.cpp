@@ -1,5 +1,7 @@
 #include "HlslTranslator2.h"
+#include "HalfPrecision.h"
 #include "../SPIRV-Cross/spirv_hlsl.hpp"
+#include "OutputFile.h"
 #include <fstream>
 #include <algorithm>
 
@@ -22,12 +24,21 @@ void HlslTranslator2::outputCode(const Target& target, const char* sourcefilenam
 		}
 	}
 
+	// min16float needs shader model 4
+	if (halfPrecision && target.version > 9) {
+		SpirVModule module(spirv);
+		std::vector<std::string> lowered;
+		lowerRelaxedPrecision(module, stage, halfVaryings, lowered);
+		module.write(spirv);
+		for (auto value : lowered) printf("Lowered to min16float: %s\n", value.c_str());
+	}
+
 	spirv_cross::CompilerHLSL* compiler = new spirv_cross::CompilerHLSL(spirv);
 
 	compiler->set_entry_point("main");
 
 	spirv_cross::CompilerGLSL::Options glslOpts = compiler->CompilerGLSL::get_options();
-	glslOpts.vertex.fixup_clipspace = true;
+	glslOpts.vertex.fixup_clipspace = clipSpaceFixup;
 	compiler->CompilerGLSL::set_options(glslOpts);
 	
 	spirv_cross::CompilerHLSL::Options opts = compiler->get_options();
@@ -40,12 +51,14 @@ void HlslTranslator2::outputCode(const Target& target, const char* sourcefilenam
 	compiler->set_options(opts);
 
 	std::string hlsl = compiler->compile();
+	if (stage == StageVertex && !clipSpaceFixup) {
+		hlsl = std::string("// projection: ") + clipSpaceProjection + "\n" + hlsl;
+	}
 	if (output) {
 		strcpy(output, hlsl.c_str());
 	}
 	else {
-		std::ofstream out;
-		out.open(filename, std::ios::binary | std::ios::out);
+		OutputFile out(filename);
 		out << hlsl;
 		out.close();
 	}
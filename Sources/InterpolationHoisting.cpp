@@ -0,0 +1,544 @@
+#include "InterpolationHoisting.h"
+#include "SpirVOptimizer.h"
+#include <SPIRV/spirv.hpp>
+#include <algorithm>
+#include <set>
+
+using namespace krafix;
+
+namespace {
+	using namespace spv;
+
+	enum ValueKind {
+		KindConstant,
+		KindUniform,
+		KindAffine
+	};
+
+	struct FloatType {
+		unsigned components;
+		unsigned rows;
+
+		bool operator==(const FloatType& other) const {
+			return components == other.components && rows == other.rows;
+		}
+	};
+
+	struct ShaderInterface {
+		ShaderInterface(SpirVModule& module) {
+			names = module.names();
+			std::map<unsigned, unsigned> pointees;
+			std::set<unsigned> builtins;
+			std::set<unsigned> builtinBlocks;
+			std::set<unsigned> qualified;
+			unsigned functionsStart = module.functionsStart();
+			for (unsigned i = 0; i < functionsStart; ++i) {
+				SpirVInstruction& inst = module.instructions[i];
+				switch (inst.opcode) {
+				case OpDecorate:
+					if (inst.operands[1] == DecorationBuiltIn) builtins.insert(inst.operands[0]);
+					if (inst.operands[1] == DecorationFlat || inst.operands[1] == DecorationNoPerspective
+						|| inst.operands[1] == DecorationCentroid || inst.operands[1] == DecorationSample) qualified.insert(inst.operands[0]);
+					if (inst.operands[1] == DecorationLocation) locations[inst.operands[0]] = inst.operands[2];
+					break;
+				case OpMemberDecorate:
+					if (inst.operands[2] == DecorationBuiltIn) builtinBlocks.insert(inst.operands[0]);
+					break;
+				case OpTypeFloat:
+					if (inst.operands[1] == 32) floatTypes[inst.operands[0]] = { 1, 1 };
+					definitions[inst.operands[0]] = i;
+					break;
+				case OpTypeVector:
+					if (floatTypes.find(inst.operands[1]) != floatTypes.end()) floatTypes[inst.operands[0]] = { inst.operands[2], inst.operands[2] };
+					definitions[inst.operands[0]] = i;
+					break;
+				case OpTypeMatrix:
+					if (floatTypes.find(inst.operands[1]) != floatTypes.end()) {
+						unsigned rows = floatTypes[inst.operands[1]].components;
+						floatTypes[inst.operands[0]] = { rows * inst.operands[2], rows };
+					}
+					definitions[inst.operands[0]] = i;
+					break;
+				case OpTypePointer:
+					pointees[inst.operands[0]] = inst.operands[2];
+					break;
+				case OpConstant:
+				case OpConstantComposite:
+					if (floatTypes.find(inst.operands[0]) != floatTypes.end()) constants.insert(inst.operands[1]);
+					definitions[inst.operands[1]] = i;
+					break;
+				case OpVariable: {
+					unsigned id = inst.operands[1];
+					unsigned type = pointees[inst.operands[0]];
+					variables[id] = type;
+					definitions[id] = i;
+					if (builtins.find(id) != builtins.end() || builtinBlocks.find(type) != builtinBlocks.end()) break;
+					if (inst.operands[2] == StorageClassInput) inputs.insert(id);
+					if (inst.operands[2] == StorageClassOutput) outputs.insert(id);
+					if (names.find(id) == names.end() || floatTypes.find(type) == floatTypes.end()) break;
+					if (inst.operands[2] == StorageClassInput && qualified.find(id) == qualified.end()) varyings[names[id]] = id;
+					if (inst.operands[2] == StorageClassOutput) varyings[names[id]] = id;
+					if (inst.operands[2] == StorageClassUniformConstant) uniforms[names[id]] = id;
+					break;
+				}
+				}
+			}
+		}
+
+		// Number of vec4 slots a value of the type occupies
+		unsigned slots(SpirVModule& module, unsigned type) {
+			if (floatTypes.find(type) != floatTypes.end()) return floatTypes[type].components / floatTypes[type].rows;
+			if (definitions.find(type) == definitions.end()) return 1;
+			SpirVInstruction& inst = module.instructions[definitions[type]];
+			if (inst.opcode == OpTypeMatrix) return inst.operands[2];
+			return 1;
+		}
+
+		// Number of vec4 slots of the interface variables which are used by any function
+		unsigned usedSlots(SpirVModule& module, const std::set<unsigned>& interfaceVariables) {
+			std::set<unsigned> used;
+			for (unsigned i = module.functionsStart(); i < module.instructions.size(); ++i) {
+				for (auto operand : module.instructions[i].operands) {
+					if (interfaceVariables.find(operand) != interfaceVariables.end()) used.insert(operand);
+				}
+			}
+			unsigned count = 0;
+			for (auto variable : used) count += slots(module, variables[variable]);
+			return count;
+		}
+
+		std::map<unsigned, std::string> names;
+		std::map<unsigned, unsigned> definitions;
+		std::map<unsigned, FloatType> floatTypes;
+		std::map<unsigned, unsigned> locations;
+		std::set<unsigned> constants;
+		// Global variables mapped to the types they point to
+		std::map<unsigned, unsigned> variables;
+		std::set<unsigned> inputs;
+		std::set<unsigned> outputs;
+		// Interpolated float inputs or float outputs by name
+		std::map<std::string, unsigned> varyings;
+		std::map<std::string, unsigned> uniforms;
+	};
+
+	bool isArithmetic(unsigned opcode) {
+		return opcode != OpCompositeExtract && opcode != OpCompositeConstruct && opcode != OpVectorShuffle;
+	}
+
+	bool isLiteralOperand(unsigned opcode, unsigned index) {
+		return (opcode == OpCompositeExtract && index >= 3) || (opcode == OpVectorShuffle && index >= 4);
+	}
+
+	// Kind of an instruction's result if interpolating it gives the same result as evaluating it per fragment
+	bool classify(SpirVInstruction& inst, std::map<unsigned, ValueKind>& kinds, ValueKind& kind) {
+		bool multiplicative = false;
+		switch (inst.opcode) {
+		case OpFNegate:
+		case OpFAdd:
+		case OpFSub:
+		case OpTranspose:
+		case OpCompositeConstruct:
+		case OpCompositeExtract:
+		case OpVectorShuffle:
+			break;
+		case OpFMul:
+		case OpFDiv:
+		case OpVectorTimesScalar:
+		case OpMatrixTimesScalar:
+		case OpMatrixTimesVector:
+		case OpVectorTimesMatrix:
+		case OpMatrixTimesMatrix:
+		case OpDot:
+			multiplicative = true;
+			break;
+		default:
+			return false;
+		}
+
+		kind = KindConstant;
+		unsigned affine = 0;
+		for (unsigned i = 2; i < inst.operands.size(); ++i) {
+			if (isLiteralOperand(inst.opcode, i)) continue;
+			auto operand = kinds.find(inst.operands[i]);
+			if (operand == kinds.end()) return false;
+			kind = std::max(kind, operand->second);
+			if (operand->second == KindAffine) ++affine;
+		}
+		if (multiplicative && affine > 1) return false;
+		if (inst.opcode == OpFDiv && kinds[inst.operands[3]] == KindAffine) return false;
+		return true;
+	}
+
+	std::string interpolatedName(unsigned index) {
+		return "_k_interpolated" + std::to_string(index);
+	}
+
+	// Replaces the given values of the fragment shader by loads of new inputs
+	std::vector<unsigned> replaceByInputs(SpirVModule& fragment, const std::vector<unsigned>& values, std::map<unsigned, unsigned>& indices,
+		std::map<unsigned, unsigned>& resultTypes, const std::set<unsigned>& varyings) {
+		std::vector<unsigned> variables;
+		for (auto value : values) {
+			variables.push_back(fragment.newId());
+			fragment.instructions[indices[value]] = SpirVInstruction(OpLoad, { resultTypes[value], value, variables.back() });
+		}
+		for (unsigned i = 0; i < values.size(); ++i) {
+			unsigned pointer = fragment.pointerType(StorageClassInput, resultTypes[values[i]]);
+			fragment.addGlobal(SpirVInstruction(OpVariable, { pointer, variables[i], StorageClassInput }));
+			fragment.addName(variables[i], interpolatedName(i));
+			fragment.addInterfaceVariable(variables[i]);
+		}
+		removeDeadCode(fragment);
+		removeUnusedVariables(fragment, varyings);
+		return variables;
+	}
+
+	// Turns an output which is no longer read by the next stage into a plain global variable
+	void demoteToPrivate(SpirVModule& module, unsigned variable) {
+		std::map<unsigned, unsigned> pointees;
+		std::set<unsigned> pointers = { variable };
+		unsigned functionsStart = module.functionsStart();
+		for (unsigned i = 0; i < module.instructions.size(); ++i) {
+			SpirVInstruction& inst = module.instructions[i];
+			if (inst.opcode == OpTypePointer) pointees[inst.operands[0]] = inst.operands[2];
+			if (i >= functionsStart && (inst.opcode == OpAccessChain || inst.opcode == OpInBoundsAccessChain) && pointers.find(inst.operands[2]) != pointers.end()) {
+				pointers.insert(inst.operands[1]);
+			}
+		}
+
+		SpirVInstruction declaration(OpVariable);
+		std::vector<SpirVInstruction> instructions;
+		for (unsigned i = 0; i < module.instructions.size(); ++i) {
+			SpirVInstruction& inst = module.instructions[i];
+			if (inst.opcode == OpVariable && inst.operands[1] == variable) declaration = inst;
+			else if (inst.opcode == OpDecorate && inst.operands[0] == variable && inst.operands[1] == DecorationLocation) continue;
+			else instructions.push_back(inst);
+		}
+		module.instructions = instructions;
+
+		std::map<unsigned, unsigned> privatePointers;
+		privatePointers[declaration.operands[0]] = 0;
+		for (unsigned i = module.functionsStart(); i < module.instructions.size(); ++i) {
+			SpirVInstruction& inst = module.instructions[i];
+			if (SpirVModule::hasResultType(inst.opcode) && pointers.find(inst.operands[1]) != pointers.end()) privatePointers[inst.operands[0]] = 0;
+		}
+		for (auto& pointer : privatePointers) {
+			pointer.second = module.pointerType(StorageClassPrivate, pointees[pointer.first]);
+		}
+
+		declaration.operands[0] = privatePointers[declaration.operands[0]];
+		declaration.operands[2] = StorageClassPrivate;
+		module.addGlobal(declaration);
+		for (unsigned i = module.functionsStart(); i < module.instructions.size(); ++i) {
+			SpirVInstruction& inst = module.instructions[i];
+			if (SpirVModule::hasResultType(inst.opcode) && pointers.find(inst.operands[1]) != pointers.end()) inst.operands[0] = privatePointers[inst.operands[0]];
+		}
+		module.removeInterfaceVariable(variable);
+	}
+
+	// Moves everything the vertex shader does with an output to a private variable, which keeps the id,
+	// and declares a new output with the name and decorations of the old one. Written values can then be
+	// read back, AGAL for example can not read its outputs.
+	void privateCopy(SpirVModule& module, ShaderInterface& interface, unsigned output) {
+		unsigned copy = module.newId();
+		for (auto& inst : module.instructions) {
+			if ((inst.opcode == OpName || inst.opcode == OpDecorate) && inst.operands[0] == output) inst.operands[0] = copy;
+		}
+		demoteToPrivate(module, output);
+		unsigned pointer = module.pointerType(StorageClassOutput, interface.variables[output]);
+		module.addGlobal(SpirVInstruction(OpVariable, { pointer, copy, StorageClassOutput }));
+		module.addInterfaceVariable(copy);
+
+		interface.variables[copy] = interface.variables[output];
+		interface.outputs.erase(output);
+		interface.outputs.insert(copy);
+		interface.varyings[interface.names[output]] = copy;
+		interface.names[copy] = interface.names[output];
+	}
+
+	// Recreates fragment shader values in the vertex shader
+	class VertexEmitter {
+	public:
+		VertexEmitter(SpirVModule& vertex, ShaderInterface& vertexInterface, SpirVModule& fragment, ShaderInterface& fragmentInterface)
+			: vertex(vertex), vertexInterface(vertexInterface), fragment(fragment), fragmentInterface(fragmentInterface) {}
+
+		unsigned type(const FloatType& floatType) {
+			for (auto type : vertexInterface.floatTypes) {
+				if (type.second == floatType) return type.first;
+			}
+			unsigned id = vertex.newId();
+			if (floatType.components == 1) {
+				vertex.addGlobal(SpirVInstruction(OpTypeFloat, { id, 32 }));
+			}
+			else if (floatType.components == floatType.rows) {
+				vertex.addGlobal(SpirVInstruction(OpTypeVector, { id, type({ 1, 1 }), floatType.components }));
+			}
+			else {
+				vertex.addGlobal(SpirVInstruction(OpTypeMatrix, { id, type({ floatType.rows, floatType.rows }), floatType.components / floatType.rows }));
+			}
+			vertexInterface.floatTypes[id] = floatType;
+			return id;
+		}
+
+		unsigned typeOf(unsigned fragmentType) {
+			return type(fragmentInterface.floatTypes[fragmentType]);
+		}
+
+		unsigned constant(unsigned id) {
+			if (constants.find(id) != constants.end()) return constants[id];
+			SpirVInstruction inst = fragment.instructions[fragmentInterface.definitions[id]];
+			inst.operands[0] = typeOf(inst.operands[0]);
+			if (inst.opcode == OpConstant) {
+				unsigned functionsStart = vertex.functionsStart();
+				for (unsigned i = 0; i < functionsStart; ++i) {
+					SpirVInstruction& existing = vertex.instructions[i];
+					if (existing.opcode == OpConstant && existing.operands[0] == inst.operands[0] && existing.operands[2] == inst.operands[2]) {
+						return constants[id] = existing.operands[1];
+					}
+				}
+			}
+			else {
+				for (unsigned i = 2; i < inst.operands.size(); ++i) inst.operands[i] = constant(inst.operands[i]);
+			}
+			inst.operands[1] = vertex.newId();
+			vertex.addGlobal(inst);
+			return constants[id] = inst.operands[1];
+		}
+
+		unsigned uniform(unsigned fragmentVariable) {
+			std::string name = fragmentInterface.names[fragmentVariable];
+			if (vertexInterface.uniforms.find(name) != vertexInterface.uniforms.end()) return vertexInterface.uniforms[name];
+			unsigned variable = vertex.newId();
+			unsigned pointer = vertex.pointerType(StorageClassUniformConstant, typeOf(fragmentInterface.variables[fragmentVariable]));
+			vertex.addGlobal(SpirVInstruction(OpVariable, { pointer, variable, StorageClassUniformConstant }));
+			vertex.addName(variable, name);
+			return vertexInterface.uniforms[name] = variable;
+		}
+
+		// Declares everything the instructions need outside of functions
+		void declare(const std::vector<unsigned>& indices) {
+			for (auto index : indices) {
+				SpirVInstruction& inst = fragment.instructions[index];
+				typeOf(inst.operands[0]);
+				if (inst.opcode == OpLoad) {
+					std::string name = fragmentInterface.names[inst.operands[2]];
+					auto varying = vertexInterface.varyings.find(name);
+					if (varying != vertexInterface.varyings.end() && fragmentInterface.varyings[name] == inst.operands[2]) {
+						if (copies.find(name) == copies.end()) {
+							unsigned variable = varying->second;
+							privateCopy(vertex, vertexInterface, variable);
+							copies[name] = variable;
+						}
+					}
+					else if (fragmentInterface.uniforms.find(name) != fragmentInterface.uniforms.end()) {
+						uniform(inst.operands[2]);
+					}
+					continue;
+				}
+				for (unsigned i = 2; i < inst.operands.size(); ++i) {
+					if (!isLiteralOperand(inst.opcode, i) && fragmentInterface.constants.find(inst.operands[i]) != fragmentInterface.constants.end()) constant(inst.operands[i]);
+				}
+			}
+		}
+
+		// Instructions which write the final values of the copied outputs, compute the values
+		// and store them to the new outputs, using fresh ids
+		std::vector<SpirVInstruction> emit(const std::vector<unsigned>& indices, const std::vector<unsigned>& values, const std::vector<unsigned>& outputs) {
+			std::vector<SpirVInstruction> instructions;
+			std::map<std::string, unsigned> written;
+			for (auto copy : copies) {
+				unsigned output = vertexInterface.varyings[copy.first];
+				unsigned value = vertex.newId();
+				instructions.push_back(SpirVInstruction(OpLoad, { vertexInterface.variables[output], value, copy.second }));
+				instructions.push_back(SpirVInstruction(OpStore, { output, value }));
+				written[copy.first] = value;
+			}
+
+			std::map<unsigned, unsigned> mapped;
+			for (auto index : indices) {
+				SpirVInstruction inst = fragment.instructions[index];
+				unsigned result = inst.operands[1];
+				inst.operands[0] = typeOf(inst.operands[0]);
+				inst.operands[1] = vertex.newId();
+				if (inst.opcode == OpLoad) {
+					auto value = written.find(fragmentInterface.names[inst.operands[2]]);
+					if (value != written.end() && fragmentInterface.varyings[value->first] == inst.operands[2]) {
+						mapped[result] = value->second;
+						continue;
+					}
+					inst.operands[2] = uniform(inst.operands[2]);
+				}
+				else {
+					for (unsigned i = 2; i < inst.operands.size(); ++i) {
+						if (isLiteralOperand(inst.opcode, i)) continue;
+						inst.operands[i] = mapped.find(inst.operands[i]) != mapped.end() ? mapped[inst.operands[i]] : constant(inst.operands[i]);
+					}
+				}
+				mapped[result] = inst.operands[1];
+				instructions.push_back(inst);
+			}
+			for (unsigned i = 0; i < values.size(); ++i) {
+				instructions.push_back(SpirVInstruction(OpStore, { outputs[i], mapped[values[i]] }));
+			}
+			return instructions;
+		}
+
+	private:
+		SpirVModule& vertex;
+		ShaderInterface& vertexInterface;
+		SpirVModule& fragment;
+		ShaderInterface& fragmentInterface;
+		std::map<unsigned, unsigned> constants;
+		// Private copies of the vertex outputs the values are computed from, by varying name
+		std::map<std::string, unsigned> copies;
+	};
+
+	// Indices of the OpReturns of the entry point function
+	std::vector<unsigned> entryPointReturns(SpirVModule& module) {
+		unsigned entryPoint = 0;
+		for (auto& inst : module.instructions) {
+			if (inst.opcode == OpEntryPoint) entryPoint = inst.operands[1];
+		}
+		std::vector<unsigned> returns;
+		bool inEntryPoint = false;
+		for (unsigned i = 0; i < module.instructions.size(); ++i) {
+			SpirVInstruction& inst = module.instructions[i];
+			if (inst.opcode == OpFunction) inEntryPoint = inst.operands[1] == entryPoint;
+			if (inEntryPoint && inst.opcode == OpReturn) returns.push_back(i);
+		}
+		return returns;
+	}
+}
+
+unsigned krafix::hoistInterpolation(SpirVModule& vertex, SpirVModule& fragment, unsigned maxVaryings) {
+	ShaderInterface vertexInterface(vertex);
+	ShaderInterface fragmentInterface(fragment);
+	std::map<unsigned, unsigned> resultTypes = fragment.resultTypes();
+
+	// Fragment inputs which the vertex shader writes with the same type
+	std::set<unsigned> varyings;
+	for (auto varying : fragmentInterface.varyings) {
+		if (fragmentInterface.inputs.find(varying.second) == fragmentInterface.inputs.end()) continue;
+		auto output = vertexInterface.varyings.find(varying.first);
+		if (output == vertexInterface.varyings.end() || vertexInterface.outputs.find(output->second) == vertexInterface.outputs.end()) continue;
+		if (fragmentInterface.floatTypes[fragmentInterface.variables[varying.second]] == vertexInterface.floatTypes[vertexInterface.variables[output->second]]) {
+			varyings.insert(varying.second);
+		}
+	}
+	std::set<unsigned> uniforms;
+	for (auto uniform : fragmentInterface.uniforms) uniforms.insert(uniform.second);
+
+	std::map<unsigned, ValueKind> kinds;
+	for (auto constant : fragmentInterface.constants) kinds[constant] = KindConstant;
+	std::map<unsigned, unsigned> indices;
+	std::set<unsigned> arithmetic;
+	std::vector<unsigned> candidates;
+	for (unsigned i = fragment.functionsStart(); i < fragment.instructions.size(); ++i) {
+		SpirVInstruction& inst = fragment.instructions[i];
+		if (inst.opcode == OpLoad && (varyings.find(inst.operands[2]) != varyings.end() || uniforms.find(inst.operands[2]) != uniforms.end())) {
+			kinds[inst.operands[1]] = varyings.find(inst.operands[2]) != varyings.end() ? KindAffine : KindUniform;
+			indices[inst.operands[1]] = i;
+			continue;
+		}
+
+		ValueKind kind;
+		if (SpirVModule::hasResultType(inst.opcode) && fragmentInterface.floatTypes.find(inst.operands[0]) != fragmentInterface.floatTypes.end() && classify(inst, kinds, kind)) {
+			unsigned result = inst.operands[1];
+			kinds[result] = kind;
+			indices[result] = i;
+			for (unsigned i2 = 2; i2 < inst.operands.size(); ++i2) {
+				if (isArithmetic(inst.opcode) || (!isLiteralOperand(inst.opcode, i2) && arithmetic.find(inst.operands[i2]) != arithmetic.end())) arithmetic.insert(result);
+			}
+			continue;
+		}
+
+		for (unsigned i2 = 0; i2 < inst.operands.size(); ++i2) {
+			if (SpirVModule::hasResultType(inst.opcode) && i2 == 1) continue;
+			unsigned operand = inst.operands[i2];
+			auto kind = kinds.find(operand);
+			if (kind == kinds.end() || kind->second != KindAffine || arithmetic.find(operand) == arithmetic.end()) continue;
+			if (std::find(candidates.begin(), candidates.end(), operand) == candidates.end()) candidates.push_back(operand);
+		}
+	}
+
+	if (candidates.empty()) return 0;
+
+	std::sort(candidates.begin(), candidates.end(), [&](unsigned a, unsigned b) { return indices[a] < indices[b]; });
+
+	std::set<unsigned> usedBefore;
+	for (auto varying : varyings) {
+		if (fragmentInterface.usedSlots(fragment, { varying }) > 0) usedBefore.insert(varying);
+	}
+
+	// Take as many values as fit, moving one can also free the varyings it was computed from
+	std::vector<unsigned> values;
+	for (auto candidate : candidates) {
+		values.push_back(candidate);
+		SpirVModule trial = fragment;
+		replaceByInputs(trial, values, indices, resultTypes, usedBefore);
+		ShaderInterface trialInterface(trial);
+		if (trialInterface.usedSlots(trial, trialInterface.inputs) > maxVaryings) values.pop_back();
+	}
+
+	if (values.empty()) return 0;
+
+	std::set<unsigned> needed(values.begin(), values.end());
+	std::vector<unsigned> neededIndices;
+	for (unsigned i = (unsigned)fragment.instructions.size(); i > fragment.functionsStart(); --i) {
+		SpirVInstruction& inst = fragment.instructions[i - 1];
+		if (!SpirVModule::hasResultType(inst.opcode) || needed.find(inst.operands[1]) == needed.end()) continue;
+		neededIndices.insert(neededIndices.begin(), i - 1);
+		if (inst.opcode == OpLoad) continue;
+		for (unsigned i2 = 2; i2 < inst.operands.size(); ++i2) {
+			if (!isLiteralOperand(inst.opcode, i2) && indices.find(inst.operands[i2]) != indices.end()) needed.insert(inst.operands[i2]);
+		}
+	}
+
+	// Explicit locations continue after the highest one in use
+	unsigned location = 0;
+	bool locations = false;
+	for (auto variable : fragmentInterface.inputs) {
+		if (fragmentInterface.locations.find(variable) == fragmentInterface.locations.end()) continue;
+		location = std::max(location, fragmentInterface.locations[variable] + 1);
+		locations = true;
+	}
+	for (auto variable : vertexInterface.outputs) {
+		if (vertexInterface.locations.find(variable) == vertexInterface.locations.end()) continue;
+		location = std::max(location, vertexInterface.locations[variable] + 1);
+		locations = true;
+	}
+
+	SpirVModule original = fragment;
+	std::vector<unsigned> inputs = replaceByInputs(fragment, values, indices, resultTypes, usedBefore);
+
+	VertexEmitter emitter(vertex, vertexInterface, original, fragmentInterface);
+	std::vector<unsigned> outputs;
+	for (unsigned i = 0; i < values.size(); ++i) {
+		unsigned variable = vertex.newId();
+		unsigned pointer = vertex.pointerType(StorageClassOutput, emitter.typeOf(resultTypes[values[i]]));
+		vertex.addGlobal(SpirVInstruction(OpVariable, { pointer, variable, StorageClassOutput }));
+		vertex.addName(variable, interpolatedName(i));
+		vertex.addInterfaceVariable(variable);
+		if (locations) {
+			vertex.addDecoration(SpirVInstruction(OpDecorate, { variable, DecorationLocation, location + i }));
+			fragment.addDecoration(SpirVInstruction(OpDecorate, { inputs[i], DecorationLocation, location + i }));
+		}
+		outputs.push_back(variable);
+	}
+	emitter.declare(neededIndices);
+
+	std::vector<unsigned> returns = entryPointReturns(vertex);
+	for (unsigned i = (unsigned)returns.size(); i > 0; --i) {
+		std::vector<SpirVInstruction> code = emitter.emit(neededIndices, values, outputs);
+		vertex.instructions.insert(vertex.instructions.begin() + returns[i - 1], code.begin(), code.end());
+	}
+
+	// Varyings the fragment shader does not read anymore
+	ShaderInterface remaining(fragment);
+	for (auto varying : usedBefore) {
+		std::string name = fragmentInterface.names[varying];
+		if (remaining.varyings.find(name) != remaining.varyings.end()) continue;
+		demoteToPrivate(vertex, vertexInterface.varyings[name]);
+	}
+
+	return (unsigned)values.size();
+}
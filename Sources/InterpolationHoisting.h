@@ -0,0 +1,11 @@
+#pragma once
+
+#include "SpirVModule.h"
+
+namespace krafix {
+	// Moves fragment shader expressions which are affine in varyings and uniforms into the
+	// vertex shader, which writes their results to new varyings (_k_interpolated<n>) that
+	// the fragment shader reads instead. Expressions are only moved while the fragment shader
+	// reads at most maxVaryings vec4 varyings. Returns the number of moved expressions.
+	unsigned hoistInterpolation(SpirVModule& vertex, SpirVModule& fragment, unsigned maxVaryings);
+}
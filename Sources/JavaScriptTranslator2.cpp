@@ -1,4 +1,5 @@
 #include "JavaScriptTranslator2.h"
+#include "OutputFile.h"
 #ifdef SPIRV_JS
 #include "../SPIRV-Cross/spirv_js.hpp"
 #include <fstream>
@@ -32,8 +33,7 @@ void JavaScriptTranslator2::outputCode(const Target& target, const char* sourcef
 	compiler->set_options(opts);
 
 	std::string js = compiler->compile();
-	std::ofstream out;
-	out.open(filename, std::ios::binary | std::ios::out);
+	OutputFile out(filename);
 	out << js;
 	out.close();
 #endif
@@ -1,5 +1,7 @@
 #include "MetalTranslator2.h"
+#include "HalfPrecision.h"
 #include "../SPIRV-Cross/spirv_msl.hpp"
+#include "OutputFile.h"
 #include <fstream>
 
 using namespace krafix;
@@ -55,6 +57,14 @@ void MetalTranslator2::outputCode(const Target& target, const char* sourcefilena
 		}
 	}
 
+	if (halfPrecision) {
+		SpirVModule module(spirv);
+		std::vector<std::string> lowered;
+		lowerRelaxedPrecision(module, stage, halfVaryings, lowered);
+		module.write(spirv);
+		for (auto value : lowered) printf("Lowered to half: %s\n", value.c_str());
+	}
+
 	spirv_cross::CompilerMSL* compiler = new spirv_cross::CompilerMSL(spirv);
 	
 	std::string name = extractFilename(sourcefilename);
@@ -71,7 +81,7 @@ void MetalTranslator2::outputCode(const Target& target, const char* sourcefilena
 		opts.es = target.es;
 		opts.force_temporary = false;
 		opts.vulkan_semantics = false;
-		opts.vertex.fixup_clipspace = true;
+		opts.vertex.fixup_clipspace = clipSpaceFixup;
 		compiler->set_common_options(opts);
 	}
 
@@ -88,12 +98,14 @@ void MetalTranslator2::outputCode(const Target& target, const char* sourcefilena
 	p_res_bindings.push_back(mslBinding);
 	
 	std::string metal = compiler->compile(nullptr, &p_res_bindings);
+	if (stage == StageVertex && !clipSpaceFixup) {
+		metal = std::string("// projection: ") + clipSpaceProjection + "\n" + metal;
+	}
 	if (output) {
 		strcpy(output, metal.c_str());
 	}
 	else {
-		std::ofstream out;
-		out.open(filename, std::ios::binary | std::ios::out);
+		OutputFile out(filename);
 		out << metal;
 		out.close();
 	}
@@ -1,11 +1,18 @@
 #pragma once
 
 #include "Translator.h"
+#include <set>
 
 namespace krafix {
 	class MetalTranslator2 : public Translator {
 	public:
-		MetalTranslator2(std::vector<unsigned>& spirv, ShaderStage stage) : Translator(spirv, stage) {}
+		MetalTranslator2(std::vector<unsigned>& spirv, ShaderStage stage, bool halfPrecision, const std::set<std::string>& halfVaryings, bool clipSpaceFixup)
+			: Translator(spirv, stage), halfPrecision(halfPrecision), halfVaryings(halfVaryings), clipSpaceFixup(clipSpaceFixup) {}
 		void outputCode(const Target& target, const char* sourcefilename, const char* filename, char* output, std::map<std::string, int>& attributes) override;
+	private:
+		bool halfPrecision;
+		// Varyings which the linked stage lowers as well
+		std::set<std::string> halfVaryings;
+		bool clipSpaceFixup;
 	};
 }
@@ -0,0 +1,85 @@
+#include "OutputFile.h"
+#include <fstream>
+#include <iterator>
+#include <stdio.h>
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+using namespace krafix;
+
+namespace {
+	bool onlyChanged = false;
+	std::vector<WrittenOutput> written;
+
+	bool replaceFile(const std::string& from, const std::string& to) {
+#ifdef _WIN32
+		return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+		return rename(from.c_str(), to.c_str()) == 0;
+#endif
+	}
+
+	int processId() {
+#ifdef _WIN32
+		return _getpid();
+#else
+		return getpid();
+#endif
+	}
+}
+
+void krafix::setWriteIfChanged(bool writeIfChanged) {
+	onlyChanged = writeIfChanged;
+}
+
+std::vector<WrittenOutput>& krafix::writtenOutputs() {
+	return written;
+}
+
+bool krafix::writeOutput(const std::string& filename, const std::string& data) {
+	WrittenOutput output = { filename, true };
+	if (!onlyChanged) {
+		written.push_back(output);
+		std::ofstream out(filename, std::ios::binary | std::ios::out);
+		out.write(data.data(), data.size());
+		return out.good();
+	}
+
+	std::ifstream existing(filename, std::ios::binary);
+	if (existing.is_open()) {
+		std::string contents((std::istreambuf_iterator<char>(existing)), std::istreambuf_iterator<char>());
+		if (contents == data) {
+			output.changed = false;
+			written.push_back(output);
+			return true;
+		}
+		existing.close();
+	}
+
+	written.push_back(output);
+
+	// The process id keeps parallel builds from sharing temporary files
+	std::string temp = filename + ".tmp" + std::to_string(processId());
+	{
+		std::ofstream out(temp, std::ios::binary | std::ios::out);
+		out.write(data.data(), data.size());
+		if (!out.good()) return false;
+	}
+	if (!replaceFile(temp, filename)) {
+		remove(temp.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool OutputFile::close() {
+	if (closed) return true;
+	closed = true;
+	if (filename.empty()) return true;
+	return writeOutput(filename, str());
+}
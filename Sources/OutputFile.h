@@ -0,0 +1,35 @@
+#pragma once
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace krafix {
+	// When set, outputs whose contents did not change are left alone, so their modification times stay
+	// the same, and all others are written to a temporary file which then replaces the output at once.
+	void setWriteIfChanged(bool writeIfChanged);
+
+	bool writeOutput(const std::string& filename, const std::string& data);
+
+	struct WrittenOutput {
+		std::string filename;
+		// False when the contents were the same and the file was left alone
+		bool changed;
+	};
+
+	// Every file writeOutput was called for, in the order of the calls
+	std::vector<WrittenOutput>& writtenOutputs();
+
+	// Collects everything written to it and hands it to writeOutput when it is closed or destroyed.
+	// Nothing is written for an empty filename.
+	class OutputFile : public std::ostringstream {
+	public:
+		OutputFile(const std::string& filename) : std::ostringstream(std::ios::binary | std::ios::out), filename(filename), closed(false) {}
+		~OutputFile() { close(); }
+		bool close();
+
+	private:
+		std::string filename;
+		bool closed;
+	};
+}
@@ -0,0 +1,97 @@
+#include "Permutations.h"
+#include "OutputFile.h"
+#include <stdint.h>
+#include <stdio.h>
+
+using namespace krafix;
+
+namespace {
+	std::string jsonString(const std::string& value) {
+		std::string escaped = "\"";
+		for (char c : value) {
+			if (c == '"' || c == '\\') escaped += '\\';
+			escaped += c;
+		}
+		return escaped + "\"";
+	}
+}
+
+bool krafix::parseAxis(const std::string& arg, PermutationAxis& axis) {
+	size_t equals = arg.find('=');
+	axis.name = arg.substr(0, equals);
+	axis.values.clear();
+	axis.toggle = equals == std::string::npos;
+	if (axis.name.empty()) return false;
+	if (axis.toggle) {
+		axis.values.push_back("0");
+		axis.values.push_back("1");
+		return true;
+	}
+	size_t start = equals + 1;
+	for (;;) {
+		size_t comma = arg.find(',', start);
+		std::string value = arg.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+		if (value.empty()) return false;
+		axis.values.push_back(value);
+		if (comma == std::string::npos) break;
+		start = comma + 1;
+	}
+	return true;
+}
+
+std::vector<Permutation> krafix::permutations(const std::vector<PermutationAxis>& axes) {
+	std::vector<Permutation> all;
+	Permutation permutation(axes.size(), 0);
+	for (;;) {
+		all.push_back(permutation);
+		int axis = (int)axes.size() - 1;
+		for (; axis >= 0; --axis) {
+			if (++permutation[axis] < axes[axis].values.size()) break;
+			permutation[axis] = 0;
+		}
+		if (axis < 0) break;
+	}
+	return all;
+}
+
+std::string krafix::permutationDefines(const std::vector<PermutationAxis>& axes, const Permutation& permutation) {
+	std::string defines;
+	for (size_t i = 0; i < axes.size(); ++i) {
+		if (axes[i].toggle && permutation[i] == 0) continue;
+		defines += "#define " + axes[i].name + " " + axes[i].values[permutation[i]] + "\n";
+	}
+	return defines;
+}
+
+std::string krafix::permutationHash(const std::string& text) {
+	uint64_t hash = 14695981039346656037ull;
+	for (size_t i = 0; i < text.size(); ++i) {
+		hash ^= (unsigned char)text[i];
+		hash *= 1099511628211ull;
+	}
+	char hex[17];
+	snprintf(hex, sizeof(hex), "%08x%08x", (unsigned)(hash >> 32), (unsigned)(hash & 0xffffffff));
+	return hex;
+}
+
+bool krafix::writePermutationManifest(const char* filename, const std::vector<PermutationAxis>& axes, const std::vector<PermutationOutput>& outputs) {
+	OutputFile out(filename);
+	out << "{\n\t\"axes\": [";
+	for (size_t i = 0; i < axes.size(); ++i) {
+		out << (i > 0 ? ",\n\t\t" : "\n\t\t") << "{ \"name\": " << jsonString(axes[i].name) << ", \"values\": [";
+		for (size_t j = 0; j < axes[i].values.size(); ++j) {
+			out << (j > 0 ? ", " : "") << jsonString(axes[i].values[j]);
+		}
+		out << "] }";
+	}
+	out << "\n\t],\n\t\"permutations\": [";
+	for (size_t i = 0; i < outputs.size(); ++i) {
+		out << (i > 0 ? ",\n\t\t" : "\n\t\t") << "{ \"defines\": { ";
+		for (size_t j = 0; j < axes.size(); ++j) {
+			out << (j > 0 ? ", " : "") << jsonString(axes[j].name) << ": " << jsonString(axes[j].values[outputs[i].permutation[j]]);
+		}
+		out << " }, \"file\": " << jsonString(outputs[i].file) << " }";
+	}
+	out << "\n\t]\n}\n";
+	return out.close();
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace krafix {
+	// A define which takes each of its values in turn (--axis NAME=v1,v2,...).
+	// Axes without values (--axis NAME) are switches, which are either left undefined or defined as 1.
+	struct PermutationAxis {
+		std::string name;
+		std::vector<std::string> values;
+		bool toggle;
+	};
+
+	bool parseAxis(const std::string& arg, PermutationAxis& axis);
+
+	// The index of the value of every axis
+	typedef std::vector<unsigned> Permutation;
+
+	// All combinations of the axis values, the last axis changing fastest
+	std::vector<Permutation> permutations(const std::vector<PermutationAxis>& axes);
+
+	std::string permutationDefines(const std::vector<PermutationAxis>& axes, const Permutation& permutation);
+
+	// 64 bit FNV-1a as 16 hex digits, which names the output of a preprocessed permutation
+	std::string permutationHash(const std::string& text);
+
+	struct PermutationOutput {
+		Permutation permutation;
+		std::string file;
+	};
+
+	// Writes a JSON file listing the axes and the output of every permutation, permutations
+	// which preprocess to the same text share an output
+	bool writePermutationManifest(const char* filename, const std::vector<PermutationAxis>& axes, const std::vector<PermutationOutput>& outputs);
+}
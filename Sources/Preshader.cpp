@@ -0,0 +1,532 @@
+#include "Preshader.h"
+#include "SpirVOptimizer.h"
+#include <SPIRV/spirv.hpp>
+#include <SPIRV/GLSL.std.450.h>
+#include <iomanip>
+#include <set>
+#include <sstream>
+#include <string.h>
+
+using namespace krafix;
+
+namespace {
+	using namespace spv;
+
+	struct PreshaderType {
+		unsigned components;
+		unsigned rows;
+	};
+
+	const char* stageName(ShaderStage stage) {
+		switch (stage) {
+		case StageVertex:
+			return "vert";
+		case StageTessControl:
+			return "tesc";
+		case StageTessEvaluation:
+			return "tese";
+		case StageGeometry:
+			return "geom";
+		case StageFragment:
+			return "frag";
+		case StageCompute:
+			return "comp";
+		}
+		return "";
+	}
+
+	bool isSupportedExtInst(unsigned instruction) {
+		switch (instruction) {
+		case GLSLstd450FAbs:
+		case GLSLstd450Floor:
+		case GLSLstd450Ceil:
+		case GLSLstd450Fract:
+		case GLSLstd450Sin:
+		case GLSLstd450Cos:
+		case GLSLstd450Tan:
+		case GLSLstd450Pow:
+		case GLSLstd450Exp:
+		case GLSLstd450Log:
+		case GLSLstd450Exp2:
+		case GLSLstd450Log2:
+		case GLSLstd450Sqrt:
+		case GLSLstd450InverseSqrt:
+		case GLSLstd450FMin:
+		case GLSLstd450FMax:
+		case GLSLstd450FClamp:
+		case GLSLstd450FMix:
+		case GLSLstd450Length:
+		case GLSLstd450Normalize:
+		case GLSLstd450Cross:
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	// Ids of the value operands of an instruction the preshader can evaluate, false for everything else
+	bool valueOperands(SpirVInstruction& inst, unsigned glslSet, std::vector<unsigned>& values) {
+		switch (inst.opcode) {
+		case OpFNegate:
+		case OpFAdd:
+		case OpFSub:
+		case OpFMul:
+		case OpFDiv:
+		case OpVectorTimesScalar:
+		case OpMatrixTimesScalar:
+		case OpMatrixTimesVector:
+		case OpVectorTimesMatrix:
+		case OpMatrixTimesMatrix:
+		case OpTranspose:
+		case OpDot:
+		case OpCompositeConstruct:
+			values.assign(inst.operands.begin() + 2, inst.operands.end());
+			return true;
+		case OpCompositeExtract:
+			values.push_back(inst.operands[2]);
+			return true;
+		case OpVectorShuffle:
+			values.push_back(inst.operands[2]);
+			values.push_back(inst.operands[3]);
+			return true;
+		case OpExtInst:
+			if (inst.operands[2] != glslSet || !isSupportedExtInst(inst.operands[3])) return false;
+			values.assign(inst.operands.begin() + 4, inst.operands.end());
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	// Shuffles and composites only move components around and are not worth a uniform on their own
+	bool isArithmetic(unsigned opcode) {
+		return opcode != OpCompositeExtract && opcode != OpCompositeConstruct && opcode != OpVectorShuffle;
+	}
+
+	class PreshaderWriter {
+	public:
+		PreshaderWriter(bool javaScript, std::map<unsigned, PreshaderType>& types, std::map<unsigned, unsigned>& resultTypes)
+			: javaScript(javaScript), types(types), resultTypes(resultTypes) {}
+
+		std::string literal(unsigned word) {
+			float value;
+			memcpy(&value, &word, 4);
+			std::stringstream stream;
+			stream << std::setprecision(9) << value;
+			std::string string = stream.str();
+			if (string.find_first_of(".e") == std::string::npos) string += ".0";
+			if (!javaScript) string += "f";
+			if (value < 0.0f) string = "(" + string + ")";
+			return string;
+		}
+
+		unsigned components(unsigned id) {
+			return types[resultTypes[id]].components;
+		}
+
+		unsigned rows(unsigned id) {
+			return types[resultTypes[id]].rows;
+		}
+
+		bool isKnown(unsigned id) {
+			return constants.find(id) != constants.end() || inputs.find(id) != inputs.end();
+		}
+
+		std::string component(unsigned id, unsigned index) {
+			if (constants.find(id) != constants.end()) return constants[id][index];
+			std::string name = inputs.find(id) != inputs.end() ? std::string(javaScript ? "input." : "in.") + inputs[id] : "t" + std::to_string(id);
+			if (components(id) > 1) return name + "[" + std::to_string(index) + "]";
+			return name;
+		}
+
+		std::string call(const std::string& function, const std::string& arguments) {
+			if (javaScript) return "Math." + function + "(" + arguments + ")";
+			if (function == "min" || function == "max" || function == "abs") return "f" + function + "f(" + arguments + ")";
+			return function + "f(" + arguments + ")";
+		}
+
+		std::string sum(const std::vector<std::string>& terms) {
+			std::string string = "(";
+			for (unsigned i = 0; i < terms.size(); ++i) {
+				if (i > 0) string += " + ";
+				string += terms[i];
+			}
+			return string + ")";
+		}
+
+		void declare(std::ostream& out, const std::string& name, const std::vector<std::string>& values) {
+			out << "\t" << (javaScript ? "var " : "float ") << name;
+			if (values.size() == 1) {
+				out << " = " << values[0] << ";\n";
+				return;
+			}
+			if (!javaScript) out << "[" << values.size() << "]";
+			out << (javaScript ? " = [" : " = { ");
+			for (unsigned i = 0; i < values.size(); ++i) {
+				if (i > 0) out << ", ";
+				out << values[i];
+			}
+			out << (javaScript ? "];\n" : " };\n");
+		}
+
+		void write(std::ostream& out, SpirVInstruction& inst) {
+			unsigned result = inst.operands[1];
+			unsigned count = types[inst.operands[0]].components;
+			std::vector<std::string> values;
+			auto a = [&](unsigned index) { return component(inst.operands[2], index); };
+			auto b = [&](unsigned index) { return component(inst.operands[3], index); };
+
+			switch (inst.opcode) {
+			case OpFNegate:
+				for (unsigned i = 0; i < count; ++i) values.push_back("(-" + a(i) + ")");
+				break;
+			case OpFAdd:
+			case OpFSub:
+			case OpFMul:
+			case OpFDiv: {
+				const char* op = inst.opcode == OpFAdd ? " + " : inst.opcode == OpFSub ? " - " : inst.opcode == OpFMul ? " * " : " / ";
+				for (unsigned i = 0; i < count; ++i) values.push_back("(" + a(i) + op + b(i) + ")");
+				break;
+			}
+			case OpVectorTimesScalar:
+			case OpMatrixTimesScalar:
+				for (unsigned i = 0; i < count; ++i) values.push_back("(" + a(i) + " * " + b(0) + ")");
+				break;
+			case OpMatrixTimesVector: {
+				unsigned matrixRows = rows(inst.operands[2]);
+				unsigned columns = components(inst.operands[2]) / matrixRows;
+				for (unsigned row = 0; row < matrixRows; ++row) {
+					std::vector<std::string> terms;
+					for (unsigned column = 0; column < columns; ++column) terms.push_back(a(column * matrixRows + row) + " * " + b(column));
+					values.push_back(sum(terms));
+				}
+				break;
+			}
+			case OpVectorTimesMatrix: {
+				unsigned matrixRows = rows(inst.operands[3]);
+				unsigned columns = components(inst.operands[3]) / matrixRows;
+				for (unsigned column = 0; column < columns; ++column) {
+					std::vector<std::string> terms;
+					for (unsigned row = 0; row < matrixRows; ++row) terms.push_back(a(row) + " * " + b(column * matrixRows + row));
+					values.push_back(sum(terms));
+				}
+				break;
+			}
+			case OpMatrixTimesMatrix: {
+				unsigned leftRows = rows(inst.operands[2]);
+				unsigned inner = components(inst.operands[2]) / leftRows;
+				unsigned columns = components(inst.operands[3]) / inner;
+				for (unsigned column = 0; column < columns; ++column) {
+					for (unsigned row = 0; row < leftRows; ++row) {
+						std::vector<std::string> terms;
+						for (unsigned k = 0; k < inner; ++k) terms.push_back(a(k * leftRows + row) + " * " + b(column * inner + k));
+						values.push_back(sum(terms));
+					}
+				}
+				break;
+			}
+			case OpTranspose: {
+				unsigned sourceRows = rows(inst.operands[2]);
+				unsigned sourceColumns = components(inst.operands[2]) / sourceRows;
+				for (unsigned column = 0; column < sourceRows; ++column) {
+					for (unsigned row = 0; row < sourceColumns; ++row) values.push_back(a(row * sourceRows + column));
+				}
+				break;
+			}
+			case OpDot: {
+				std::vector<std::string> terms;
+				for (unsigned i = 0; i < components(inst.operands[2]); ++i) terms.push_back(a(i) + " * " + b(i));
+				values.push_back(sum(terms));
+				break;
+			}
+			case OpCompositeConstruct:
+				for (unsigned i = 2; i < inst.operands.size(); ++i) {
+					for (unsigned i2 = 0; i2 < components(inst.operands[i]); ++i2) values.push_back(component(inst.operands[i], i2));
+				}
+				break;
+			case OpCompositeExtract: {
+				unsigned compositeRows = rows(inst.operands[2]);
+				unsigned offset = inst.operands[3];
+				if (compositeRows < components(inst.operands[2])) {
+					offset *= compositeRows;
+					if (inst.operands.size() > 4) offset += inst.operands[4];
+				}
+				for (unsigned i = 0; i < count; ++i) values.push_back(a(offset + i));
+				break;
+			}
+			case OpVectorShuffle: {
+				unsigned first = components(inst.operands[2]);
+				for (unsigned i = 4; i < inst.operands.size(); ++i) {
+					unsigned index = inst.operands[i] == 0xffffffff ? 0 : inst.operands[i];
+					values.push_back(index < first ? a(index) : b(index - first));
+				}
+				break;
+			}
+			case OpExtInst:
+				writeExtInst(out, inst, values);
+				break;
+			}
+
+			declare(out, "t" + std::to_string(result), values);
+		}
+
+		void writeExtInst(std::ostream& out, SpirVInstruction& inst, std::vector<std::string>& values) {
+			unsigned result = inst.operands[1];
+			unsigned count = types[inst.operands[0]].components;
+			auto x = [&](unsigned index) { return component(inst.operands[4], index); };
+			auto y = [&](unsigned index) { return component(inst.operands[5], index); };
+			auto z = [&](unsigned index) { return component(inst.operands[6], index); };
+
+			const char* function = nullptr;
+			switch (inst.operands[3]) {
+			case GLSLstd450FAbs: function = "abs"; break;
+			case GLSLstd450Floor: function = "floor"; break;
+			case GLSLstd450Ceil: function = "ceil"; break;
+			case GLSLstd450Sin: function = "sin"; break;
+			case GLSLstd450Cos: function = "cos"; break;
+			case GLSLstd450Tan: function = "tan"; break;
+			case GLSLstd450Exp: function = "exp"; break;
+			case GLSLstd450Log: function = "log"; break;
+			case GLSLstd450Log2: function = "log2"; break;
+			case GLSLstd450Sqrt: function = "sqrt"; break;
+			}
+			if (function != nullptr) {
+				for (unsigned i = 0; i < count; ++i) values.push_back(call(function, x(i)));
+				return;
+			}
+
+			switch (inst.operands[3]) {
+			case GLSLstd450Fract:
+				for (unsigned i = 0; i < count; ++i) values.push_back("(" + x(i) + " - " + call("floor", x(i)) + ")");
+				break;
+			case GLSLstd450Exp2:
+				for (unsigned i = 0; i < count; ++i) values.push_back(javaScript ? call("pow", literal(0x40000000) + ", " + x(i)) : call("exp2", x(i)));
+				break;
+			case GLSLstd450InverseSqrt:
+				for (unsigned i = 0; i < count; ++i) values.push_back("(" + literal(0x3f800000) + " / " + call("sqrt", x(i)) + ")");
+				break;
+			case GLSLstd450Pow:
+				for (unsigned i = 0; i < count; ++i) values.push_back(call("pow", x(i) + ", " + y(i)));
+				break;
+			case GLSLstd450FMin:
+				for (unsigned i = 0; i < count; ++i) values.push_back(call("min", x(i) + ", " + y(i)));
+				break;
+			case GLSLstd450FMax:
+				for (unsigned i = 0; i < count; ++i) values.push_back(call("max", x(i) + ", " + y(i)));
+				break;
+			case GLSLstd450FClamp:
+				for (unsigned i = 0; i < count; ++i) values.push_back(call("min", call("max", x(i) + ", " + y(i)) + ", " + z(i)));
+				break;
+			case GLSLstd450FMix:
+				for (unsigned i = 0; i < count; ++i) values.push_back("(" + x(i) + " + (" + y(i) + " - " + x(i) + ") * " + z(i) + ")");
+				break;
+			case GLSLstd450Length:
+			case GLSLstd450Normalize: {
+				std::vector<std::string> terms;
+				for (unsigned i = 0; i < components(inst.operands[4]); ++i) terms.push_back(x(i) + " * " + x(i));
+				std::string length = call("sqrt", sum(terms));
+				if (inst.operands[3] == GLSLstd450Length) {
+					values.push_back(length);
+					break;
+				}
+				std::string name = "t" + std::to_string(result) + "_length";
+				declare(out, name, { length });
+				for (unsigned i = 0; i < count; ++i) values.push_back("(" + x(i) + " / " + name + ")");
+				break;
+			}
+			case GLSLstd450Cross:
+				for (unsigned i = 0; i < 3; ++i) {
+					unsigned i1 = (i + 1) % 3;
+					unsigned i2 = (i + 2) % 3;
+					values.push_back("(" + x(i1) + " * " + y(i2) + " - " + y(i1) + " * " + x(i2) + ")");
+				}
+				break;
+			}
+		}
+
+		bool javaScript;
+		std::map<unsigned, PreshaderType>& types;
+		std::map<unsigned, unsigned>& resultTypes;
+		std::map<unsigned, std::vector<std::string>> constants;
+		// Loads of uniforms, mapped to the uniform name
+		std::map<unsigned, std::string> inputs;
+	};
+}
+
+std::string krafix::extractPreshader(SpirVModule& module, ShaderStage stage, const std::string& name, bool javaScript) {
+	std::map<unsigned, std::string> names = module.names();
+	std::map<unsigned, unsigned> resultTypes = module.resultTypes();
+	std::map<unsigned, PreshaderType> types;
+	std::map<unsigned, unsigned> uniformPointees;
+	std::set<unsigned> uniforms;
+	PreshaderWriter writer(javaScript, types, resultTypes);
+	unsigned glslSet = 0;
+	unsigned functionsStart = module.functionsStart();
+
+	for (unsigned i = 0; i < functionsStart; ++i) {
+		SpirVInstruction& inst = module.instructions[i];
+		switch (inst.opcode) {
+		case OpExtInstImport:
+			if (SpirVModule::readString(inst.operands, 1) == "GLSL.std.450") glslSet = inst.operands[0];
+			break;
+		case OpTypeFloat:
+			if (inst.operands[1] == 32) types[inst.operands[0]] = { 1, 1 };
+			break;
+		case OpTypeVector:
+			if (types.find(inst.operands[1]) != types.end()) types[inst.operands[0]] = { inst.operands[2], inst.operands[2] };
+			break;
+		case OpTypeMatrix:
+			if (types.find(inst.operands[1]) != types.end()) {
+				unsigned rows = types[inst.operands[1]].components;
+				types[inst.operands[0]] = { rows * inst.operands[2], rows };
+			}
+			break;
+		case OpTypePointer:
+			if (inst.operands[1] != StorageClassUniformConstant) break;
+			uniformPointees[inst.operands[0]] = inst.operands[2];
+			break;
+		case OpConstant:
+			if (types.find(inst.operands[0]) != types.end()) writer.constants[inst.operands[1]] = { writer.literal(inst.operands[2]) };
+			break;
+		case OpConstantComposite: {
+			if (types.find(inst.operands[0]) == types.end()) break;
+			std::vector<std::string> values;
+			for (unsigned i2 = 2; i2 < inst.operands.size(); ++i2) {
+				if (writer.constants.find(inst.operands[i2]) == writer.constants.end()) break;
+				std::vector<std::string>& part = writer.constants[inst.operands[i2]];
+				values.insert(values.end(), part.begin(), part.end());
+			}
+			if (values.size() == types[inst.operands[0]].components) writer.constants[inst.operands[1]] = values;
+			break;
+		}
+		case OpVariable:
+			if (inst.operands[2] != StorageClassUniformConstant || names.find(inst.operands[1]) == names.end()) break;
+			if (types.find(uniformPointees[inst.operands[0]]) != types.end()) uniforms.insert(inst.operands[1]);
+			break;
+		}
+	}
+
+	// Values which can be computed from uniforms and constants alone
+	std::map<unsigned, unsigned> derived;
+	std::set<unsigned> arithmetic;
+	std::set<unsigned> uniformDependent;
+	std::set<unsigned> roots;
+	for (unsigned i = functionsStart; i < module.instructions.size(); ++i) {
+		SpirVInstruction& inst = module.instructions[i];
+		if (inst.opcode == OpLoad && uniforms.find(inst.operands[2]) != uniforms.end()) {
+			writer.inputs[inst.operands[1]] = names[inst.operands[2]];
+			uniformDependent.insert(inst.operands[1]);
+			continue;
+		}
+
+		std::vector<unsigned> values;
+		bool evaluable = SpirVModule::hasResultType(inst.opcode) && types.find(inst.operands[0]) != types.end() && valueOperands(inst, glslSet, values);
+		for (unsigned i2 = 0; evaluable && i2 < values.size(); ++i2) {
+			evaluable = writer.isKnown(values[i2]) || derived.find(values[i2]) != derived.end();
+		}
+		if (evaluable) {
+			unsigned result = inst.operands[1];
+			derived[result] = i;
+			if (isArithmetic(inst.opcode)) arithmetic.insert(result);
+			for (auto value : values) {
+				if (arithmetic.find(value) != arithmetic.end()) arithmetic.insert(result);
+				if (uniformDependent.find(value) != uniformDependent.end()) uniformDependent.insert(result);
+			}
+			continue;
+		}
+
+		for (unsigned i2 = 0; i2 < inst.operands.size(); ++i2) {
+			if (SpirVModule::hasResultType(inst.opcode) && i2 == 1) continue;
+			unsigned operand = inst.operands[i2];
+			if (arithmetic.find(operand) != arithmetic.end() && uniformDependent.find(operand) != uniformDependent.end()) roots.insert(operand);
+		}
+	}
+
+	if (roots.empty()) return "";
+
+	std::set<unsigned> needed(roots.begin(), roots.end());
+	std::map<std::string, unsigned> inputUniforms;
+	std::set<unsigned> inputVariables;
+	for (unsigned i = (unsigned)module.instructions.size(); i > functionsStart; --i) {
+		SpirVInstruction& inst = module.instructions[i - 1];
+		if (inst.opcode == OpLoad && needed.find(inst.operands[1]) != needed.end()) {
+			inputUniforms[names[inst.operands[2]]] = types[inst.operands[0]].components;
+			inputVariables.insert(inst.operands[2]);
+			continue;
+		}
+		if (!SpirVModule::hasResultType(inst.opcode) || derived.find(inst.operands[1]) == derived.end() || needed.find(inst.operands[1]) == needed.end()) continue;
+		std::vector<unsigned> values;
+		valueOperands(inst, glslSet, values);
+		needed.insert(values.begin(), values.end());
+	}
+
+	std::map<unsigned, std::string> rootNames;
+	unsigned index = 0;
+	for (auto root : roots) {
+		rootNames[root] = std::string("_k_preshader_") + stageName(stage) + std::to_string(index++);
+	}
+
+	std::stringstream code;
+	if (javaScript) {
+		code << "// Generated by krafix, computes the preshader uniforms of " << name << ".\n";
+		code << "// Reads the uniforms from input and writes the results to output, matrices are column major arrays.\n";
+		code << "function " << name << "(input, output) {\n";
+	}
+	else {
+		code << "// Generated by krafix, computes the preshader uniforms of " << name << ".\n";
+		code << "// Matrices are stored column major.\n";
+		code << "#pragma once\n\n#include <math.h>\n\n";
+		code << "struct " << name << "_in {\n";
+		for (auto input : inputUniforms) {
+			code << "\tfloat " << input.first;
+			if (input.second > 1) code << "[" << input.second << "]";
+			code << ";\n";
+		}
+		code << "};\n\n";
+		code << "struct " << name << "_out {\n";
+		for (auto root : rootNames) {
+			code << "\tfloat " << root.second;
+			if (writer.components(root.first) > 1) code << "[" << writer.components(root.first) << "]";
+			code << ";\n";
+		}
+		code << "};\n\n";
+		code << "inline void " << name << "(const " << name << "_in& in, " << name << "_out& out) {\n";
+	}
+	for (unsigned i = functionsStart; i < module.instructions.size(); ++i) {
+		SpirVInstruction& inst = module.instructions[i];
+		if (!SpirVModule::hasResultType(inst.opcode) || derived.find(inst.operands[1]) == derived.end() || needed.find(inst.operands[1]) == needed.end()) continue;
+		writer.write(code, inst);
+	}
+	for (auto root : rootNames) {
+		unsigned count = writer.components(root.first);
+		if (count == 1) {
+			code << "\t" << (javaScript ? "output." : "out.") << root.second << " = " << writer.component(root.first, 0) << ";\n";
+		}
+		else if (javaScript) {
+			code << "\toutput." << root.second << " = t" << root.first << ";\n";
+		}
+		else {
+			for (unsigned i = 0; i < count; ++i) {
+				code << "\tout." << root.second << "[" << i << "] = " << writer.component(root.first, i) << ";\n";
+			}
+		}
+	}
+	code << "}\n";
+
+	// Replace every root by a load of its new uniform
+	std::map<unsigned, unsigned> variables;
+	for (auto root : rootNames) {
+		variables[root.first] = module.newId();
+		module.instructions[derived[root.first]] = SpirVInstruction(OpLoad, { resultTypes[root.first], root.first, variables[root.first] });
+	}
+	for (auto root : rootNames) {
+		unsigned pointer = module.pointerType(StorageClassUniformConstant, resultTypes[root.first]);
+		module.addGlobal(SpirVInstruction(OpVariable, { pointer, variables[root.first], StorageClassUniformConstant }));
+		module.addName(variables[root.first], root.second);
+	}
+
+	removeDeadCode(module);
+	removeUnusedVariables(module, inputVariables);
+
+	return code.str();
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "SpirVModule.h"
+#include "Translator.h"
+
+namespace krafix {
+	// Moves float expressions which only depend on uniforms and constants out of the shader.
+	// Every hoisted expression is replaced by a load of a new uniform (_k_preshader_<stage><n>)
+	// and the returned code computes those uniforms on the CPU in a function called name,
+	// as JavaScript or otherwise as a C++ header. Returns an empty string when nothing was hoisted.
+	std::string extractPreshader(SpirVModule& module, ShaderStage stage, const std::string& name, bool javaScript);
+}
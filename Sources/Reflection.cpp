@@ -0,0 +1,405 @@
+#include "Reflection.h"
+#include "OutputFile.h"
+#include "SpirVModule.h"
+#include "UniformLayout.h"
+#include <SPIRV/spirv.hpp>
+#include <algorithm>
+#include <fstream>
+#include <stdio.h>
+
+using namespace krafix;
+
+namespace {
+	using namespace spv;
+
+	struct Decorations {
+		unsigned location;
+		unsigned set;
+		unsigned binding;
+		unsigned arrayStride;
+		bool builtIn;
+
+		Decorations() : location(reflectionNone), set(0), binding(reflectionNone), arrayStride(0), builtIn(false) {}
+	};
+
+	typedef std::pair<unsigned, unsigned> Member;
+
+	class NameHasher {
+	public:
+		uint32_t hash(const std::string& name) {
+			uint32_t hash = hashName(name);
+			auto existing = names.find(hash);
+			if (existing != names.end() && existing->second != name) {
+				printf("Warning: %s and %s have the same reflection hash.\n", existing->second.c_str(), name.c_str());
+			}
+			names[hash] = name;
+			return hash;
+		}
+
+	private:
+		std::map<uint32_t, std::string> names;
+	};
+
+	uint32_t describeType(std::map<unsigned, SpirVInstruction>& definitions, unsigned type) {
+		auto definition = definitions.find(type);
+		if (definition == definitions.end()) return reflectedType(ReflectedStruct, 0, 0);
+		SpirVInstruction& inst = definition->second;
+		switch (inst.opcode) {
+		case OpTypeArray:
+		case OpTypeRuntimeArray:
+			return describeType(definitions, inst.operands[1]);
+		case OpTypeBool:
+			return reflectedType(ReflectedBool, 1, 1);
+		case OpTypeInt:
+			return reflectedType(inst.operands[2] != 0 ? ReflectedInt : ReflectedUint, 1, 1);
+		case OpTypeFloat:
+			return reflectedType(ReflectedFloat, 1, 1);
+		case OpTypeVector:
+			return (describeType(definitions, inst.operands[1]) & 0xff) | (inst.operands[2] << 8) | (1 << 16);
+		case OpTypeMatrix:
+			return (describeType(definitions, inst.operands[1]) & 0xffff) | (inst.operands[2] << 16);
+		case OpTypeImage:
+			return reflectedType(ReflectedImage, 0, 0);
+		case OpTypeSampler:
+			return reflectedType(ReflectedSampler, 0, 0);
+		case OpTypeSampledImage:
+			return reflectedType(ReflectedSampledImage, 0, 0);
+		default:
+			return reflectedType(ReflectedStruct, 0, 0);
+		}
+	}
+
+	// Uses the explicit strides when there are some and std140 otherwise
+	void layoutUniform(LayoutTypes& types, std::map<unsigned, Decorations>& decorations, unsigned type, unsigned matrixStride, ReflectedUniform& uniform) {
+		LayoutType& t = types[type];
+		if (t.opcode == OpTypeArray) {
+			unsigned stride = decorations[type].arrayStride;
+			uniform.arrayLength = t.count;
+			uniform.arrayStride = stride != 0 ? stride : arrayStride(types, type, false);
+			uniform.size = uniform.arrayStride * t.count;
+		}
+		else {
+			uniform.arrayLength = 0;
+			uniform.arrayStride = 0;
+			if (t.opcode == OpTypeMatrix && matrixStride != 0) uniform.size = matrixStride * t.count;
+			else uniform.size = typeLayout(types, type, false).size;
+		}
+	}
+
+	template<class T> void writeTable(std::ostream& out, const std::vector<T>& table) {
+		if (table.size() > 0) out.write((const char*)table.data(), table.size() * sizeof(T));
+	}
+
+	// 64 bit FNV-1a over 32 bit words
+	struct InterfaceHash {
+		uint64_t value;
+
+		InterfaceHash() : value(14695981039346656037ull) {}
+
+		void add(uint32_t word) {
+			for (unsigned i = 0; i < 4; ++i) {
+				value ^= (word >> (i * 8)) & 0xff;
+				value *= 1099511628211ull;
+			}
+		}
+	};
+
+	struct Input {
+		std::string name;
+		unsigned type;
+		unsigned location;
+
+		bool operator<(const Input& other) const {
+			return name < other.name;
+		}
+	};
+}
+
+uint32_t krafix::hashName(const std::string& name) {
+	uint32_t hash = 2166136261u;
+	for (unsigned i = 0; i < name.size(); ++i) {
+		hash ^= (unsigned char)name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+void krafix::reflect(const std::vector<unsigned>& spirv, ShaderStage stage, const std::map<std::string, int>& attributes, ShaderReflection& reflection) {
+	SpirVModule module(spirv);
+	std::map<unsigned, std::string> names = module.names();
+	std::map<Member, std::string> memberNames;
+	std::map<Member, unsigned> memberOffsets;
+	std::map<Member, unsigned> memberMatrixStrides;
+	std::map<unsigned, Decorations> decorations;
+	std::map<unsigned, SpirVInstruction> definitions;
+	std::map<unsigned, unsigned> pointees;
+	std::map<unsigned, unsigned> constants;
+	std::vector<SpirVInstruction> variables;
+	LayoutTypes types;
+	NameHasher hasher;
+
+	reflection.stage = stage;
+	reflection.projection = ReflectedProjectionNone;
+
+	unsigned functionsStart = module.functionsStart();
+	for (unsigned i = 0; i < functionsStart; ++i) {
+		SpirVInstruction& inst = module.instructions[i];
+		addLayoutType(types, constants, inst.opcode, inst.operands.data(), (unsigned)inst.operands.size());
+		if (inst.opcode >= OpTypeVoid && inst.opcode <= OpTypePipe) definitions.insert(std::make_pair(inst.operands[0], inst));
+		switch (inst.opcode) {
+		case OpMemberName:
+			memberNames[Member(inst.operands[0], inst.operands[1])] = SpirVModule::readString(inst.operands, 2);
+			break;
+		case OpDecorate: {
+			Decorations& decoration = decorations[inst.operands[0]];
+			switch (inst.operands[1]) {
+			case DecorationLocation:
+				decoration.location = inst.operands[2];
+				break;
+			case DecorationDescriptorSet:
+				decoration.set = inst.operands[2];
+				break;
+			case DecorationBinding:
+				decoration.binding = inst.operands[2];
+				break;
+			case DecorationArrayStride:
+				decoration.arrayStride = inst.operands[2];
+				break;
+			case DecorationBuiltIn:
+				decoration.builtIn = true;
+				break;
+			}
+			break;
+		}
+		case OpMemberDecorate:
+			if (inst.operands[2] == DecorationOffset) memberOffsets[Member(inst.operands[0], inst.operands[1])] = inst.operands[3];
+			if (inst.operands[2] == DecorationMatrixStride) memberMatrixStrides[Member(inst.operands[0], inst.operands[1])] = inst.operands[3];
+			break;
+		case OpTypePointer:
+			pointees[inst.operands[0]] = inst.operands[2];
+			break;
+		case OpVariable:
+			variables.push_back(inst);
+			break;
+		}
+	}
+
+	std::vector<Input> inputs;
+	std::vector<Input> varyings;
+	for (auto& variable : variables) {
+		unsigned id = variable.operands[1];
+		unsigned type = pointees[variable.operands[0]];
+		Decorations& decoration = decorations[id];
+		std::string name = names[id];
+		if (decoration.builtIn) continue;
+
+		switch (variable.operands[2]) {
+		case StorageClassInput:
+			if (name == "" || name.substr(0, 3) == "gl_") break;
+			if (stage == StageVertex) inputs.push_back({ name, type, decoration.location });
+			if (stage == StageFragment) varyings.push_back({ name, type, decoration.location });
+			break;
+		case StorageClassOutput:
+			if (name == "" || name.substr(0, 3) == "gl_") break;
+			if (stage == StageVertex) varyings.push_back({ name, type, decoration.location });
+			break;
+		case StorageClassUniform:
+		case StorageClassPushConstant: {
+			if (types[type].opcode != OpTypeStruct) break;
+			bool pushConstants = variable.operands[2] == StorageClassPushConstant;
+			ReflectedBlock block;
+			block.name = hasher.hash(name != "" ? name : names[type]);
+			block.storage = pushConstants ? ReflectedPushConstants : ReflectedUniformBuffer;
+			block.set = decoration.set;
+			// The global uniform buffer carries its binding on the struct type
+			block.binding = pushConstants ? reflectionNone : decoration.binding != reflectionNone ? decoration.binding : decorations[type].binding;
+			block.size = 0;
+			std::vector<unsigned> members = types[type].members;
+			for (unsigned member = 0; member < members.size(); ++member) {
+				Member key(type, member);
+				ReflectedUniform uniform;
+				uniform.name = hasher.hash(memberNames[key]);
+				uniform.type = describeType(definitions, members[member]);
+				uniform.block = (uint32_t)reflection.blocks.size();
+				uniform.offset = memberOffsets.find(key) != memberOffsets.end() ? memberOffsets[key] : reflectionNone;
+				unsigned matrixStride = memberMatrixStrides.find(key) != memberMatrixStrides.end() ? memberMatrixStrides[key] : 0;
+				layoutUniform(types, decorations, members[member], matrixStride, uniform);
+				if (uniform.offset != reflectionNone) block.size = std::max(block.size, uniform.offset + uniform.size);
+				reflection.uniforms.push_back(uniform);
+			}
+			if (!pushConstants) block.size = roundUp(block.size, 16);
+			reflection.blocks.push_back(block);
+			break;
+		}
+		case StorageClassUniformConstant: {
+			if (name == "") break;
+			uint32_t description = describeType(definitions, type);
+			ReflectedBaseType base = (ReflectedBaseType)(description & 0xff);
+			if (base == ReflectedImage || base == ReflectedSampler || base == ReflectedSampledImage) {
+				ReflectedResource resource;
+				resource.name = hasher.hash(name);
+				resource.type = description;
+				resource.set = decoration.set;
+				resource.binding = decoration.binding;
+				resource.arrayLength = types[type].opcode == OpTypeArray ? types[type].count : 0;
+				reflection.resources.push_back(resource);
+			}
+			else {
+				ReflectedUniform uniform;
+				uniform.name = hasher.hash(name);
+				uniform.type = description;
+				uniform.block = reflectionNone;
+				uniform.offset = reflectionNone;
+				layoutUniform(types, decorations, type, 0, uniform);
+				reflection.uniforms.push_back(uniform);
+			}
+			break;
+		}
+		}
+	}
+
+	std::sort(inputs.begin(), inputs.end());
+	for (unsigned i = 0; i < inputs.size(); ++i) {
+		Input& input = inputs[i];
+		ReflectedInput reflected;
+		reflected.name = hasher.hash(input.name);
+		reflected.type = describeType(definitions, input.type);
+		// Matrices are split into one attribute per column by the HLSL backend
+		auto attribute = attributes.find(input.name);
+		if (attribute == attributes.end()) attribute = attributes.find(input.name + "_0");
+		if (attribute != attributes.end()) reflected.location = attribute->second;
+		else if (input.location != reflectionNone) reflected.location = input.location;
+		else reflected.location = i;
+		reflection.inputs.push_back(reflected);
+	}
+
+	// Varyings are matched by name unless they have locations
+	std::sort(varyings.begin(), varyings.end());
+	for (unsigned i = 0; i < varyings.size(); ++i) {
+		Input& varying = varyings[i];
+		ReflectedInput reflected;
+		reflected.name = hasher.hash(varying.name);
+		reflected.type = describeType(definitions, varying.type);
+		reflected.location = varying.location != reflectionNone ? varying.location : i;
+		reflection.varyings.push_back(reflected);
+	}
+
+	reflection.hashes = hashInterfaces(reflection);
+}
+
+InterfaceHashes krafix::hashInterfaces(const ShaderReflection& reflection) {
+	InterfaceHashes hashes;
+
+	std::vector<ReflectedInput> inputs = reflection.inputs;
+	std::sort(inputs.begin(), inputs.end(), [](const ReflectedInput& a, const ReflectedInput& b) { return a.location < b.location; });
+	InterfaceHash inputHash;
+	for (auto& input : inputs) {
+		inputHash.add(input.location);
+		inputHash.add(input.type);
+	}
+	hashes.vertexInput = inputHash.value;
+
+	InterfaceHash varyingHash;
+	for (auto& varying : reflection.varyings) {
+		varyingHash.add(varying.name);
+		varyingHash.add(varying.type);
+		varyingHash.add(varying.location);
+	}
+	hashes.varyings = varyingHash.value;
+
+	// Blocks and bound resources are identified by their bindings, names only matter for loose uniforms
+	std::vector<unsigned> blocks;
+	for (unsigned i = 0; i < reflection.blocks.size(); ++i) blocks.push_back(i);
+	std::sort(blocks.begin(), blocks.end(), [&](unsigned a, unsigned b) {
+		const ReflectedBlock& blockA = reflection.blocks[a];
+		const ReflectedBlock& blockB = reflection.blocks[b];
+		if (blockA.storage != blockB.storage) return blockA.storage < blockB.storage;
+		if (blockA.set != blockB.set) return blockA.set < blockB.set;
+		return blockA.binding < blockB.binding;
+	});
+	InterfaceHash resourceHash;
+	for (unsigned block : blocks) {
+		const ReflectedBlock& reflected = reflection.blocks[block];
+		resourceHash.add(reflected.storage);
+		resourceHash.add(reflected.set);
+		resourceHash.add(reflected.binding);
+		resourceHash.add(reflected.size);
+		for (auto& uniform : reflection.uniforms) {
+			if (uniform.block != block) continue;
+			resourceHash.add(uniform.type);
+			resourceHash.add(uniform.offset);
+			resourceHash.add(uniform.arrayLength);
+			resourceHash.add(uniform.arrayStride);
+		}
+	}
+	std::vector<ReflectedUniform> loose;
+	for (auto& uniform : reflection.uniforms) {
+		if (uniform.block == reflectionNone) loose.push_back(uniform);
+	}
+	std::sort(loose.begin(), loose.end(), [](const ReflectedUniform& a, const ReflectedUniform& b) { return a.name < b.name; });
+	for (auto& uniform : loose) {
+		resourceHash.add(uniform.name);
+		resourceHash.add(uniform.type);
+		resourceHash.add(uniform.arrayLength);
+	}
+	std::vector<ReflectedResource> resources = reflection.resources;
+	std::sort(resources.begin(), resources.end(), [](const ReflectedResource& a, const ReflectedResource& b) {
+		if (a.set != b.set) return a.set < b.set;
+		if (a.binding != b.binding) return a.binding < b.binding;
+		return a.name < b.name;
+	});
+	for (auto& resource : resources) {
+		if (resource.binding == reflectionNone) resourceHash.add(resource.name);
+		resourceHash.add(resource.type);
+		resourceHash.add(resource.set);
+		resourceHash.add(resource.binding);
+		resourceHash.add(resource.arrayLength);
+	}
+	hashes.resources = resourceHash.value;
+
+	return hashes;
+}
+
+bool krafix::compatibleStages(const ShaderReflection& vertex, const ShaderReflection& fragment, std::string& error) {
+	for (auto& input : fragment.varyings) {
+		bool found = false;
+		for (auto& output : vertex.varyings) {
+			if (output.name != input.name) continue;
+			found = true;
+			if (output.type != input.type) {
+				error = "a varying has different types in the vertex and fragment shader";
+				return false;
+			}
+		}
+		if (!found) {
+			error = "the fragment shader reads a varying which the vertex shader does not write";
+			return false;
+		}
+	}
+	return true;
+}
+
+bool krafix::writeReflection(const char* filename, const ShaderReflection& reflection) {
+	OutputFile out(filename);
+	ReflectionHeader header;
+	header.magic = reflectionMagic;
+	header.version = reflectionVersion;
+	header.stage = reflection.stage;
+	header.blocks = (uint32_t)reflection.blocks.size();
+	header.uniforms = (uint32_t)reflection.uniforms.size();
+	header.inputs = (uint32_t)reflection.inputs.size();
+	header.varyings = (uint32_t)reflection.varyings.size();
+	header.resources = (uint32_t)reflection.resources.size();
+	header.projection = reflection.projection;
+	header.reserved = 0;
+	header.vertexInputHash = reflection.hashes.vertexInput;
+	header.varyingHash = reflection.hashes.varyings;
+	header.resourceHash = reflection.hashes.resources;
+	out.write((const char*)&header, sizeof(header));
+	writeTable(out, reflection.blocks);
+	writeTable(out, reflection.uniforms);
+	writeTable(out, reflection.inputs);
+	writeTable(out, reflection.varyings);
+	writeTable(out, reflection.resources);
+	return out.close();
+}
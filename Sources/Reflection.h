@@ -0,0 +1,134 @@
+#pragma once
+
+#include "Translator.h"
+#include <stdint.h>
+
+namespace krafix {
+	// Layout of the reflection files written next to compiled shaders (<shader>.reflect).
+	// All values are little endian 32 bit words (64 bit for the hashes in the header),
+	// so runtimes can map a file and use it in place:
+	// the header is followed by header.blocks ReflectedBlocks, header.uniforms ReflectedUniforms,
+	// header.inputs ReflectedInputs, header.varyings ReflectedInputs and header.resources ReflectedResources.
+	// Names are stored as hashName() hashes, so lookups need no strings at load time.
+
+	const uint32_t reflectionMagic = 0x4c46524b; // KRFL
+	const uint32_t reflectionVersion = 3;
+	// Binding, location, block or offset which the backend assigns itself
+	const uint32_t reflectionNone = 0xffffffff;
+
+	enum ReflectedBaseType {
+		ReflectedFloat,
+		ReflectedInt,
+		ReflectedUint,
+		ReflectedBool,
+		ReflectedStruct,
+		ReflectedImage,
+		ReflectedSampler,
+		ReflectedSampledImage
+	};
+
+	enum ReflectedStorage {
+		ReflectedUniformBuffer,
+		ReflectedPushConstants
+	};
+
+	// What runtimes have to fold into the projection matrices of a vertex shader
+	enum ReflectedProjection {
+		ReflectedProjectionNone,
+		// Compiled without clip space fixups, depth has to be mapped like clipSpaceProjection
+		ReflectedProjectionHalfDepth
+	};
+
+	// Base type in the lowest byte, then vector size, then matrix columns
+	inline uint32_t reflectedType(ReflectedBaseType base, unsigned vectorSize, unsigned columns) {
+		return (uint32_t)base | (vectorSize << 8) | (columns << 16);
+	}
+
+	struct ReflectionHeader {
+		uint32_t magic;
+		uint32_t version;
+		uint32_t stage;
+		uint32_t blocks;
+		uint32_t uniforms;
+		uint32_t inputs;
+		uint32_t varyings;
+		uint32_t resources;
+		uint32_t projection;
+		uint32_t reserved;
+		uint64_t vertexInputHash;
+		uint64_t varyingHash;
+		uint64_t resourceHash;
+	};
+
+	struct ReflectedBlock {
+		uint32_t name;
+		uint32_t storage;
+		uint32_t set;
+		uint32_t binding;
+		uint32_t size;
+	};
+
+	// Loose uniforms use reflectionNone as block and offset
+	struct ReflectedUniform {
+		uint32_t name;
+		uint32_t type;
+		uint32_t block;
+		uint32_t offset;
+		uint32_t size;
+		uint32_t arrayLength;
+		uint32_t arrayStride;
+	};
+
+	struct ReflectedInput {
+		uint32_t name;
+		uint32_t type;
+		uint32_t location;
+	};
+
+	struct ReflectedResource {
+		uint32_t name;
+		uint32_t type;
+		uint32_t set;
+		uint32_t binding;
+		uint32_t arrayLength;
+	};
+
+	// Canonical hashes which are equal for equal interfaces, no matter in which order
+	// the shader source declares them, for deduplicating pipeline state and input layouts
+	struct InterfaceHashes {
+		// Locations and types of the vertex inputs
+		uint64_t vertexInput;
+		// Names, types and locations of the vertex outputs or fragment inputs
+		uint64_t varyings;
+		// Uniform blocks with their member layouts, loose uniforms and bound resources
+		uint64_t resources;
+	};
+
+	struct ShaderReflection {
+		ShaderStage stage;
+		std::vector<ReflectedBlock> blocks;
+		std::vector<ReflectedUniform> uniforms;
+		std::vector<ReflectedInput> inputs;
+		// Vertex shader outputs or fragment shader inputs
+		std::vector<ReflectedInput> varyings;
+		std::vector<ReflectedResource> resources;
+		InterfaceHashes hashes;
+		ReflectedProjection projection;
+	};
+
+	// 32 bit FNV-1a
+	uint32_t hashName(const std::string& name);
+
+	// Collects blocks, uniforms, vertex inputs, varyings and images of a module and hashes them.
+	// Vertex input locations are taken from attributes when the backend assigned them, then from
+	// Location decorations and otherwise follow the name order like in the SPIR-V output.
+	// The projection is left at ReflectedProjectionNone for the caller, which knows the target.
+	void reflect(const std::vector<unsigned>& spirv, ShaderStage stage, const std::map<std::string, int>& attributes, ShaderReflection& reflection);
+
+	InterfaceHashes hashInterfaces(const ShaderReflection& reflection);
+
+	// Checks that every varying the fragment shader reads is written by the vertex shader with the same type
+	bool compatibleStages(const ShaderReflection& vertex, const ShaderReflection& fragment, std::string& error);
+
+	bool writeReflection(const char* filename, const ShaderReflection& reflection);
+}
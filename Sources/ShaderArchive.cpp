@@ -0,0 +1,216 @@
+#include "ShaderArchive.h"
+#include "OutputFile.h"
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <stdio.h>
+#include <string.h>
+
+using namespace krafix;
+
+namespace {
+	struct StoredEntry {
+		std::string name;
+		std::vector<unsigned char> data;
+		uint32_t uncompressedSize;
+		uint32_t compression;
+	};
+
+	bool readFile(const char* filename, std::vector<unsigned char>& data) {
+		std::ifstream file(filename, std::ios::binary);
+		if (!file.is_open()) return false;
+		data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+		return true;
+	}
+
+	void readArchive(const std::vector<unsigned char>& archive, std::map<uint64_t, StoredEntry>& entries) {
+		if (archive.size() < sizeof(ArchiveHeader)) return;
+		const ArchiveHeader* header = (const ArchiveHeader*)archive.data();
+		if (header->magic != archiveMagic || header->version != archiveVersion) return;
+		size_t entriesStart = sizeof(ArchiveHeader) + header->buckets * sizeof(uint32_t);
+		if (entriesStart + header->entries * sizeof(ArchiveEntry) > archive.size()) return;
+		const ArchiveEntry* stored = (const ArchiveEntry*)&archive[entriesStart];
+		for (uint32_t i = 0; i < header->entries; ++i) {
+			const ArchiveEntry& entry = stored[i];
+			if ((size_t)entry.nameOffset + entry.nameLength > archive.size() || (size_t)entry.offset + entry.size > archive.size()) return;
+			StoredEntry& copy = entries[entry.key];
+			copy.name = std::string((const char*)&archive[entry.nameOffset], entry.nameLength);
+			copy.data.assign(archive.begin() + entry.offset, archive.begin() + entry.offset + entry.size);
+			copy.uncompressedSize = entry.uncompressedSize;
+			copy.compression = entry.compression;
+		}
+	}
+
+	void writeLength(std::vector<unsigned char>& out, unsigned length) {
+		while (length >= 255) {
+			out.push_back(255);
+			length -= 255;
+		}
+		out.push_back((unsigned char)length);
+	}
+
+	void writeLiterals(std::vector<unsigned char>& out, const std::vector<unsigned char>& data, unsigned start, unsigned length, unsigned matchNibble) {
+		out.push_back((unsigned char)(((length < 15 ? length : 15) << 4) | matchNibble));
+		if (length >= 15) writeLength(out, length - 15);
+		out.insert(out.end(), data.begin() + start, data.begin() + start + length);
+	}
+
+	bool readLength(const unsigned char* data, unsigned size, unsigned& in, unsigned& length) {
+		unsigned char byte;
+		do {
+			if (in >= size) return false;
+			byte = data[in++];
+			length += byte;
+		} while (byte == 255);
+		return true;
+	}
+
+	unsigned alignUp(unsigned value) {
+		return (value + archiveAlignment - 1) / archiveAlignment * archiveAlignment;
+	}
+}
+
+uint64_t krafix::archiveKey(const std::string& shader, const std::string& target, const std::string& variant) {
+	std::string key = shader + '\0' + target + '\0' + variant;
+	uint64_t hash = 14695981039346656037ull;
+	for (unsigned i = 0; i < key.size(); ++i) {
+		hash ^= (unsigned char)key[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+std::vector<unsigned char> krafix::compressLZ(const std::vector<unsigned char>& data) {
+	std::vector<unsigned char> out;
+	std::vector<int> table(4096, -1);
+	unsigned size = (unsigned)data.size();
+	unsigned literalStart = 0;
+	unsigned i = 0;
+	while (i + 4 <= size) {
+		uint32_t sequence;
+		memcpy(&sequence, &data[i], 4);
+		unsigned hash = (sequence * 2654435761u) >> 20;
+		int candidate = table[hash];
+		table[hash] = (int)i;
+		if (candidate < 0 || i - candidate > 0xffff || memcmp(&data[candidate], &data[i], 4) != 0) {
+			++i;
+			continue;
+		}
+		unsigned length = 4;
+		while (i + length < size && data[candidate + length] == data[i + length]) ++length;
+		unsigned offset = i - candidate;
+		writeLiterals(out, data, literalStart, i - literalStart, length - 4 < 15 ? length - 4 : 15);
+		out.push_back(offset & 0xff);
+		out.push_back(offset >> 8);
+		if (length - 4 >= 15) writeLength(out, length - 4 - 15);
+		i += length;
+		literalStart = i;
+	}
+	writeLiterals(out, data, literalStart, size - literalStart, 0);
+	return out;
+}
+
+bool krafix::decompressLZ(const unsigned char* data, unsigned size, unsigned char* output, unsigned outputSize) {
+	unsigned in = 0;
+	unsigned out = 0;
+	while (in < size) {
+		unsigned token = data[in++];
+		unsigned literals = token >> 4;
+		if (literals == 15 && !readLength(data, size, in, literals)) return false;
+		if (in + literals > size || out + literals > outputSize) return false;
+		memcpy(&output[out], &data[in], literals);
+		in += literals;
+		out += literals;
+		if (in == size) break;
+
+		if (in + 2 > size) return false;
+		unsigned offset = data[in] | (data[in + 1] << 8);
+		in += 2;
+		unsigned length = token & 15;
+		if (length == 15 && !readLength(data, size, in, length)) return false;
+		length += 4;
+		if (offset == 0 || offset > out || out + length > outputSize) return false;
+		for (unsigned i = 0; i < length; ++i, ++out) output[out] = output[out - offset];
+	}
+	return out == outputSize;
+}
+
+bool krafix::addToArchive(const char* archive, const std::string& target, const std::vector<ArchiveInput>& files, bool compress) {
+	std::map<uint64_t, StoredEntry> entries;
+	std::vector<unsigned char> existing;
+	if (readFile(archive, existing)) readArchive(existing, entries);
+
+	for (auto& file : files) {
+		std::vector<unsigned char> data;
+		if (!readFile(file.filename.c_str(), data)) {
+			printf("Warning: Could not read %s for the archive.\n", file.filename.c_str());
+			continue;
+		}
+		uint64_t key = archiveKey(file.shader, target, file.variant);
+		std::string name = file.shader + " " + target + " " + file.variant;
+		if (entries.find(key) != entries.end() && entries[key].name != name) {
+			printf("Warning: %s and %s have the same archive key.\n", entries[key].name.c_str(), name.c_str());
+		}
+		StoredEntry& entry = entries[key];
+		entry.name = name;
+		entry.uncompressedSize = (uint32_t)data.size();
+		entry.compression = ArchiveUncompressed;
+		entry.data = data;
+		if (compress) {
+			std::vector<unsigned char> compressed = compressLZ(data);
+			if (compressed.size() < data.size()) {
+				entry.compression = ArchiveLZ;
+				entry.data = compressed;
+			}
+		}
+	}
+
+	// At least two buckets keep the entries 8 byte aligned
+	unsigned buckets = 2;
+	while (buckets < entries.size() * 2) buckets *= 2;
+
+	ArchiveHeader header;
+	header.magic = archiveMagic;
+	header.version = archiveVersion;
+	header.entries = (uint32_t)entries.size();
+	header.buckets = buckets;
+
+	std::vector<uint32_t> bucketTable(buckets, archiveEmpty);
+	std::vector<ArchiveEntry> entryTable;
+	std::string names;
+	unsigned namesStart = (unsigned)(sizeof(ArchiveHeader) + buckets * sizeof(uint32_t) + entries.size() * sizeof(ArchiveEntry));
+	for (auto& entry : entries) {
+		ArchiveEntry stored;
+		stored.key = entry.first;
+		stored.nameOffset = namesStart + (uint32_t)names.size();
+		stored.nameLength = (uint32_t)entry.second.name.size();
+		stored.size = (uint32_t)entry.second.data.size();
+		stored.uncompressedSize = entry.second.uncompressedSize;
+		stored.compression = entry.second.compression;
+		names += entry.second.name;
+		unsigned bucket = (unsigned)(entry.first & (buckets - 1));
+		while (bucketTable[bucket] != archiveEmpty) bucket = (bucket + 1) & (buckets - 1);
+		bucketTable[bucket] = (uint32_t)entryTable.size();
+		entryTable.push_back(stored);
+	}
+	unsigned offset = alignUp(namesStart + (unsigned)names.size());
+	for (auto& stored : entryTable) {
+		stored.offset = offset;
+		offset = alignUp(offset + stored.size);
+	}
+
+	OutputFile out(archive);
+	out.write((const char*)&header, sizeof(header));
+	out.write((const char*)bucketTable.data(), bucketTable.size() * sizeof(uint32_t));
+	if (entryTable.size() > 0) out.write((const char*)entryTable.data(), entryTable.size() * sizeof(ArchiveEntry));
+	out.write(names.data(), names.size());
+	unsigned position = namesStart + (unsigned)names.size();
+	unsigned index = 0;
+	for (auto& entry : entries) {
+		for (; position < entryTable[index].offset; ++position) out.put(0);
+		out.write((const char*)entry.second.data.data(), entry.second.data.size());
+		position += (unsigned)entry.second.data.size();
+		++index;
+	}
+	return out.close();
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace krafix {
+	// Layout of shader archives, which hold every compiled variant of a project in one file.
+	// The header is followed by header.buckets uint32_t bucket entries, header.entries ArchiveEntries
+	// sorted by key, the key strings and the payloads, each payload aligned to archiveAlignment.
+	// A key hashes to bucket key & (buckets - 1), buckets are probed linearly and hold entry indices
+	// or archiveEmpty, so runtimes can map an archive and find entries in constant time.
+
+	const uint32_t archiveMagic = 0x4146524b; // KRFA
+	const uint32_t archiveVersion = 1;
+	const uint32_t archiveEmpty = 0xffffffff;
+	const uint32_t archiveAlignment = 16;
+
+	enum ArchiveCompression {
+		ArchiveUncompressed,
+		// LZ4 style block: sequences of a token (literal length << 4 | match length - 4),
+		// extra length bytes for nibbles of 15, literals and a 16 bit little endian match offset,
+		// the last sequence has literals only
+		ArchiveLZ
+	};
+
+	struct ArchiveHeader {
+		uint32_t magic;
+		uint32_t version;
+		uint32_t entries;
+		uint32_t buckets;
+	};
+
+	struct ArchiveEntry {
+		uint64_t key;
+		// Offsets are relative to the start of the archive
+		uint32_t nameOffset;
+		uint32_t nameLength;
+		uint32_t offset;
+		uint32_t size;
+		uint32_t uncompressedSize;
+		uint32_t compression;
+	};
+
+	// 64 bit FNV-1a of "shader\0target\0variant", shader is the output name without directory
+	// and variant (like "painter-colored.frag.essl"), variant the suffix (like "-tex4-inst")
+	uint64_t archiveKey(const std::string& shader, const std::string& target, const std::string& variant);
+
+	inline const ArchiveEntry* findArchiveEntry(const void* archive, uint64_t key) {
+		const ArchiveHeader* header = (const ArchiveHeader*)archive;
+		if (header->magic != archiveMagic || header->version != archiveVersion || header->buckets == 0) return nullptr;
+		const uint32_t* buckets = (const uint32_t*)(header + 1);
+		const ArchiveEntry* entries = (const ArchiveEntry*)(buckets + header->buckets);
+		for (uint32_t i = 0; i < header->buckets; ++i) {
+			uint32_t index = buckets[(key + i) & (header->buckets - 1)];
+			if (index == archiveEmpty) return nullptr;
+			if (entries[index].key == key) return &entries[index];
+		}
+		return nullptr;
+	}
+
+	std::vector<unsigned char> compressLZ(const std::vector<unsigned char>& data);
+	bool decompressLZ(const unsigned char* data, unsigned size, unsigned char* output, unsigned outputSize);
+
+	struct ArchiveInput {
+		std::string shader;
+		std::string variant;
+		std::string filename;
+	};
+
+	// Adds compiled files to an archive, replacing entries with the same keys and keeping all others.
+	// Entries are only stored compressed when that makes them smaller.
+	bool addToArchive(const char* archive, const std::string& target, const std::vector<ArchiveInput>& files, bool compress);
+}
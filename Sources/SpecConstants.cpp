@@ -0,0 +1,104 @@
+#include "SpecConstants.h"
+#include "OutputFile.h"
+#include <stdlib.h>
+
+using namespace krafix;
+
+namespace {
+	bool isIdentifierChar(char c) {
+		return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+	}
+
+	std::string trimmed(const std::string& line) {
+		size_t start = line.find_first_not_of(" \t\r");
+		if (start == std::string::npos) return "";
+		return line.substr(start, line.find_last_not_of(" \t\r") + 1 - start);
+	}
+}
+
+bool krafix::parseSpecConstant(const std::string& define, SpecConstant& constant) {
+	size_t equals = define.find('=');
+	constant.name = define.substr(0, equals);
+	std::string value = equals == std::string::npos ? "true" : define.substr(equals + 1);
+	if (value == "true" || value == "false") {
+		constant.boolean = true;
+		constant.value = value == "true" ? 1 : 0;
+		return true;
+	}
+	char* end;
+	long number = strtol(value.c_str(), &end, 0);
+	if (value.empty() || *end != 0) return false;
+	constant.boolean = false;
+	constant.value = (int)number;
+	return true;
+}
+
+std::string krafix::specConstantLiteral(const SpecConstant& constant, int value) {
+	if (constant.boolean) return value != 0 ? "true" : "false";
+	return std::to_string(value);
+}
+
+std::string krafix::replaceIdentifier(const std::string& text, const std::string& name, const std::string& replacement) {
+	std::string replaced;
+	size_t position = 0;
+	for (;;) {
+		size_t found = text.find(name, position);
+		if (found == std::string::npos) break;
+		size_t end = found + name.size();
+		bool whole = (found == 0 || !isIdentifierChar(text[found - 1])) && (end == text.size() || !isIdentifierChar(text[end]));
+		replaced += text.substr(position, found - position);
+		replaced += whole ? replacement : name;
+		position = end;
+	}
+	return replaced + text.substr(position);
+}
+
+std::string krafix::insertSpecConstants(const char* source, const std::vector<SpecConstant>& constants) {
+	std::string text = source;
+	size_t insert = 0;
+	unsigned headerLines = 0;
+	int version = 0;
+	bool es = false;
+	size_t position = 0;
+	for (unsigned line = 1; position < text.size(); ++line) {
+		size_t end = text.find('\n', position);
+		size_t next = end == std::string::npos ? text.size() : end + 1;
+		std::string content = trimmed(text.substr(position, next - position));
+		if (content.compare(0, 8, "#version") == 0) {
+			version = atoi(content.c_str() + 8);
+			es = content.find(" es") != std::string::npos;
+		}
+		else if (content.compare(0, 10, "#extension") != 0) {
+			if (content.empty() || content.compare(0, 2, "//") == 0) {
+				position = next;
+				continue;
+			}
+			break;
+		}
+		insert = next;
+		headerLines = line;
+		position = next;
+	}
+
+	std::string declarations = insert > 0 && text[insert - 1] != '\n' ? "\n" : "";
+	for (auto& constant : constants) {
+		declarations += "layout(constant_id = " + std::to_string(constant.id) + ") const " + (constant.boolean ? "bool " : "int ")
+			+ constant.name + " = " + specConstantLiteral(constant, constant.value) + ";\n";
+	}
+	// Before GLSL 330 #line sets the number of the line containing the directive
+	unsigned nextLine = headerLines + 1;
+	declarations += "#line " + std::to_string(es || version >= 330 ? nextLine : nextLine - 1) + "\n";
+	return text.substr(0, insert) + declarations + text.substr(insert);
+}
+
+bool krafix::writeSpecConstantTable(const char* filename, const std::vector<SpecConstant>& constants) {
+	OutputFile out(filename);
+	out << "{\n\t\"constants\": [";
+	for (size_t i = 0; i < constants.size(); ++i) {
+		const SpecConstant& constant = constants[i];
+		out << (i > 0 ? ",\n\t\t" : "\n\t\t") << "{ \"name\": \"" << constant.name << "\", \"id\": " << constant.id
+			<< ", \"type\": \"" << (constant.boolean ? "bool" : "int") << "\", \"default\": " << specConstantLiteral(constant, constant.value) << " }";
+	}
+	out << "\n\t]\n}\n";
+	return out.close();
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace krafix {
+	// A -D define which the spirv target turns into a specialization constant
+	// (layout(constant_id = id) const bool/int name = value), so one module covers all its values.
+	struct SpecConstant {
+		std::string name;
+		unsigned id;
+		bool boolean;
+		int value;
+	};
+
+	// Reads the value of a -D argument: NAME and NAME=true become true, NAME=false false
+	// and NAME=<integer> an int. Other values can not become specialization constants.
+	bool parseSpecConstant(const std::string& define, SpecConstant& constant);
+
+	// The GLSL literal for a value of the constant's type
+	std::string specConstantLiteral(const SpecConstant& constant, int value);
+
+	// Replaces whole identifiers only
+	std::string replaceIdentifier(const std::string& text, const std::string& name, const std::string& replacement);
+
+	// Declares the constants after the #version and #extension lines of a shader,
+	// followed by a #line directive which keeps the line numbers of the source
+	std::string insertSpecConstants(const char* source, const std::vector<SpecConstant>& constants);
+
+	// Writes a JSON table of the names, constant ids, types and default values
+	bool writeSpecConstantTable(const char* filename, const std::vector<SpecConstant>& constants);
+}
@@ -0,0 +1,225 @@
+#include "SpirVModule.h"
+#include <SPIRV/spirv.hpp>
+
+using namespace krafix;
+
+namespace {
+	bool isTypeDeclaration(unsigned opcode) {
+		using namespace spv;
+		return (opcode >= OpTypeVoid && opcode <= OpTypeFunction) || (opcode >= OpConstantTrue && opcode <= OpSpecConstantOp)
+			|| opcode == OpVariable || opcode == OpUndef;
+	}
+}
+
+SpirVModule::SpirVModule(const std::vector<unsigned>& spirv) : magicNumber(0), version(0), generator(0), bound(0), schema(0) {
+	if (spirv.size() < 5) return;
+
+	magicNumber = spirv[0];
+	version = spirv[1];
+	generator = spirv[2];
+	bound = spirv[3];
+	schema = spirv[4];
+
+	unsigned index = 5;
+	while (index < spirv.size()) {
+		unsigned wordCount = spirv[index] >> 16;
+		if (wordCount == 0) break;
+		SpirVInstruction inst(spirv[index] & 0xffff);
+		for (unsigned i = 1; i < wordCount && index + i < spirv.size(); ++i) {
+			inst.operands.push_back(spirv[index + i]);
+		}
+		instructions.push_back(inst);
+		index += wordCount;
+	}
+}
+
+void SpirVModule::write(std::vector<unsigned>& spirv) {
+	spirv.clear();
+	spirv.push_back(magicNumber);
+	spirv.push_back(version);
+	spirv.push_back(generator);
+	spirv.push_back(bound);
+	spirv.push_back(schema);
+
+	for (unsigned i = 0; i < instructions.size(); ++i) {
+		SpirVInstruction& inst = instructions[i];
+		spirv.push_back((((unsigned)inst.operands.size() + 1) << 16) | inst.opcode);
+		spirv.insert(spirv.end(), inst.operands.begin(), inst.operands.end());
+	}
+}
+
+unsigned SpirVModule::typesStart() {
+	for (unsigned i = 0; i < instructions.size(); ++i) {
+		if (isTypeDeclaration(instructions[i].opcode)) return i;
+	}
+	return functionsStart();
+}
+
+unsigned SpirVModule::functionsStart() {
+	for (unsigned i = 0; i < instructions.size(); ++i) {
+		if (instructions[i].opcode == spv::OpFunction) return i;
+	}
+	return (unsigned)instructions.size();
+}
+
+std::map<unsigned, std::string> SpirVModule::names() {
+	std::map<unsigned, std::string> names;
+	for (unsigned i = 0; i < instructions.size(); ++i) {
+		SpirVInstruction& inst = instructions[i];
+		if (inst.opcode == spv::OpName && inst.operands.size() > 1) {
+			std::string name = readString(inst.operands, 1);
+			if (name != "") names[inst.operands[0]] = name;
+		}
+	}
+	return names;
+}
+
+std::map<unsigned, unsigned> SpirVModule::resultTypes() {
+	std::map<unsigned, unsigned> types;
+	for (unsigned i = 0; i < instructions.size(); ++i) {
+		SpirVInstruction& inst = instructions[i];
+		if (hasResultType(inst.opcode) && inst.operands.size() > 1) {
+			types[inst.operands[1]] = inst.operands[0];
+		}
+	}
+	return types;
+}
+
+unsigned SpirVModule::pointerType(unsigned storage, unsigned type) {
+	unsigned start = functionsStart();
+	for (unsigned i = 0; i < start; ++i) {
+		SpirVInstruction& inst = instructions[i];
+		if (inst.opcode == spv::OpTypePointer && inst.operands[1] == storage && inst.operands[2] == type) return inst.operands[0];
+	}
+	unsigned pointer = newId();
+	addGlobal(SpirVInstruction(spv::OpTypePointer, { pointer, storage, type }));
+	return pointer;
+}
+
+void SpirVModule::addGlobal(const SpirVInstruction& inst) {
+	instructions.insert(instructions.begin() + functionsStart(), inst);
+}
+
+unsigned SpirVModule::namesEnd() {
+	unsigned index = 0;
+	unsigned start = typesStart();
+	for (unsigned i = 0; i < start; ++i) {
+		unsigned opcode = instructions[i].opcode;
+		if (opcode == spv::OpName || opcode == spv::OpMemberName) index = i + 1;
+		else if (index == 0 && (opcode == spv::OpDecorate || opcode == spv::OpMemberDecorate)) index = i;
+	}
+	if (index == 0) index = start;
+	return index;
+}
+
+void SpirVModule::addName(unsigned id, const std::string& name) {
+	SpirVInstruction inst(spv::OpName, { id });
+	appendString(inst.operands, name);
+	instructions.insert(instructions.begin() + namesEnd(), inst);
+}
+
+void SpirVModule::addMemberName(unsigned type, unsigned member, const std::string& name) {
+	SpirVInstruction inst(spv::OpMemberName, { type, member });
+	appendString(inst.operands, name);
+	instructions.insert(instructions.begin() + namesEnd(), inst);
+}
+
+void SpirVModule::addSourceExtension(const std::string& extension) {
+	unsigned index = 0;
+	for (unsigned i = 0; i < instructions.size(); ++i) {
+		unsigned opcode = instructions[i].opcode;
+		if (opcode == spv::OpSource || opcode == spv::OpSourceExtension) index = i + 1;
+	}
+	if (index == 0) {
+		index = namesEnd();
+		for (unsigned i = 0; i < index; ++i) {
+			if (instructions[i].opcode == spv::OpName || instructions[i].opcode == spv::OpMemberName) {
+				index = i;
+				break;
+			}
+		}
+	}
+	SpirVInstruction inst(spv::OpSourceExtension);
+	appendString(inst.operands, extension);
+	instructions.insert(instructions.begin() + index, inst);
+}
+
+void SpirVModule::addDecoration(const SpirVInstruction& inst) {
+	instructions.insert(instructions.begin() + typesStart(), inst);
+}
+
+void SpirVModule::addInterfaceVariable(unsigned variable) {
+	for (unsigned i = 0; i < instructions.size(); ++i) {
+		if (instructions[i].opcode == spv::OpEntryPoint) instructions[i].operands.push_back(variable);
+	}
+}
+
+void SpirVModule::removeInterfaceVariable(unsigned variable) {
+	for (unsigned i = 0; i < instructions.size(); ++i) {
+		SpirVInstruction& inst = instructions[i];
+		if (inst.opcode != spv::OpEntryPoint) continue;
+		for (unsigned i2 = interfaceStart(inst); i2 < inst.operands.size(); ++i2) {
+			if (inst.operands[i2] == variable) {
+				inst.operands.erase(inst.operands.begin() + i2);
+				break;
+			}
+		}
+	}
+}
+
+bool SpirVModule::hasResultType(unsigned opcode) {
+	using namespace spv;
+	switch (opcode) {
+	case OpUndef:
+	case OpExtInst:
+	case OpFunction:
+	case OpFunctionParameter:
+	case OpFunctionCall:
+	case OpVariable:
+	case OpImageTexelPointer:
+	case OpLoad:
+	case OpAccessChain:
+	case OpInBoundsAccessChain:
+	case OpPtrAccessChain:
+	case OpPhi:
+		return true;
+	case OpImageWrite:
+		return false;
+	default:
+		return (opcode >= OpConstantTrue && opcode <= OpSpecConstantOp)
+			|| (opcode >= OpVectorExtractDynamic && opcode <= OpTranspose)
+			|| (opcode >= OpSampledImage && opcode <= OpImageQuerySamples)
+			|| (opcode >= OpConvertFToU && opcode <= OpFwidthCoarse)
+			|| (opcode >= OpAtomicLoad && opcode <= OpAtomicXor && opcode != OpAtomicStore);
+	}
+}
+
+std::string SpirVModule::readString(const std::vector<unsigned>& operands, unsigned start) {
+	std::string string;
+	for (unsigned i = start; i < operands.size(); ++i) {
+		for (unsigned i2 = 0; i2 < 4; ++i2) {
+			char c = (char)((operands[i] >> (i2 * 8)) & 0xff);
+			if (c == 0) return string;
+			string += c;
+		}
+	}
+	return string;
+}
+
+void SpirVModule::appendString(std::vector<unsigned>& operands, const std::string& string) {
+	for (unsigned i = 0; i <= string.size(); i += 4) {
+		unsigned word = 0;
+		for (unsigned i2 = 0; i2 < 4; ++i2) {
+			if (i + i2 < string.size()) word |= (unsigned)(unsigned char)string[i + i2] << (i2 * 8);
+		}
+		operands.push_back(word);
+	}
+}
+
+unsigned SpirVModule::interfaceStart(const SpirVInstruction& entryPoint) {
+	for (unsigned i = 2; i < entryPoint.operands.size(); ++i) {
+		unsigned word = entryPoint.operands[i];
+		if ((word & 0xff000000) == 0 || (word & 0xff0000) == 0 || (word & 0xff00) == 0 || (word & 0xff) == 0) return i + 1;
+	}
+	return (unsigned)entryPoint.operands.size();
+}
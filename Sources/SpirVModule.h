@@ -0,0 +1,60 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace krafix {
+	struct SpirVInstruction {
+		unsigned opcode;
+		std::vector<unsigned> operands;
+
+		SpirVInstruction(unsigned opcode) : opcode(opcode) {}
+		SpirVInstruction(unsigned opcode, const std::vector<unsigned>& operands) : opcode(opcode), operands(operands) {}
+	};
+
+	// Editable copy of a SPIR-V binary for the SPIR-V to SPIR-V passes
+	// which run before a module is handed to a translator or to SPIRV-Cross.
+	class SpirVModule {
+	public:
+		SpirVModule(const std::vector<unsigned>& spirv);
+		void write(std::vector<unsigned>& spirv);
+		unsigned newId() { return bound++; }
+		// Index of the first instruction of the types, constants and global variables section
+		unsigned typesStart();
+		// Index of the first OpFunction
+		unsigned functionsStart();
+		std::map<unsigned, std::string> names();
+		// Maps every result id to its result type
+		std::map<unsigned, unsigned> resultTypes();
+		// Returns the pointer type to type in the given storage class, declaring it when necessary
+		unsigned pointerType(unsigned storage, unsigned type);
+		// Declares a type, constant or global variable after all existing ones
+		void addGlobal(const SpirVInstruction& inst);
+		void addName(unsigned id, const std::string& name);
+		void addMemberName(unsigned type, unsigned member, const std::string& name);
+		// Records a note about the module next to the source language information
+		void addSourceExtension(const std::string& extension);
+		void addDecoration(const SpirVInstruction& inst);
+		// Adds a global variable to the interfaces of all entry points or removes it from them
+		void addInterfaceVariable(unsigned variable);
+		void removeInterfaceVariable(unsigned variable);
+
+		static bool hasResultType(unsigned opcode);
+		static std::string readString(const std::vector<unsigned>& operands, unsigned start);
+		static void appendString(std::vector<unsigned>& operands, const std::string& string);
+		// Index of the first interface operand of an OpEntryPoint
+		static unsigned interfaceStart(const SpirVInstruction& entryPoint);
+
+		unsigned magicNumber;
+		unsigned version;
+		unsigned generator;
+		unsigned bound;
+		unsigned schema;
+		std::vector<SpirVInstruction> instructions;
+
+	private:
+		// Index behind the last name, where new names go
+		unsigned namesEnd();
+	};
+}
@@ -0,0 +1,537 @@
+#include "SpirVOptimizer.h"
+#include <SPIRV/spirv.hpp>
+#include <set>
+#include <string.h>
+
+using namespace krafix;
+
+namespace {
+	using namespace spv;
+
+	enum ScalarKind {
+		KindFloat,
+		KindInt,
+		KindUInt,
+		KindBool
+	};
+
+	struct TypeInfo {
+		ScalarKind kind;
+		unsigned count;
+		unsigned component;
+	};
+
+	float toFloat(unsigned word) {
+		float f;
+		memcpy(&f, &word, 4);
+		return f;
+	}
+
+	unsigned fromFloat(float f) {
+		unsigned word;
+		memcpy(&word, &f, 4);
+		return word;
+	}
+
+	bool isTerminator(unsigned opcode) {
+		return opcode == OpBranch || opcode == OpBranchConditional || opcode == OpSwitch || opcode == OpReturn
+			|| opcode == OpReturnValue || opcode == OpKill || opcode == OpUnreachable;
+	}
+
+	// Evaluates one component of a componentwise operation.
+	bool foldComponent(unsigned opcode, const std::vector<unsigned>& values, unsigned& result) {
+		unsigned a = values.size() > 0 ? values[0] : 0;
+		unsigned b = values.size() > 1 ? values[1] : 0;
+		float fa = toFloat(a);
+		float fb = toFloat(b);
+		int sa = (int)a;
+		int sb = (int)b;
+		switch (opcode) {
+		case OpFNegate: result = fromFloat(-fa); return true;
+		case OpFAdd: result = fromFloat(fa + fb); return true;
+		case OpFSub: result = fromFloat(fa - fb); return true;
+		case OpFMul:
+		case OpVectorTimesScalar: result = fromFloat(fa * fb); return true;
+		case OpFDiv:
+			if (fb == 0.0f) return false;
+			result = fromFloat(fa / fb);
+			return true;
+		case OpSNegate: result = (unsigned)-sa; return true;
+		case OpIAdd: result = a + b; return true;
+		case OpISub: result = a - b; return true;
+		case OpIMul: result = a * b; return true;
+		case OpSDiv:
+			if (sb == 0) return false;
+			result = (unsigned)(sa / sb);
+			return true;
+		case OpUDiv:
+			if (b == 0) return false;
+			result = a / b;
+			return true;
+		case OpFOrdEqual:
+		case OpFUnordEqual: result = fa == fb; return true;
+		case OpFOrdNotEqual:
+		case OpFUnordNotEqual: result = fa != fb; return true;
+		case OpFOrdLessThan:
+		case OpFUnordLessThan: result = fa < fb; return true;
+		case OpFOrdGreaterThan:
+		case OpFUnordGreaterThan: result = fa > fb; return true;
+		case OpFOrdLessThanEqual:
+		case OpFUnordLessThanEqual: result = fa <= fb; return true;
+		case OpFOrdGreaterThanEqual:
+		case OpFUnordGreaterThanEqual: result = fa >= fb; return true;
+		case OpIEqual:
+		case OpLogicalEqual: result = a == b; return true;
+		case OpINotEqual:
+		case OpLogicalNotEqual: result = a != b; return true;
+		case OpSLessThan: result = sa < sb; return true;
+		case OpSGreaterThan: result = sa > sb; return true;
+		case OpSLessThanEqual: result = sa <= sb; return true;
+		case OpSGreaterThanEqual: result = sa >= sb; return true;
+		case OpULessThan: result = a < b; return true;
+		case OpUGreaterThan: result = a > b; return true;
+		case OpULessThanEqual: result = a <= b; return true;
+		case OpUGreaterThanEqual: result = a >= b; return true;
+		case OpLogicalAnd: result = a && b; return true;
+		case OpLogicalOr: result = a || b; return true;
+		case OpLogicalNot: result = !a; return true;
+		case OpSelect: result = a ? b : values[2]; return true;
+		case OpConvertSToF: result = fromFloat((float)sa); return true;
+		case OpConvertUToF: result = fromFloat((float)a); return true;
+		case OpConvertFToS: result = (unsigned)(int)fa; return true;
+		case OpConvertFToU: result = (unsigned)fa; return true;
+		default:
+			return false;
+		}
+	}
+
+	bool isComponentwise(unsigned opcode) {
+		switch (opcode) {
+		case OpFNegate:
+		case OpFAdd:
+		case OpFSub:
+		case OpFMul:
+		case OpFDiv:
+		case OpVectorTimesScalar:
+		case OpSNegate:
+		case OpIAdd:
+		case OpISub:
+		case OpIMul:
+		case OpSDiv:
+		case OpUDiv:
+		case OpConvertSToF:
+		case OpConvertUToF:
+		case OpConvertFToS:
+		case OpConvertFToU:
+		case OpSelect:
+			return true;
+		default:
+			return opcode >= OpLogicalEqual && opcode <= OpFUnordGreaterThanEqual;
+		}
+	}
+
+	class ConstantFolder {
+	public:
+		ConstantFolder(SpirVModule& module) : module(module) {
+			unsigned functionsStart = module.functionsStart();
+			for (unsigned i = 0; i < functionsStart; ++i) {
+				SpirVInstruction& inst = module.instructions[i];
+				switch (inst.opcode) {
+				case OpTypeBool:
+					types[inst.operands[0]] = { KindBool, 1, inst.operands[0] };
+					break;
+				case OpTypeInt:
+					if (inst.operands[1] == 32) types[inst.operands[0]] = { inst.operands[2] ? KindInt : KindUInt, 1, inst.operands[0] };
+					break;
+				case OpTypeFloat:
+					if (inst.operands[1] == 32) types[inst.operands[0]] = { KindFloat, 1, inst.operands[0] };
+					break;
+				case OpTypeVector:
+					if (types.find(inst.operands[1]) != types.end()) types[inst.operands[0]] = { types[inst.operands[1]].kind, inst.operands[2], inst.operands[1] };
+					break;
+				case OpConstant:
+					if (types.find(inst.operands[0]) != types.end() && inst.operands.size() == 3) addScalar(inst.operands[0], inst.operands[1], inst.operands[2]);
+					break;
+				case OpConstantTrue:
+					addScalar(inst.operands[0], inst.operands[1], 1);
+					break;
+				case OpConstantFalse:
+					addScalar(inst.operands[0], inst.operands[1], 0);
+					break;
+				case OpConstantComposite: {
+					if (types.find(inst.operands[0]) == types.end()) break;
+					std::vector<unsigned> values;
+					for (unsigned i2 = 2; i2 < inst.operands.size(); ++i2) {
+						if (constants.find(inst.operands[i2]) == constants.end() || constants[inst.operands[i2]].size() != 1) break;
+						values.push_back(constants[inst.operands[i2]][0]);
+					}
+					if (values.size() == types[inst.operands[0]].count) constants[inst.operands[1]] = values;
+					break;
+				}
+				}
+			}
+		}
+
+		bool isConstant(unsigned id) {
+			return constants.find(id) != constants.end();
+		}
+
+		// Tries to evaluate inst, on success its result id is declared as a constant
+		bool fold(SpirVInstruction& inst) {
+			if (!SpirVModule::hasResultType(inst.opcode) || types.find(inst.operands[0]) == types.end()) return false;
+			TypeInfo& type = types[inst.operands[0]];
+			std::vector<unsigned> result;
+
+			if (isComponentwise(inst.opcode)) {
+				for (unsigned i = 2; i < inst.operands.size(); ++i) {
+					if (!isConstant(inst.operands[i])) return false;
+				}
+				for (unsigned c = 0; c < type.count; ++c) {
+					std::vector<unsigned> values;
+					for (unsigned i = 2; i < inst.operands.size(); ++i) {
+						std::vector<unsigned>& operand = constants[inst.operands[i]];
+						values.push_back(operand.size() == 1 ? operand[0] : operand[c]);
+					}
+					unsigned value;
+					if (!foldComponent(inst.opcode, values, value)) return false;
+					result.push_back(value);
+				}
+			}
+			else if (inst.opcode == OpCompositeExtract && inst.operands.size() == 4 && isConstant(inst.operands[2])) {
+				std::vector<unsigned>& composite = constants[inst.operands[2]];
+				if (inst.operands[3] >= composite.size()) return false;
+				result.push_back(composite[inst.operands[3]]);
+			}
+			else if (inst.opcode == OpCompositeConstruct) {
+				for (unsigned i = 2; i < inst.operands.size(); ++i) {
+					if (!isConstant(inst.operands[i])) return false;
+					result.insert(result.end(), constants[inst.operands[i]].begin(), constants[inst.operands[i]].end());
+				}
+			}
+			else if (inst.opcode == OpVectorShuffle && isConstant(inst.operands[2]) && isConstant(inst.operands[3])) {
+				std::vector<unsigned> both = constants[inst.operands[2]];
+				both.insert(both.end(), constants[inst.operands[3]].begin(), constants[inst.operands[3]].end());
+				for (unsigned i = 4; i < inst.operands.size(); ++i) {
+					if (inst.operands[i] >= both.size()) return false;
+					result.push_back(both[inst.operands[i]]);
+				}
+			}
+			else if (inst.opcode == OpDot && isConstant(inst.operands[2]) && isConstant(inst.operands[3])) {
+				std::vector<unsigned>& a = constants[inst.operands[2]];
+				std::vector<unsigned>& b = constants[inst.operands[3]];
+				float dot = 0.0f;
+				for (unsigned i = 0; i < a.size() && i < b.size(); ++i) dot += toFloat(a[i]) * toFloat(b[i]);
+				result.push_back(fromFloat(dot));
+			}
+			else {
+				return false;
+			}
+
+			if (result.size() != type.count) return false;
+			declare(inst.operands[0], inst.operands[1], result);
+			return true;
+		}
+
+		// Declares id as a constant of the given type
+		void declare(unsigned type, unsigned id, const std::vector<unsigned>& values) {
+			TypeInfo& info = types[type];
+			if (info.count == 1) {
+				newConstants.push_back(scalarInstruction(type, id, values[0]));
+				addScalar(type, id, values[0]);
+			}
+			else {
+				SpirVInstruction composite(OpConstantComposite, { type, id });
+				for (auto value : values) composite.operands.push_back(getScalar(info.component, value));
+				newConstants.push_back(composite);
+				constants[id] = values;
+			}
+		}
+
+		bool hasType(unsigned type) {
+			return types.find(type) != types.end();
+		}
+
+		std::vector<unsigned>& value(unsigned id) {
+			return constants[id];
+		}
+
+		std::vector<SpirVInstruction> newConstants;
+	private:
+		SpirVInstruction scalarInstruction(unsigned type, unsigned id, unsigned value) {
+			if (types[type].kind == KindBool) return SpirVInstruction(value ? OpConstantTrue : OpConstantFalse, { type, id });
+			return SpirVInstruction(OpConstant, { type, id, value });
+		}
+
+		void addScalar(unsigned type, unsigned id, unsigned value) {
+			constants[id] = std::vector<unsigned>(1, value);
+			std::pair<unsigned, unsigned> key(type, value);
+			if (scalars.find(key) == scalars.end()) scalars[key] = id;
+		}
+
+		unsigned getScalar(unsigned type, unsigned value) {
+			std::pair<unsigned, unsigned> key(type, value);
+			if (scalars.find(key) != scalars.end()) return scalars[key];
+			unsigned id = module.newId();
+			newConstants.push_back(scalarInstruction(type, id, value));
+			addScalar(type, id, value);
+			return id;
+		}
+
+		SpirVModule& module;
+		std::map<unsigned, TypeInfo> types;
+		std::map<unsigned, std::vector<unsigned>> constants;
+		std::map<std::pair<unsigned, unsigned>, unsigned> scalars;
+	};
+
+	struct Block {
+		unsigned label;
+		unsigned start;
+		unsigned end;
+	};
+
+	std::vector<unsigned> successors(SpirVInstruction& terminator) {
+		std::vector<unsigned> targets;
+		switch (terminator.opcode) {
+		case OpBranch:
+			targets.push_back(terminator.operands[0]);
+			break;
+		case OpBranchConditional:
+			targets.push_back(terminator.operands[1]);
+			targets.push_back(terminator.operands[2]);
+			break;
+		case OpSwitch:
+			targets.push_back(terminator.operands[1]);
+			for (unsigned i = 3; i < terminator.operands.size(); i += 2) targets.push_back(terminator.operands[i]);
+			break;
+		}
+		return targets;
+	}
+
+	// Removes unreachable blocks from the functions section and drops phi operands of removed edges
+	void removeUnreachableBlocks(std::vector<SpirVInstruction>& functions) {
+		std::vector<Block> blocks;
+		std::map<unsigned, unsigned> blockIndices;
+		std::set<unsigned> entries;
+		bool newFunction = true;
+		for (unsigned i = 0; i < functions.size(); ++i) {
+			if (functions[i].opcode == OpFunction) newFunction = true;
+			if (functions[i].opcode == OpLabel) {
+				Block block;
+				block.label = functions[i].operands[0];
+				block.start = i;
+				block.end = i;
+				while (block.end < functions.size() && !isTerminator(functions[block.end].opcode)) ++block.end;
+				blockIndices[block.label] = (unsigned)blocks.size();
+				blocks.push_back(block);
+				if (newFunction) entries.insert(block.label);
+				newFunction = false;
+			}
+		}
+
+		std::set<unsigned> reachable;
+		std::map<unsigned, std::set<unsigned>> predecessors;
+		std::vector<unsigned> work(entries.begin(), entries.end());
+		while (!work.empty()) {
+			unsigned label = work.back();
+			work.pop_back();
+			if (reachable.find(label) != reachable.end() || blockIndices.find(label) == blockIndices.end()) continue;
+			reachable.insert(label);
+			Block& block = blocks[blockIndices[label]];
+			if (block.end >= functions.size()) continue;
+			for (auto target : successors(functions[block.end])) {
+				predecessors[target].insert(label);
+				work.push_back(target);
+			}
+			if (block.end > block.start) {
+				SpirVInstruction& merge = functions[block.end - 1];
+				if (merge.opcode == OpSelectionMerge) work.push_back(merge.operands[0]);
+				if (merge.opcode == OpLoopMerge) {
+					work.push_back(merge.operands[0]);
+					work.push_back(merge.operands[1]);
+				}
+			}
+		}
+
+		std::vector<SpirVInstruction> kept;
+		unsigned currentBlock = 0;
+		bool keep = true;
+		for (unsigned i = 0; i < functions.size(); ++i) {
+			SpirVInstruction& inst = functions[i];
+			if (inst.opcode == OpLabel) {
+				currentBlock = inst.operands[0];
+				keep = reachable.find(currentBlock) != reachable.end();
+			}
+			else if (inst.opcode == OpFunctionEnd) {
+				keep = true;
+			}
+			if (!keep) continue;
+			if (inst.opcode == OpPhi) {
+				SpirVInstruction phi(OpPhi, { inst.operands[0], inst.operands[1] });
+				std::set<unsigned>& preds = predecessors[currentBlock];
+				for (unsigned i2 = 2; i2 + 1 < inst.operands.size(); i2 += 2) {
+					if (preds.find(inst.operands[i2 + 1]) != preds.end()) {
+						phi.operands.push_back(inst.operands[i2]);
+						phi.operands.push_back(inst.operands[i2 + 1]);
+					}
+				}
+				if (phi.operands.size() == 2) phi = SpirVInstruction(OpUndef, { inst.operands[0], inst.operands[1] });
+				kept.push_back(phi);
+			}
+			else {
+				kept.push_back(inst);
+			}
+			if (isTerminator(inst.opcode)) keep = false;
+		}
+		functions = kept;
+	}
+
+	// Instructions with a result which can not be removed when the result is unused, calls to
+	// extended instructions other than GLSL.std.450 are kept as well
+	bool hasSideEffects(const SpirVInstruction& inst, unsigned glslSet) {
+		switch (inst.opcode) {
+		case OpFunction:
+		case OpFunctionParameter:
+		case OpFunctionCall:
+			return true;
+		case OpExtInst:
+			return inst.operands[2] != glslSet;
+		default:
+			return inst.opcode >= OpAtomicLoad && inst.opcode <= OpAtomicXor;
+		}
+	}
+
+	bool isIgnoredUse(unsigned opcode) {
+		return opcode == OpName || opcode == OpMemberName || opcode == OpDecorate || opcode == OpMemberDecorate || opcode == OpEntryPoint;
+	}
+}
+
+void krafix::foldConstants(SpirVModule& module) {
+	ConstantFolder folder(module);
+	unsigned functionsStart = module.functionsStart();
+	std::vector<SpirVInstruction> functions(module.instructions.begin() + functionsStart, module.instructions.end());
+
+	bool changed = true;
+	bool branchesFolded = false;
+	while (changed) {
+		changed = false;
+		std::vector<SpirVInstruction> remaining;
+		for (unsigned i = 0; i < functions.size(); ++i) {
+			SpirVInstruction& inst = functions[i];
+			if (folder.fold(inst)) {
+				changed = true;
+				continue;
+			}
+			// A constant condition turns a selection into a plain branch
+			if (!remaining.empty() && remaining.back().opcode == OpSelectionMerge) {
+				if (inst.opcode == OpBranchConditional && folder.isConstant(inst.operands[0])) {
+					remaining.pop_back();
+					remaining.push_back(SpirVInstruction(OpBranch, { folder.value(inst.operands[0])[0] ? inst.operands[1] : inst.operands[2] }));
+					changed = branchesFolded = true;
+					continue;
+				}
+				if (inst.opcode == OpSwitch && folder.isConstant(inst.operands[0])) {
+					unsigned selector = folder.value(inst.operands[0])[0];
+					unsigned target = inst.operands[1];
+					for (unsigned i2 = 2; i2 + 1 < inst.operands.size(); i2 += 2) {
+						if (inst.operands[i2] == selector) target = inst.operands[i2 + 1];
+					}
+					remaining.pop_back();
+					remaining.push_back(SpirVInstruction(OpBranch, { target }));
+					changed = branchesFolded = true;
+					continue;
+				}
+			}
+			remaining.push_back(inst);
+		}
+		functions = remaining;
+	}
+
+	if (branchesFolded) removeUnreachableBlocks(functions);
+
+	std::vector<SpirVInstruction> instructions(module.instructions.begin(), module.instructions.begin() + functionsStart);
+	instructions.insert(instructions.end(), folder.newConstants.begin(), folder.newConstants.end());
+	instructions.insert(instructions.end(), functions.begin(), functions.end());
+	module.instructions = instructions;
+}
+
+void krafix::removeDeadCode(SpirVModule& module) {
+	unsigned glslSet = 0;
+	for (unsigned i = 0; i < module.instructions.size(); ++i) {
+		SpirVInstruction& inst = module.instructions[i];
+		if (inst.opcode == OpExtInstImport && SpirVModule::readString(inst.operands, 1) == "GLSL.std.450") glslSet = inst.operands[0];
+	}
+
+	std::vector<unsigned> removed;
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		std::map<unsigned, unsigned> uses;
+		for (unsigned i = 0; i < module.instructions.size(); ++i) {
+			SpirVInstruction& inst = module.instructions[i];
+			if (isIgnoredUse(inst.opcode)) continue;
+			for (unsigned i2 = 0; i2 < inst.operands.size(); ++i2) {
+				if (SpirVModule::hasResultType(inst.opcode) && i2 == 1) continue;
+				++uses[inst.operands[i2]];
+			}
+		}
+
+		unsigned functionsStart = module.functionsStart();
+		std::vector<SpirVInstruction> instructions;
+		for (unsigned i = 0; i < module.instructions.size(); ++i) {
+			SpirVInstruction& inst = module.instructions[i];
+			bool pure = SpirVModule::hasResultType(inst.opcode) && !hasSideEffects(inst, glslSet);
+			if (i >= functionsStart && pure && uses[inst.operands[1]] == 0) {
+				removed.push_back(inst.operands[1]);
+				changed = true;
+				continue;
+			}
+			instructions.push_back(inst);
+		}
+		module.instructions = instructions;
+	}
+	removeReferences(module, removed);
+}
+
+void krafix::removeReferences(SpirVModule& module, const std::vector<unsigned>& ids) {
+	std::set<unsigned> removed(ids.begin(), ids.end());
+	std::vector<SpirVInstruction> instructions;
+	for (unsigned i = 0; i < module.instructions.size(); ++i) {
+		SpirVInstruction& inst = module.instructions[i];
+		if ((inst.opcode == OpName || inst.opcode == OpDecorate) && removed.find(inst.operands[0]) != removed.end()) continue;
+		if (inst.opcode == OpEntryPoint) {
+			unsigned index = SpirVModule::interfaceStart(inst);
+			SpirVInstruction entryPoint(OpEntryPoint, std::vector<unsigned>(inst.operands.begin(), inst.operands.begin() + index));
+			for (; index < inst.operands.size(); ++index) {
+				if (removed.find(inst.operands[index]) == removed.end()) entryPoint.operands.push_back(inst.operands[index]);
+			}
+			instructions.push_back(entryPoint);
+			continue;
+		}
+		instructions.push_back(inst);
+	}
+	module.instructions = instructions;
+}
+
+void krafix::removeUnusedVariables(SpirVModule& module, const std::set<unsigned>& variables) {
+	std::set<unsigned> referenced;
+	unsigned functionsStart = module.functionsStart();
+	for (unsigned i = functionsStart; i < module.instructions.size(); ++i) {
+		for (auto operand : module.instructions[i].operands) {
+			if (variables.find(operand) != variables.end()) referenced.insert(operand);
+		}
+	}
+
+	std::vector<unsigned> unused;
+	std::vector<SpirVInstruction> instructions;
+	for (unsigned i = 0; i < module.instructions.size(); ++i) {
+		SpirVInstruction& inst = module.instructions[i];
+		if (i < functionsStart && inst.opcode == OpVariable && variables.find(inst.operands[1]) != variables.end() && referenced.find(inst.operands[1]) == referenced.end()) {
+			unused.push_back(inst.operands[1]);
+			continue;
+		}
+		instructions.push_back(inst);
+	}
+	if (unused.empty()) return;
+	module.instructions = instructions;
+	removeReferences(module, unused);
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "SpirVModule.h"
+#include <set>
+
+namespace krafix {
+	// Evaluates arithmetic, comparisons, selects and conditional branches on constant
+	// operands at compile time and removes the blocks which became unreachable.
+	void foldConstants(SpirVModule& module);
+
+	// Removes side effect free instructions whose results are never used
+	// together with their names and decorations. Calls, atomics and extended
+	// instructions outside of GLSL.std.450 are always kept.
+	void removeDeadCode(SpirVModule& module);
+
+	// Removes names, decorations and entry point references of the given ids.
+	void removeReferences(SpirVModule& module, const std::vector<unsigned>& ids);
+
+	// Removes those of the given global variables which are no longer referenced by any function.
+	void removeUnusedVariables(SpirVModule& module, const std::set<unsigned>& variables);
+}
@@ -0,0 +1,329 @@
+#include "SpirVShipping.h"
+#include <SPIRV/spirv.hpp>
+#include <algorithm>
+#include <set>
+
+using namespace krafix;
+
+namespace {
+	using namespace spv;
+
+	bool isTypeDeclaration(unsigned opcode) {
+		return opcode >= OpTypeVoid && opcode <= OpTypeFunction;
+	}
+
+	bool isDeclaration(unsigned opcode) {
+		return isTypeDeclaration(opcode) || (opcode >= OpConstantTrue && opcode <= OpSpecConstantOp) || opcode == OpVariable || opcode == OpUndef;
+	}
+
+	bool isInterface(unsigned storage) {
+		return storage == StorageClassUniformConstant || storage == StorageClassInput || storage == StorageClassUniform
+			|| storage == StorageClassOutput || storage == StorageClassPushConstant;
+	}
+
+	// Operand index of the id an instruction defines, -1 when it defines none
+	int resultIndex(unsigned opcode) {
+		if (SpirVModule::hasResultType(opcode) || opcode == OpArrayLength) return 1;
+		if (isTypeDeclaration(opcode) || opcode == OpString || opcode == OpExtInstImport || opcode == OpLabel || opcode == OpDecorationGroup) return 0;
+		return -1;
+	}
+
+	// Instructions whose operands isIdOperand knows, ids in other instructions can not be renumbered
+	bool isKnown(unsigned opcode) {
+		if (resultIndex(opcode) >= 0) return true;
+		switch (opcode) {
+		case OpNop:
+		case OpSourceContinued:
+		case OpSource:
+		case OpSourceExtension:
+		case OpName:
+		case OpMemberName:
+		case OpLine:
+		case OpNoLine:
+		case OpModuleProcessed:
+		case OpExtension:
+		case OpMemoryModel:
+		case OpEntryPoint:
+		case OpExecutionMode:
+		case OpCapability:
+		case OpFunctionEnd:
+		case OpStore:
+		case OpCopyMemory:
+		case OpDecorate:
+		case OpMemberDecorate:
+		case OpGroupDecorate:
+		case OpGroupMemberDecorate:
+		case OpImageWrite:
+		case OpEmitVertex:
+		case OpEndPrimitive:
+		case OpEmitStreamVertex:
+		case OpEndStreamPrimitive:
+		case OpControlBarrier:
+		case OpMemoryBarrier:
+		case OpAtomicStore:
+		case OpLoopMerge:
+		case OpSelectionMerge:
+		case OpBranch:
+		case OpBranchConditional:
+		case OpSwitch:
+		case OpKill:
+		case OpReturn:
+		case OpReturnValue:
+		case OpUnreachable:
+			return true;
+		}
+		return false;
+	}
+
+	// Whether an operand is an id rather than a literal number, enumerant or string
+	bool isIdOperand(const SpirVInstruction& inst, unsigned index) {
+		switch (inst.opcode) {
+		case OpSourceContinued:
+		case OpSourceExtension:
+		case OpModuleProcessed:
+		case OpExtension:
+		case OpMemoryModel:
+		case OpCapability:
+			return false;
+		case OpSource:
+			return index == 2;
+		case OpName:
+		case OpMemberName:
+		case OpLine:
+		case OpString:
+		case OpExtInstImport:
+		case OpExecutionMode:
+		case OpDecorate:
+		case OpMemberDecorate:
+		case OpTypeVoid:
+		case OpTypeBool:
+		case OpTypeInt:
+		case OpTypeFloat:
+		case OpTypeSampler:
+		case OpTypeOpaque:
+		case OpLabel:
+		case OpDecorationGroup:
+		case OpSelectionMerge:
+			return index == 0;
+		case OpTypeVector:
+		case OpTypeMatrix:
+		case OpTypeImage:
+		case OpStore:
+		case OpCopyMemory:
+		case OpLoopMerge:
+		case OpConstant:
+		case OpSpecConstant:
+		case OpConstantSampler:
+			return index <= 1;
+		case OpLoad:
+		case OpCompositeExtract:
+		case OpArrayLength:
+		case OpBranchConditional:
+			return index <= 2;
+		case OpVectorShuffle:
+		case OpCompositeInsert:
+			return index <= 3;
+		case OpTypePointer:
+			return index != 1;
+		case OpVariable:
+		case OpFunction:
+			return index != 2;
+		case OpExtInst:
+			return index != 3;
+		case OpEntryPoint:
+			return index == 1 || index >= SpirVModule::interfaceStart(inst);
+		case OpSwitch:
+			return index < 2 || index % 2 == 1;
+		case OpGroupMemberDecorate:
+			return index == 0 || index % 2 == 1;
+		case OpSpecConstantOp: {
+			if (index == 2) return false;
+			if (index < 2 || inst.operands.size() < 3) return true;
+			// The operands of the wrapped operation follow its opcode, without result type and id
+			SpirVInstruction operation(inst.operands[2], std::vector<unsigned>(inst.operands.size() - 1, 0));
+			return isIdOperand(operation, index - 1);
+		}
+		// Image operands start with a mask followed by ids
+		case OpImageWrite:
+			return index != 3;
+		case OpImageSampleImplicitLod:
+		case OpImageSampleExplicitLod:
+		case OpImageSampleProjImplicitLod:
+		case OpImageSampleProjExplicitLod:
+		case OpImageFetch:
+		case OpImageRead:
+			return index != 4;
+		case OpImageSampleDrefImplicitLod:
+		case OpImageSampleDrefExplicitLod:
+		case OpImageSampleProjDrefImplicitLod:
+		case OpImageSampleProjDrefExplicitLod:
+		case OpImageGather:
+		case OpImageDrefGather:
+			return index != 5;
+		}
+		return true;
+	}
+
+	// Orders declarations by their contents, ids of declarations are compared by their new positions
+	std::vector<unsigned> sortKey(const SpirVInstruction& inst, unsigned index, const std::map<unsigned, unsigned>& positions) {
+		// Variables keep their order, it is the order of the interface
+		if (inst.opcode == OpVariable) return { 2, index };
+		std::vector<unsigned> key = { isTypeDeclaration(inst.opcode) ? 0u : 1u, inst.opcode, (unsigned)inst.operands.size() };
+		int result = resultIndex(inst.opcode);
+		for (unsigned i = 0; i < inst.operands.size(); ++i) {
+			if ((int)i == result) continue;
+			auto position = positions.find(inst.operands[i]);
+			if (isIdOperand(inst, i) && position != positions.end()) key.push_back(position->second);
+			else key.push_back(inst.operands[i]);
+		}
+		key.push_back(index);
+		return key;
+	}
+}
+
+void krafix::stripDebugInformation(SpirVModule& module) {
+	std::map<unsigned, SpirVInstruction> types;
+	std::map<unsigned, unsigned> pointees;
+	std::vector<unsigned> pending;
+	std::set<unsigned> named;
+	std::set<unsigned> memberNamed;
+
+	unsigned functionsStart = module.functionsStart();
+	for (unsigned i = 0; i < functionsStart; ++i) {
+		SpirVInstruction& inst = module.instructions[i];
+		if (isTypeDeclaration(inst.opcode)) types.insert(std::make_pair(inst.operands[0], inst));
+		if (inst.opcode == OpTypePointer) pointees[inst.operands[0]] = inst.operands[2];
+	}
+	for (unsigned i = 0; i < functionsStart; ++i) {
+		SpirVInstruction& inst = module.instructions[i];
+		if (inst.opcode != OpVariable || !isInterface(inst.operands[2])) continue;
+		named.insert(inst.operands[1]);
+		pending.push_back(pointees[inst.operands[0]]);
+	}
+	while (!pending.empty()) {
+		auto type = types.find(pending.back());
+		pending.pop_back();
+		if (type == types.end()) continue;
+		SpirVInstruction& inst = type->second;
+		if (inst.opcode == OpTypeArray || inst.opcode == OpTypeRuntimeArray) {
+			pending.push_back(inst.operands[1]);
+		}
+		else if (inst.opcode == OpTypeStruct && memberNamed.find(inst.operands[0]) == memberNamed.end()) {
+			named.insert(inst.operands[0]);
+			memberNamed.insert(inst.operands[0]);
+			pending.insert(pending.end(), inst.operands.begin() + 1, inst.operands.end());
+		}
+	}
+
+	std::vector<SpirVInstruction> instructions;
+	for (unsigned i = 0; i < module.instructions.size(); ++i) {
+		SpirVInstruction& inst = module.instructions[i];
+		switch (inst.opcode) {
+		case OpSource:
+		case OpSourceContinued:
+		case OpString:
+		case OpLine:
+		case OpNoLine:
+		case OpModuleProcessed:
+			continue;
+		case OpSourceExtension:
+			if (SpirVModule::readString(inst.operands, 0).substr(0, 6) != "krafix") continue;
+			break;
+		case OpName:
+			if (named.find(inst.operands[0]) == named.end()) continue;
+			break;
+		case OpMemberName:
+			if (memberNamed.find(inst.operands[0]) == memberNamed.end()) continue;
+			break;
+		}
+		instructions.push_back(inst);
+	}
+	module.instructions = instructions;
+}
+
+void krafix::sortTypesAndConstants(SpirVModule& module) {
+	unsigned start = module.typesStart();
+	unsigned end = module.functionsStart();
+	std::vector<SpirVInstruction> declarations;
+	std::map<unsigned, unsigned> indices;
+	for (unsigned i = start; i < end; ++i) {
+		SpirVInstruction& inst = module.instructions[i];
+		// Debug lines or forward pointers between the declarations, leave them as they are
+		if (!isDeclaration(inst.opcode)) return;
+		indices[inst.operands[resultIndex(inst.opcode)]] = (unsigned)declarations.size();
+		declarations.push_back(inst);
+	}
+
+	std::vector<std::vector<unsigned>> dependencies(declarations.size());
+	for (unsigned i = 0; i < declarations.size(); ++i) {
+		SpirVInstruction& inst = declarations[i];
+		for (unsigned i2 = 0; i2 < inst.operands.size(); ++i2) {
+			if ((int)i2 == resultIndex(inst.opcode) || !isIdOperand(inst, i2)) continue;
+			auto dependency = indices.find(inst.operands[i2]);
+			if (dependency != indices.end()) dependencies[i].push_back(dependency->second);
+		}
+	}
+
+	// Always places the smallest declaration whose dependencies are already placed
+	std::map<unsigned, unsigned> positions;
+	std::vector<bool> placed(declarations.size(), false);
+	std::vector<SpirVInstruction> sorted;
+	while (sorted.size() < declarations.size()) {
+		int best = -1;
+		std::vector<unsigned> bestKey;
+		for (unsigned i = 0; i < declarations.size(); ++i) {
+			if (placed[i]) continue;
+			bool ready = true;
+			for (auto dependency : dependencies[i]) {
+				if (!placed[dependency]) ready = false;
+			}
+			if (!ready) continue;
+			std::vector<unsigned> key = sortKey(declarations[i], i, positions);
+			if (best < 0 || key < bestKey) {
+				best = i;
+				bestKey = key;
+			}
+		}
+		if (best < 0) return;
+		placed[best] = true;
+		SpirVInstruction& inst = declarations[best];
+		positions[inst.operands[resultIndex(inst.opcode)]] = (unsigned)sorted.size();
+		sorted.push_back(inst);
+	}
+
+	std::copy(sorted.begin(), sorted.end(), module.instructions.begin() + start);
+}
+
+void krafix::compactIds(SpirVModule& module) {
+	std::map<unsigned, unsigned> ids;
+	for (unsigned i = 0; i < module.instructions.size(); ++i) {
+		SpirVInstruction& inst = module.instructions[i];
+		if (!isKnown(inst.opcode)) return;
+		int result = resultIndex(inst.opcode);
+		if (result >= 0 && result < (int)inst.operands.size() && ids.find(inst.operands[result]) == ids.end()) {
+			unsigned id = (unsigned)ids.size() + 1;
+			ids[inst.operands[result]] = id;
+		}
+	}
+
+	// Names and decorations of removed ids are dropped, any other reference to an
+	// undefined id would collide with the new numbers
+	std::vector<SpirVInstruction> instructions;
+	for (unsigned i = 0; i < module.instructions.size(); ++i) {
+		SpirVInstruction inst = module.instructions[i];
+		bool dangling = false;
+		for (unsigned i2 = 0; i2 < inst.operands.size(); ++i2) {
+			if ((int)i2 != resultIndex(inst.opcode) && !isIdOperand(inst, i2)) continue;
+			auto id = ids.find(inst.operands[i2]);
+			if (id == ids.end()) dangling = true;
+			else inst.operands[i2] = id->second;
+		}
+		if (dangling) {
+			if (inst.opcode == OpName || inst.opcode == OpMemberName || inst.opcode == OpDecorate || inst.opcode == OpMemberDecorate) continue;
+			return;
+		}
+		instructions.push_back(inst);
+	}
+	module.instructions = instructions;
+	module.bound = (unsigned)ids.size() + 1;
+}
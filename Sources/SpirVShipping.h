@@ -0,0 +1,17 @@
+#pragma once
+
+#include "SpirVModule.h"
+
+namespace krafix {
+	// Removes OpSource, OpString, OpLine and the names of everything except the interface variables,
+	// their block types and the members of those blocks, which reflection and runtimes look up by name.
+	// Source extensions starting with "krafix" carry notes for runtimes and stay as well.
+	void stripDebugInformation(SpirVModule& module);
+
+	// Sorts the types and constants by their contents instead of the order in which
+	// they were first needed, so variants of a shader declare them the same way.
+	void sortTypesAndConstants(SpirVModule& module);
+
+	// Renumbers all ids densely in the order of their definitions and lowers the bound to match.
+	void compactIds(SpirVModule& module);
+}
@@ -1,9 +1,13 @@
 #include "SpirVTranslator.h"
+#include "OutputFile.h"
+#include "SpirVShipping.h"
+#include "UniformLayout.h"
 #include <SPIRV/spirv.hpp>
 #include "../glslang/glslang/Public/ShaderLang.h"
 #include <algorithm>
 #include <fstream>
 #include <map>
+#include <set>
 #include <string.h>
 #include <sstream>
 #include <strstream>
@@ -75,7 +79,7 @@ namespace {
 }
 
 void SpirVTranslator::writeInstructions(const char* filename, char* output, std::vector<Instruction>& instructions) {
-	std::ofstream fileout;
+	OutputFile fileout(output ? "" : filename);
 	std::ostrstream arrayout(output, 1024 * 1024);
 	std::ostream* out;
 
@@ -83,24 +87,32 @@ void SpirVTranslator::writeInstructions(const char* filename, char* output, std:
 		out = &arrayout;
 	}
 	else {
-		fileout.open(filename, std::ios::binary | std::ios::out);
 		out = &fileout;
 	}
 
-	writeInstruction(out, magicNumber);
-	writeInstruction(out, version);
-	writeInstruction(out, generator);
-	writeInstruction(out, bound);
-	writeInstruction(out, schema);
-
+	translated = { magicNumber, version, generator, bound, schema };
 	for (unsigned i = 0; i < instructions.size(); ++i) {
 		Instruction& inst = instructions[i];
-		writeInstruction(out, ((inst.length + 1) << 16) | (unsigned)inst.opcode);
+		translated.push_back(((inst.length + 1) << 16) | (unsigned)inst.opcode);
 		for (unsigned i2 = 0; i2 < inst.length; ++i2) {
-			writeInstruction(out, inst.operands[i2]);
+			translated.push_back(inst.operands[i2]);
 		}
 	}
 
+	// Reflection keeps using the complete module
+	std::vector<unsigned> words = translated;
+	if (shipping) {
+		SpirVModule module(translated);
+		stripDebugInformation(module);
+		sortTypesAndConstants(module);
+		compactIds(module);
+		module.write(words);
+	}
+
+	for (unsigned i = 0; i < words.size(); ++i) {
+		writeInstruction(out, words[i]);
+	}
+
 	if (!output) {
 		fileout.close();
 	}
@@ -134,6 +146,118 @@ namespace {
 		}
 	}
 
+	void collectLayoutTypes(std::vector<Instruction>& instructions, LayoutTypes& types, std::set<unsigned>& laidOut) {
+		std::map<unsigned, unsigned> constants;
+		for (unsigned i = 0; i < instructions.size(); ++i) {
+			Instruction& inst = instructions[i];
+			addLayoutType(types, constants, inst.opcode, inst.operands, inst.length);
+			if (inst.opcode == OpDecorate && inst.operands[1] == DecorationArrayStride) laidOut.insert(inst.operands[0]);
+			if (inst.opcode == OpMemberDecorate && inst.operands[2] == DecorationOffset) laidOut.insert(inst.operands[0]);
+		}
+	}
+
+	void outputMemberLayout(unsigned* instructionsData, unsigned& instructionsDataIndex, std::vector<unsigned>& structtypeindices, std::vector<Instruction>& newinstructions,
+		LayoutTypes& types, unsigned structtype, unsigned member, unsigned type, unsigned offset, bool std430) {
+		Instruction dec(OpMemberDecorate, &instructionsData[instructionsDataIndex], 4);
+		if (structtype == 0) structtypeindices.push_back(instructionsDataIndex);
+		instructionsData[instructionsDataIndex++] = structtype;
+		instructionsData[instructionsDataIndex++] = member;
+		instructionsData[instructionsDataIndex++] = DecorationOffset;
+		instructionsData[instructionsDataIndex++] = offset;
+		newinstructions.push_back(dec);
+
+		unsigned inner = innermostType(types, type);
+		if (types[inner].opcode == OpTypeMatrix) {
+			Instruction dec2(OpMemberDecorate, &instructionsData[instructionsDataIndex], 3);
+			if (structtype == 0) structtypeindices.push_back(instructionsDataIndex);
+			instructionsData[instructionsDataIndex++] = structtype;
+			instructionsData[instructionsDataIndex++] = member;
+			instructionsData[instructionsDataIndex++] = DecorationColMajor;
+			newinstructions.push_back(dec2);
+
+			Instruction dec3(OpMemberDecorate, &instructionsData[instructionsDataIndex], 4);
+			if (structtype == 0) structtypeindices.push_back(instructionsDataIndex);
+			instructionsData[instructionsDataIndex++] = structtype;
+			instructionsData[instructionsDataIndex++] = member;
+			instructionsData[instructionsDataIndex++] = DecorationMatrixStride;
+			instructionsData[instructionsDataIndex++] = matrixStride(types, inner, std430);
+			newinstructions.push_back(dec3);
+		}
+	}
+
+	// ArrayStride and member offsets for the arrays and structs nested in a uniform
+	void outputNestedLayout(unsigned* instructionsData, unsigned& instructionsDataIndex, std::vector<unsigned>& structtypeindices, std::vector<Instruction>& newinstructions,
+		LayoutTypes& types, std::set<unsigned>& laidOut, unsigned type, bool std430) {
+		LayoutType& t = types[type];
+		if (t.opcode != OpTypeArray && t.opcode != OpTypeStruct) return;
+		if (laidOut.find(type) != laidOut.end()) return;
+		laidOut.insert(type);
+		if (t.opcode == OpTypeArray) {
+			Instruction dec(OpDecorate, &instructionsData[instructionsDataIndex], 3);
+			instructionsData[instructionsDataIndex++] = type;
+			instructionsData[instructionsDataIndex++] = DecorationArrayStride;
+			instructionsData[instructionsDataIndex++] = arrayStride(types, type, std430);
+			newinstructions.push_back(dec);
+			outputNestedLayout(instructionsData, instructionsDataIndex, structtypeindices, newinstructions, types, laidOut, t.component, std430);
+		}
+		else {
+			std::vector<unsigned> members = t.members;
+			unsigned offset = 0;
+			for (unsigned i = 0; i < members.size(); ++i) {
+				Layout layout = typeLayout(types, members[i], std430);
+				offset = roundUp(offset, layout.alignment);
+				outputMemberLayout(instructionsData, instructionsDataIndex, structtypeindices, newinstructions, types, type, i, members[i], offset, std430);
+				offset += layout.size;
+				outputNestedLayout(instructionsData, instructionsDataIndex, structtypeindices, newinstructions, types, laidOut, members[i], std430);
+			}
+		}
+	}
+
+	// Orders uniforms by alignment and lets scalars fill the gaps after vec3s
+	void reorderUniforms(std::vector<Var>& uniforms, std::map<unsigned, unsigned>& pointers, LayoutTypes& types, bool std430) {
+		std::vector<Var> wide;
+		std::vector<Var> vec3s;
+		std::vector<Var> pairs;
+		std::vector<Var> scalars;
+		for (auto var : uniforms) {
+			unsigned type = pointers[var.type];
+			Layout layout = typeLayout(types, type, std430);
+			if (types[type].opcode == OpTypeVector && types[type].count == 3) vec3s.push_back(var);
+			else if (layout.alignment >= 16) wide.push_back(var);
+			else if (layout.alignment == 8) pairs.push_back(var);
+			else scalars.push_back(var);
+		}
+		uniforms = wide;
+		unsigned scalar = 0;
+		for (auto var : vec3s) {
+			uniforms.push_back(var);
+			if (scalar < scalars.size()) uniforms.push_back(scalars[scalar++]);
+		}
+		uniforms.insert(uniforms.end(), pairs.begin(), pairs.end());
+		uniforms.insert(uniforms.end(), scalars.begin() + scalar, scalars.end());
+	}
+
+	unsigned uniformBlockSize(std::vector<Var>& uniforms, std::map<unsigned, unsigned>& pointers, LayoutTypes& types, bool std430) {
+		unsigned offset = 0;
+		for (auto var : uniforms) {
+			Layout layout = typeLayout(types, pointers[var.type], std430);
+			offset = roundUp(offset, layout.alignment) + layout.size;
+		}
+		return offset;
+	}
+
+	// Notes for the runtime, placed in front of the other debug information
+	void outputSourceExtension(unsigned* instructionsData, unsigned& instructionsDataIndex, std::vector<Instruction>& newinstructions, const std::string& text) {
+		Instruction extension(OpSourceExtension, &instructionsData[instructionsDataIndex], 0);
+		extension.length = copyname(text, instructionsData, instructionsDataIndex);
+		for (unsigned i = 0; i < newinstructions.size(); ++i) {
+			if (isDebugInformation(newinstructions[i])) {
+				newinstructions.insert(newinstructions.begin() + i, extension);
+				break;
+			}
+		}
+	}
+
 	unsigned booltype = 0;
 	unsigned inttype = 0;
 	unsigned floattype = 0;
@@ -145,7 +269,8 @@ namespace {
 	unsigned mat2type = 0;
 
 	void outputDecorations(unsigned* instructionsData, unsigned& instructionsDataIndex, std::vector<unsigned>& structtypeindices, std::vector<Instruction>& newinstructions, std::vector<Var>& uniforms,
-		std::map<unsigned, unsigned>& pointers, std::vector<Var>& invars, std::vector<Var>& outvars, std::vector<Var>& images, ShaderStage stage) {
+		std::map<unsigned, unsigned>& pointers, std::vector<Var>& invars, std::vector<Var>& outvars, std::vector<Var>& images, ShaderStage stage,
+		LayoutTypes& types, std::set<unsigned>& laidOut, bool std430, StorageClass uniformStorage, unsigned uniformBinding) {
 
 		unsigned location = 0;
 		for (auto var : invars) {
@@ -176,41 +301,12 @@ namespace {
 		}
 		unsigned offset = 0;
 		for (unsigned i = 0; i < uniforms.size(); ++i) {
-			Instruction newinst(OpMemberDecorate, &instructionsData[instructionsDataIndex], 4);
-			structtypeindices.push_back(instructionsDataIndex);
-			instructionsData[instructionsDataIndex++] = 0;
-			instructionsData[instructionsDataIndex++] = i;
-			instructionsData[instructionsDataIndex++] = DecorationOffset;
-			instructionsData[instructionsDataIndex++] = offset;
-			newinstructions.push_back(newinst);
-
-			int utype = pointers[uniforms[i].type];
-
-			if (utype == mat2type || utype == mat3type || utype == mat4type) {
-				Instruction dec2(OpMemberDecorate, &instructionsData[instructionsDataIndex], 3);
-				structtypeindices.push_back(instructionsDataIndex);
-				instructionsData[instructionsDataIndex++] = 0;
-				instructionsData[instructionsDataIndex++] = i;
-				instructionsData[instructionsDataIndex++] = DecorationColMajor;
-				newinstructions.push_back(dec2);
-
-				Instruction dec3(OpMemberDecorate, &instructionsData[instructionsDataIndex], 4);
-				structtypeindices.push_back(instructionsDataIndex);
-				instructionsData[instructionsDataIndex++] = 0;
-				instructionsData[instructionsDataIndex++] = i;
-				instructionsData[instructionsDataIndex++] = DecorationMatrixStride;
-				instructionsData[instructionsDataIndex++] = 16;
-				newinstructions.push_back(dec3);
-			}
-			
-			if (utype == booltype || utype == inttype || utype == floattype) offset += 4;
-			else if (utype == vec2type) offset += 8;
-			else if (utype == vec3type) offset += 12;
-			else if (utype == vec4type) offset += 16;
-			else if (utype == mat2type) offset += 16;
-			else if (utype == mat3type) offset += 36;
-			else if (utype == mat4type) offset += 64;
-			else offset += 1; // Type not handled
+			unsigned utype = pointers[uniforms[i].type];
+			Layout layout = typeLayout(types, utype, std430);
+			offset = roundUp(offset, layout.alignment);
+			outputMemberLayout(instructionsData, instructionsDataIndex, structtypeindices, newinstructions, types, 0, i, utype, offset, std430);
+			offset += layout.size;
+			outputNestedLayout(instructionsData, instructionsDataIndex, structtypeindices, newinstructions, types, laidOut, utype, std430);
 		}
 		if (uniforms.size() > 0) {
 			Instruction dec1(OpDecorate, &instructionsData[instructionsDataIndex], 2);
@@ -219,18 +315,20 @@ namespace {
 			instructionsData[instructionsDataIndex++] = DecorationBlock;
 			newinstructions.push_back(dec1);
 
-			Instruction decbind(OpDecorate, &instructionsData[instructionsDataIndex], 3);
-			structtypeindices.push_back(instructionsDataIndex);
-			instructionsData[instructionsDataIndex++] = 0;
-			instructionsData[instructionsDataIndex++] = DecorationBinding;
-			instructionsData[instructionsDataIndex++] = stage == StageVertex ? 0 : 1;
-			newinstructions.push_back(decbind);
+			if (uniformStorage == StorageClassUniform) {
+				Instruction decbind(OpDecorate, &instructionsData[instructionsDataIndex], 3);
+				structtypeindices.push_back(instructionsDataIndex);
+				instructionsData[instructionsDataIndex++] = 0;
+				instructionsData[instructionsDataIndex++] = DecorationBinding;
+				instructionsData[instructionsDataIndex++] = uniformBinding;
+				newinstructions.push_back(decbind);
+			}
 		}
 	}
 
 	void outputTypes(unsigned* instructionsData, unsigned& instructionsDataIndex, std::vector<unsigned>& structtypeindices, unsigned& structvarindex, std::vector<Instruction>& newinstructions, std::vector<Var>& uniforms,
 		std::map<unsigned, unsigned>& pointers, std::map<unsigned, unsigned>& constants, unsigned& currentId, unsigned& structid, unsigned& floatpointertype,
-		unsigned& dotfive, unsigned& two, unsigned& three, unsigned& tempposition, ShaderStage stage) {
+		unsigned& dotfive, unsigned& two, unsigned& three, unsigned& tempposition, ShaderStage stage, StorageClass uniformStorage) {
 		if (uniforms.size() > 0) {
 			Instruction typestruct(OpTypeStruct, &instructionsData[instructionsDataIndex], 1 + uniforms.size());
 			unsigned structtype = instructionsData[instructionsDataIndex++] = currentId++;
@@ -241,14 +339,14 @@ namespace {
 			newinstructions.push_back(typestruct);
 			Instruction typepointer(OpTypePointer, &instructionsData[instructionsDataIndex], 3);
 			unsigned pointertype = instructionsData[instructionsDataIndex++] = currentId++;
-			instructionsData[instructionsDataIndex++] = StorageClassUniform;
+			instructionsData[instructionsDataIndex++] = uniformStorage;
 			instructionsData[instructionsDataIndex++] = structtype;
 			newinstructions.push_back(typepointer);
 			Instruction variable(OpVariable, &instructionsData[instructionsDataIndex], 3);
 			instructionsData[instructionsDataIndex++] = pointertype;
 			structid = instructionsData[instructionsDataIndex++] = currentId++;
 			instructionsData[structvarindex] = structid;
-			instructionsData[instructionsDataIndex++] = StorageClassUniform;
+			instructionsData[instructionsDataIndex++] = uniformStorage;
 			newinstructions.push_back(variable);
 
 			if (inttype == 0) {
@@ -268,7 +366,7 @@ namespace {
 				newinstructions.push_back(constant);
 				Instruction typepointer(OpTypePointer, &instructionsData[instructionsDataIndex], 3);
 				uniforms[i].pointertype = instructionsData[instructionsDataIndex++] = currentId++;
-				instructionsData[instructionsDataIndex++] = StorageClassUniform;
+				instructionsData[instructionsDataIndex++] = uniformStorage;
 				instructionsData[instructionsDataIndex++] = pointers[uniforms[i].type];
 				newinstructions.push_back(typepointer);
 			}
@@ -475,6 +573,21 @@ void SpirVTranslator::outputCode(const Target& target, const char* sourcefilenam
 	std::sort(outvars.begin(), outvars.end(), varcompare);
 	std::sort(images.begin(), images.end(), varcompare);
 
+	LayoutTypes layoutTypes;
+	std::set<unsigned> laidOut;
+	collectLayoutTypes(instructions, layoutTypes, laidOut);
+	// Both stages have to agree on the order, declaration order differs between them
+	if (sharedUniforms) std::sort(uniforms.begin(), uniforms.end(), varcompare);
+	if (packUniforms) reorderUniforms(uniforms, pointers, layoutTypes, std430);
+
+	// Push constants always use std430
+	StorageClass uniformStorage = StorageClassUniform;
+	if (pushConstantLimit > 0 && uniforms.size() > 0 && uniformBlockSize(uniforms, pointers, layoutTypes, true) <= pushConstantLimit) {
+		uniformStorage = StorageClassPushConstant;
+	}
+	bool uniformStd430 = std430 || uniformStorage == StorageClassPushConstant;
+	unsigned uniformBinding = sharedUniforms || stage == StageVertex ? 0 : 1;
+
 	SpirVState state = SpirVStart;
 	std::vector<Instruction> newinstructions;
 	unsigned instructionsData[4096];
@@ -513,7 +626,7 @@ void SpirVTranslator::outputCode(const Target& target, const char* sourcefilenam
 					namesInserted = true;
 				}
 				if (!decorationsInserted) {
-					outputDecorations(instructionsData, instructionsDataIndex, structtypeindices, newinstructions, uniforms, pointers, invars, outvars, images, stage);
+					outputDecorations(instructionsData, instructionsDataIndex, structtypeindices, newinstructions, uniforms, pointers, invars, outvars, images, stage, layoutTypes, laidOut, uniformStd430, uniformStorage, uniformBinding);
 					decorationsInserted = true;
 				}
 			}
@@ -525,7 +638,7 @@ void SpirVTranslator::outputCode(const Target& target, const char* sourcefilenam
 					namesInserted = true;
 				}
 				if (!decorationsInserted) {
-					outputDecorations(instructionsData, instructionsDataIndex, structtypeindices, newinstructions, uniforms, pointers, invars, outvars, images, stage);
+					outputDecorations(instructionsData, instructionsDataIndex, structtypeindices, newinstructions, uniforms, pointers, invars, outvars, images, stage, layoutTypes, laidOut, uniformStd430, uniformStorage, uniformBinding);
 					decorationsInserted = true;
 				}
 			}
@@ -539,7 +652,7 @@ void SpirVTranslator::outputCode(const Target& target, const char* sourcefilenam
 					namesInserted = true;
 				}
 				if (!decorationsInserted) {
-					outputDecorations(instructionsData, instructionsDataIndex, structtypeindices, newinstructions, uniforms, pointers, invars, outvars, images, stage);
+					outputDecorations(instructionsData, instructionsDataIndex, structtypeindices, newinstructions, uniforms, pointers, invars, outvars, images, stage, layoutTypes, laidOut, uniformStd430, uniformStorage, uniformBinding);
 					decorationsInserted = true;
 				}
 			}
@@ -547,7 +660,7 @@ void SpirVTranslator::outputCode(const Target& target, const char* sourcefilenam
 		case SpirVTypes:
 			if (inst.opcode == OpFunction) {
 				outputTypes(instructionsData, instructionsDataIndex, structtypeindices, structvarindex, newinstructions, uniforms, pointers, constants, currentId,
-					structid, floatpointertype, dotfive, two, three, tempposition, stage);
+					structid, floatpointertype, dotfive, two, three, tempposition, stage, uniformStorage);
 				state = SpirVFunctions;
 			}
 			break;
@@ -623,7 +736,7 @@ void SpirVTranslator::outputCode(const Target& target, const char* sourcefilenam
 			}
 		}
 		else if (inst.opcode == OpStore) {
-			if (stage == StageVertex) {
+			if (stage == StageVertex && clipSpaceFixup) {
 				//gl_Position.z = (gl_Position.z + gl_Position.w) * 0.5;
 				unsigned to = inst.operands[0];
 				unsigned from = inst.operands[1];
@@ -720,6 +833,17 @@ void SpirVTranslator::outputCode(const Target& target, const char* sourcefilenam
 		}
 	}
 	
+	if (stage == StageVertex && !clipSpaceFixup) {
+		outputSourceExtension(instructionsData, instructionsDataIndex, newinstructions, std::string("krafix projection: ") + clipSpaceProjection);
+	}
+	if (sharedUniforms && uniforms.size() > 0) {
+		outputSourceExtension(instructionsData, instructionsDataIndex, newinstructions, "krafix uniforms: shared");
+	}
+	if (pushConstantLimit > 0 && uniforms.size() > 0) {
+		outputSourceExtension(instructionsData, instructionsDataIndex, newinstructions,
+			uniformStorage == StorageClassPushConstant ? "krafix uniforms: push constants" : "krafix uniforms: uniform buffer");
+	}
+
 	bound = currentId + 1;
 	writeInstructions(filename, output, newinstructions);
 }
@@ -5,9 +5,23 @@
 namespace krafix {
 	class SpirVTranslator : public Translator {
 	public:
-		SpirVTranslator(std::vector<unsigned>& spirv, ShaderStage stage) : Translator(spirv, stage) {}
+		SpirVTranslator(std::vector<unsigned>& spirv, ShaderStage stage, bool clipSpaceFixup, bool std430, bool packUniforms, unsigned pushConstantLimit, bool sharedUniforms, bool shipping)
+			: Translator(spirv, stage), clipSpaceFixup(clipSpaceFixup), std430(std430), packUniforms(packUniforms), pushConstantLimit(pushConstantLimit), sharedUniforms(sharedUniforms), shipping(shipping) {}
 		void outputCode(const Target& target, const char* sourcefilename, const char* filename, char* output, std::map<std::string, int>& attributes) override;
+		const std::vector<unsigned>& interfaceSpirv() override { return translated; }
 	private:
 		void writeInstructions(const char* filename, char* output, std::vector<Instruction>& instructions);
+		bool clipSpaceFixup;
+		// Layout of _k_global_uniform_buffer, std140 unless std430 is set
+		bool std430;
+		// Reorders the uniforms in _k_global_uniform_buffer to minimize padding
+		bool packUniforms;
+		// Uses push constants instead of _k_global_uniform_buffer when the uniforms fit, 0 disables it
+		unsigned pushConstantLimit;
+		// Vertex and fragment shader declare the same uniforms and use one buffer at binding 0
+		bool sharedUniforms;
+		// Strips debug information, sorts types and constants and renumbers ids densely in the written module
+		bool shipping;
+		std::vector<unsigned> translated;
 	};
 }
@@ -75,6 +75,10 @@ namespace krafix {
 		}
 	};
 
+	// Recorded in the output of vertex shaders which are compiled without clip space fixups,
+	// runtimes have to fold it into their projection matrices to map depth from -1..1 to 0..1
+	const char* const clipSpaceProjection = "z = (z + w) * 0.5";
+
 	class Instruction {
 	public:
 		Instruction(std::vector<unsigned>& spirv, unsigned& index);
@@ -91,6 +95,8 @@ namespace krafix {
 		Translator(std::vector<unsigned>& spirv, ShaderStage stage);
 		virtual ~Translator() {}
 		virtual void outputCode(const Target& target, const char* sourcefilename, const char* filename, char* output, std::map<std::string, int>& attributes) = 0;
+		// SPIR-V with the interface of the generated code, used for reflection
+		virtual const std::vector<unsigned>& interfaceSpirv() { return spirv; }
 
 	protected:
 		std::vector<unsigned>& spirv;
@@ -0,0 +1,202 @@
+#include "UniformBaking.h"
+#include "SpirVOptimizer.h"
+#include <SPIRV/spirv.hpp>
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <stdio.h>
+#include <string.h>
+
+using namespace krafix;
+
+namespace {
+	using namespace spv;
+
+	struct BakeType {
+		unsigned opcode;
+		unsigned component;
+		unsigned count;
+		bool isSigned;
+	};
+
+	unsigned scalarCount(std::map<unsigned, BakeType>& types, unsigned type) {
+		BakeType& t = types[type];
+		if (t.opcode == OpTypeVector || t.opcode == OpTypeMatrix) return t.count * scalarCount(types, t.component);
+		return 1;
+	}
+
+	unsigned parseScalar(BakeType& type, const std::string& value) {
+		switch (type.opcode) {
+		case OpTypeBool:
+			return value == "true" || (value != "false" && std::stoi(value) != 0);
+		case OpTypeInt:
+			if (type.isSigned) return (unsigned)std::stoi(value);
+			return (unsigned)std::stoul(value);
+		default: {
+			float f = std::stof(value);
+			unsigned word;
+			memcpy(&word, &f, 4);
+			return word;
+		}
+		}
+	}
+
+	unsigned buildConstant(SpirVModule& module, std::map<unsigned, BakeType>& types, unsigned type, const std::vector<std::string>& values, unsigned& index, unsigned id, std::vector<SpirVInstruction>& constants) {
+		BakeType& t = types[type];
+		if (id == 0) id = module.newId();
+		if (t.opcode == OpTypeVector || t.opcode == OpTypeMatrix) {
+			SpirVInstruction composite(OpConstantComposite, { type, id });
+			for (unsigned i = 0; i < t.count; ++i) {
+				composite.operands.push_back(buildConstant(module, types, t.component, values, index, 0, constants));
+			}
+			constants.push_back(composite);
+		}
+		else if (t.opcode == OpTypeBool) {
+			constants.push_back(SpirVInstruction(parseScalar(t, values[index++]) ? OpConstantTrue : OpConstantFalse, { type, id }));
+		}
+		else {
+			constants.push_back(SpirVInstruction(OpConstant, { type, id, parseScalar(t, values[index++]) }));
+		}
+		return id;
+	}
+
+	std::set<unsigned> referencedVariables(SpirVModule& module, const std::set<unsigned>& variables) {
+		std::set<unsigned> referenced;
+		unsigned start = module.functionsStart();
+		for (unsigned i = start; i < module.instructions.size(); ++i) {
+			for (auto operand : module.instructions[i].operands) {
+				if (variables.find(operand) != variables.end()) referenced.insert(operand);
+			}
+		}
+		return referenced;
+	}
+}
+
+bool krafix::readBakedUniforms(const char* filename, BakedUniforms& uniforms) {
+	std::ifstream file(filename);
+	if (!file.is_open()) return false;
+	std::string line;
+	while (getline(file, line)) {
+		line = line.substr(0, line.find('#'));
+		for (unsigned i = 0; i < line.size(); ++i) {
+			if (line[i] == '=' || line[i] == ',' || line[i] == '\t' || line[i] == '\r') line[i] = ' ';
+		}
+		std::stringstream stream(line);
+		std::string name;
+		if (!(stream >> name)) continue;
+		std::vector<std::string> values;
+		std::string value;
+		while (stream >> value) values.push_back(value);
+		uniforms[name] = values;
+	}
+	return true;
+}
+
+void krafix::bakeUniforms(SpirVModule& module, const BakedUniforms& uniforms) {
+	std::map<unsigned, std::string> names = module.names();
+	std::map<unsigned, BakeType> types;
+	std::map<unsigned, unsigned> pointers;
+	std::map<unsigned, unsigned> candidates;
+	std::set<unsigned> uniformConstants;
+	unsigned functionsStart = module.functionsStart();
+
+	for (unsigned i = 0; i < functionsStart; ++i) {
+		SpirVInstruction& inst = module.instructions[i];
+		switch (inst.opcode) {
+		case OpTypeBool:
+		case OpTypeFloat:
+			types[inst.operands[0]] = { inst.opcode, 0, 1, false };
+			break;
+		case OpTypeInt:
+			types[inst.operands[0]] = { inst.opcode, 0, 1, inst.operands[2] != 0 };
+			break;
+		case OpTypeVector:
+		case OpTypeMatrix:
+			types[inst.operands[0]] = { inst.opcode, inst.operands[1], inst.operands[2], false };
+			break;
+		case OpTypePointer:
+			pointers[inst.operands[0]] = inst.operands[2];
+			break;
+		case OpVariable: {
+			if (inst.operands[2] != StorageClassUniformConstant) break;
+			unsigned id = inst.operands[1];
+			uniformConstants.insert(id);
+			unsigned type = pointers[inst.operands[0]];
+			if (names.find(id) == names.end() || uniforms.find(names[id]) == uniforms.end()) break;
+			if (types.find(type) == types.end()) {
+				printf("Warning: Uniform %s can not be baked, only scalars, vectors and matrices are supported.\n", names[id].c_str());
+				break;
+			}
+			candidates[id] = type;
+			break;
+		}
+		}
+	}
+
+	std::set<unsigned> usedBefore = referencedVariables(module, uniformConstants);
+
+	for (unsigned i = functionsStart; i < module.instructions.size(); ++i) {
+		SpirVInstruction& inst = module.instructions[i];
+		for (unsigned i2 = 0; i2 < inst.operands.size(); ++i2) {
+			if (inst.opcode == OpLoad && i2 == 2) continue;
+			if (candidates.find(inst.operands[i2]) != candidates.end()) {
+				printf("Warning: Uniform %s can not be baked, it is not only loaded directly.\n", names[inst.operands[i2]].c_str());
+				candidates.erase(inst.operands[i2]);
+			}
+		}
+	}
+
+	for (auto it = candidates.begin(); it != candidates.end();) {
+		const std::vector<std::string>& values = uniforms.at(names[it->first]);
+		if (values.size() != scalarCount(types, it->second)) {
+			printf("Warning: Uniform %s can not be baked, it needs %u values.\n", names[it->first].c_str(), scalarCount(types, it->second));
+			it = candidates.erase(it);
+		}
+		else {
+			++it;
+		}
+	}
+
+	if (candidates.empty()) return;
+
+	std::vector<SpirVInstruction> constants;
+	std::vector<SpirVInstruction> functions;
+	std::vector<unsigned> removed;
+	try {
+		for (unsigned i = functionsStart; i < module.instructions.size(); ++i) {
+			SpirVInstruction& inst = module.instructions[i];
+			if (inst.opcode == OpLoad && candidates.find(inst.operands[2]) != candidates.end()) {
+				unsigned index = 0;
+				buildConstant(module, types, inst.operands[0], uniforms.at(names[inst.operands[2]]), index, inst.operands[1], constants);
+			}
+			else {
+				functions.push_back(inst);
+			}
+		}
+	}
+	catch (std::exception&) {
+		printf("Warning: Could not parse the baked uniform values.\n");
+		return;
+	}
+
+	std::vector<SpirVInstruction> instructions;
+	for (unsigned i = 0; i < functionsStart; ++i) {
+		SpirVInstruction& inst = module.instructions[i];
+		if (inst.opcode == OpVariable && candidates.find(inst.operands[1]) != candidates.end()) {
+			removed.push_back(inst.operands[1]);
+			continue;
+		}
+		instructions.push_back(inst);
+	}
+	instructions.insert(instructions.end(), constants.begin(), constants.end());
+	instructions.insert(instructions.end(), functions.begin(), functions.end());
+	module.instructions = instructions;
+	removeReferences(module, removed);
+
+	foldConstants(module);
+	removeDeadCode(module);
+
+	// Uniforms which were only used in code that depended on baked values
+	removeUnusedVariables(module, usedBefore);
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include "SpirVModule.h"
+
+namespace krafix {
+	typedef std::map<std::string, std::vector<std::string>> BakedUniforms;
+
+	// Reads a file of "name = value, value, ..." lines (# starts a comment).
+	// Matrices are given column by column.
+	bool readBakedUniforms(const char* filename, BakedUniforms& uniforms);
+
+	// Replaces all loads of the given uniforms with constants, folds the result and removes
+	// the uniforms as well as everything which is no longer used because of them.
+	void bakeUniforms(SpirVModule& module, const BakedUniforms& uniforms);
+}
@@ -0,0 +1,284 @@
+#include "UniformGroups.h"
+#include "SpirVOptimizer.h"
+#include "UniformLayout.h"
+#include <SPIRV/spirv.hpp>
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <stdio.h>
+
+using namespace krafix;
+
+namespace {
+	using namespace spv;
+
+	const char* groupNames[UniformGroupCount] = { "frame", "material", "draw" };
+
+	unsigned groupOf(const std::string& name, const UniformGroups& groups, bool byPrefix) {
+		auto group = groups.find(name);
+		if (group != groups.end()) return group->second;
+		if (byPrefix) {
+			for (unsigned i = 0; i < UniformGroupCount; ++i) {
+				std::string prefix = std::string(groupNames[i]) + "_";
+				if (name.compare(0, prefix.size(), prefix) == 0) return i;
+			}
+		}
+		return UniformGroupCount;
+	}
+
+	unsigned intConstant(SpirVModule& module, unsigned value) {
+		unsigned intType = 0;
+		unsigned functionsStart = module.functionsStart();
+		for (unsigned i = 0; i < functionsStart; ++i) {
+			SpirVInstruction& inst = module.instructions[i];
+			if (inst.opcode == OpTypeInt && inst.operands[1] == 32 && inst.operands[2] == 1) intType = inst.operands[0];
+		}
+		if (intType == 0) {
+			intType = module.newId();
+			module.addGlobal(SpirVInstruction(OpTypeInt, { intType, 32, 1 }));
+		}
+		for (unsigned i = 0; i < functionsStart; ++i) {
+			SpirVInstruction& inst = module.instructions[i];
+			if (inst.opcode == OpConstant && inst.operands[0] == intType && inst.operands[2] == value) return inst.operands[1];
+		}
+		unsigned id = module.newId();
+		module.addGlobal(SpirVInstruction(OpConstant, { intType, id, value }));
+		return id;
+	}
+
+	void decorateMember(SpirVModule& module, LayoutTypes& types, unsigned structType, unsigned member, unsigned type, unsigned offset) {
+		module.addDecoration(SpirVInstruction(OpMemberDecorate, { structType, member, DecorationOffset, offset }));
+		unsigned inner = innermostType(types, type);
+		if (types[inner].opcode == OpTypeMatrix) {
+			module.addDecoration(SpirVInstruction(OpMemberDecorate, { structType, member, DecorationColMajor }));
+			module.addDecoration(SpirVInstruction(OpMemberDecorate, { structType, member, DecorationMatrixStride, matrixStride(types, inner, false) }));
+		}
+	}
+
+	// ArrayStride and member offsets for the arrays and structs nested in a block
+	void decorateNested(SpirVModule& module, LayoutTypes& types, std::set<unsigned>& laidOut, unsigned type) {
+		LayoutType& t = types[type];
+		if (t.opcode != OpTypeArray && t.opcode != OpTypeStruct) return;
+		if (laidOut.find(type) != laidOut.end()) return;
+		laidOut.insert(type);
+		if (t.opcode == OpTypeArray) {
+			module.addDecoration(SpirVInstruction(OpDecorate, { type, DecorationArrayStride, arrayStride(types, type, false) }));
+			decorateNested(module, types, laidOut, t.component);
+		}
+		else {
+			std::vector<unsigned> members = t.members;
+			unsigned offset = 0;
+			for (unsigned i = 0; i < members.size(); ++i) {
+				Layout layout = typeLayout(types, members[i], false);
+				offset = roundUp(offset, layout.alignment);
+				decorateMember(module, types, type, i, members[i], offset);
+				offset += layout.size;
+				decorateNested(module, types, laidOut, members[i]);
+			}
+		}
+	}
+}
+
+const char* krafix::uniformGroupName(unsigned group) {
+	return group < UniformGroupCount ? groupNames[group] : "";
+}
+
+bool krafix::readUniformGroups(const char* filename, UniformGroups& groups) {
+	std::ifstream file(filename);
+	if (!file.is_open()) return false;
+	std::string line;
+	while (getline(file, line)) {
+		line = line.substr(0, line.find('#'));
+		for (unsigned i = 0; i < line.size(); ++i) {
+			if (line[i] == '=' || line[i] == ',' || line[i] == '\t' || line[i] == '\r') line[i] = ' ';
+		}
+		std::stringstream stream(line);
+		std::string group;
+		if (!(stream >> group)) continue;
+		unsigned index = 0;
+		while (index < UniformGroupCount && group != groupNames[index]) ++index;
+		if (index == UniformGroupCount) {
+			printf("Warning: Unknown uniform group %s, groups are frame, material and draw.\n", group.c_str());
+			continue;
+		}
+		std::string name;
+		while (stream >> name) groups[name] = index;
+	}
+	return true;
+}
+
+unsigned krafix::groupUniforms(SpirVModule& module, const UniformGroups& groups, bool byPrefix) {
+	std::map<unsigned, std::string> names = module.names();
+	LayoutTypes types;
+	std::map<unsigned, unsigned> constants;
+	std::map<unsigned, unsigned> pointees;
+	// Samplers, images and booleans, which can not be block members
+	std::set<unsigned> opaque;
+	std::set<unsigned> booleans;
+	std::set<unsigned> laidOut;
+	// Grouped variables mapped to their groups
+	std::map<unsigned, unsigned> candidates;
+	unsigned functionsStart = module.functionsStart();
+
+	for (unsigned i = 0; i < functionsStart; ++i) {
+		SpirVInstruction& inst = module.instructions[i];
+		addLayoutType(types, constants, inst.opcode, inst.operands.data(), (unsigned)inst.operands.size());
+		switch (inst.opcode) {
+		case OpTypeImage:
+		case OpTypeSampler:
+		case OpTypeSampledImage:
+			opaque.insert(inst.operands[0]);
+			break;
+		case OpTypeBool:
+			booleans.insert(inst.operands[0]);
+			break;
+		case OpTypeVector:
+		case OpTypeMatrix:
+		case OpTypeArray:
+		case OpTypeRuntimeArray:
+			if (opaque.find(inst.operands[1]) != opaque.end()) opaque.insert(inst.operands[0]);
+			if (booleans.find(inst.operands[1]) != booleans.end()) booleans.insert(inst.operands[0]);
+			break;
+		case OpTypeStruct:
+			for (unsigned i2 = 1; i2 < inst.operands.size(); ++i2) {
+				if (opaque.find(inst.operands[i2]) != opaque.end()) opaque.insert(inst.operands[0]);
+				if (booleans.find(inst.operands[i2]) != booleans.end()) booleans.insert(inst.operands[0]);
+			}
+			break;
+		case OpTypePointer:
+			pointees[inst.operands[0]] = inst.operands[2];
+			break;
+		case OpDecorate:
+			if (inst.operands[1] == DecorationArrayStride) laidOut.insert(inst.operands[0]);
+			break;
+		case OpMemberDecorate:
+			if (inst.operands[2] == DecorationOffset) laidOut.insert(inst.operands[0]);
+			break;
+		case OpVariable: {
+			unsigned id = inst.operands[1];
+			if (inst.operands[2] != StorageClassUniformConstant || names.find(id) == names.end()) break;
+			unsigned group = groupOf(names[id], groups, byPrefix);
+			unsigned type = pointees[inst.operands[0]];
+			if (group == UniformGroupCount || opaque.find(type) != opaque.end()) break;
+			if (booleans.find(type) != booleans.end()) {
+				printf("Warning: Uniform %s can not be grouped, uniform blocks can not contain booleans.\n", names[id].c_str());
+				break;
+			}
+			candidates[id] = group;
+			break;
+		}
+		}
+	}
+
+	for (unsigned i = functionsStart; i < module.instructions.size(); ++i) {
+		SpirVInstruction& inst = module.instructions[i];
+		bool access = inst.opcode == OpLoad || inst.opcode == OpAccessChain || inst.opcode == OpInBoundsAccessChain;
+		for (unsigned i2 = 0; i2 < inst.operands.size(); ++i2) {
+			if (access && i2 == 2) continue;
+			if (candidates.find(inst.operands[i2]) != candidates.end()) {
+				printf("Warning: Uniform %s can not be grouped, it is not only loaded directly.\n", names[inst.operands[i2]].c_str());
+				candidates.erase(inst.operands[i2]);
+			}
+		}
+	}
+
+	if (candidates.empty()) return 0;
+
+	// Members sorted by name, mapped to their variables
+	std::map<std::string, unsigned> members[UniformGroupCount];
+	for (auto candidate : candidates) {
+		members[candidate.second][names[candidate.first]] = candidate.first;
+	}
+	std::map<unsigned, unsigned> variableTypes;
+	for (unsigned i = 0; i < functionsStart; ++i) {
+		SpirVInstruction& inst = module.instructions[i];
+		if (inst.opcode == OpVariable && candidates.find(inst.operands[1]) != candidates.end()) variableTypes[inst.operands[1]] = pointees[inst.operands[0]];
+	}
+
+	// Grouped variables mapped to their blocks and member indices
+	std::map<unsigned, std::pair<unsigned, unsigned>> replacements;
+	std::vector<unsigned> removed;
+	for (unsigned group = 0; group < UniformGroupCount; ++group) {
+		if (members[group].empty()) continue;
+		std::string name = std::string("_k_") + groupNames[group] + "_uniforms";
+		unsigned structType = module.newId();
+		SpirVInstruction typeStruct(OpTypeStruct, { structType });
+		for (auto member : members[group]) typeStruct.operands.push_back(variableTypes[member.second]);
+		module.addGlobal(typeStruct);
+		unsigned pointer = module.pointerType(StorageClassUniform, structType);
+		unsigned variable = module.newId();
+		module.addGlobal(SpirVInstruction(OpVariable, { pointer, variable, StorageClassUniform }));
+		module.addName(structType, name + "_type");
+		module.addName(variable, name);
+		module.addDecoration(SpirVInstruction(OpDecorate, { structType, DecorationBlock }));
+		module.addDecoration(SpirVInstruction(OpDecorate, { variable, DecorationDescriptorSet, group + 1 }));
+		module.addDecoration(SpirVInstruction(OpDecorate, { variable, DecorationBinding, group + 1 }));
+
+		unsigned offset = 0;
+		unsigned index = 0;
+		for (auto member : members[group]) {
+			unsigned type = variableTypes[member.second];
+			module.addMemberName(structType, index, member.first);
+			Layout layout = typeLayout(types, type, false);
+			offset = roundUp(offset, layout.alignment);
+			decorateMember(module, types, structType, index, type, offset);
+			offset += layout.size;
+			decorateNested(module, types, laidOut, type);
+			replacements.insert(std::make_pair(member.second, std::make_pair(variable, intConstant(module, index))));
+			removed.push_back(member.second);
+			++index;
+		}
+
+		std::stringstream extension;
+		extension << "krafix uniform group: " << groupNames[group] << " set " << group + 1 << " binding " << group + 1 << " size " << roundUp(offset, 16);
+		module.addSourceExtension(extension.str());
+	}
+
+	// Loads and access chains of the grouped variables now point into uniform blocks
+	std::set<unsigned> pointers;
+	std::map<unsigned, unsigned> uniformPointers;
+	for (auto replacement : replacements) pointers.insert(replacement.first);
+	functionsStart = module.functionsStart();
+	for (unsigned i = functionsStart; i < module.instructions.size(); ++i) {
+		SpirVInstruction& inst = module.instructions[i];
+		if (inst.opcode == OpLoad && replacements.find(inst.operands[2]) != replacements.end()) {
+			uniformPointers[inst.operands[0]] = 0;
+		}
+		else if ((inst.opcode == OpAccessChain || inst.opcode == OpInBoundsAccessChain) && pointers.find(inst.operands[2]) != pointers.end()) {
+			pointers.insert(inst.operands[1]);
+			uniformPointers[pointees[inst.operands[0]]] = 0;
+		}
+	}
+	for (auto& pointer : uniformPointers) {
+		pointer.second = module.pointerType(StorageClassUniform, pointer.first);
+	}
+
+	functionsStart = module.functionsStart();
+	std::vector<SpirVInstruction> instructions;
+	for (unsigned i = 0; i < functionsStart; ++i) {
+		SpirVInstruction& inst = module.instructions[i];
+		if (inst.opcode == OpVariable && replacements.find(inst.operands[1]) != replacements.end()) continue;
+		instructions.push_back(inst);
+	}
+	for (unsigned i = functionsStart; i < module.instructions.size(); ++i) {
+		SpirVInstruction inst = module.instructions[i];
+		if (inst.opcode == OpLoad && replacements.find(inst.operands[2]) != replacements.end()) {
+			std::pair<unsigned, unsigned> member = replacements[inst.operands[2]];
+			unsigned pointer = module.newId();
+			instructions.push_back(SpirVInstruction(OpAccessChain, { uniformPointers[inst.operands[0]], pointer, member.first, member.second }));
+			inst.operands[2] = pointer;
+		}
+		else if ((inst.opcode == OpAccessChain || inst.opcode == OpInBoundsAccessChain) && pointers.find(inst.operands[2]) != pointers.end()) {
+			inst.operands[0] = uniformPointers[pointees[inst.operands[0]]];
+			if (replacements.find(inst.operands[2]) != replacements.end()) {
+				std::pair<unsigned, unsigned> member = replacements[inst.operands[2]];
+				inst.operands[2] = member.first;
+				inst.operands.insert(inst.operands.begin() + 3, member.second);
+			}
+		}
+		instructions.push_back(inst);
+	}
+	module.instructions = instructions;
+	removeReferences(module, removed);
+	return (unsigned)removed.size();
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "SpirVModule.h"
+
+namespace krafix {
+	enum UniformGroup {
+		FrameUniforms,
+		MaterialUniforms,
+		DrawUniforms,
+		UniformGroupCount
+	};
+
+	// Uniform names mapped to the group they are updated with
+	typedef std::map<std::string, unsigned> UniformGroups;
+
+	// frame, material or draw
+	const char* uniformGroupName(unsigned group);
+
+	// Reads a file of "group = name, name, ..." lines (# starts a comment).
+	bool readUniformGroups(const char* filename, UniformGroups& groups);
+
+	// Moves the loose uniforms listed in groups and, when byPrefix is set, those whose names start
+	// with frame_, material_ or draw_ into one std140 uniform block per group (_k_frame_uniforms, ...).
+	// Members are sorted by name and each block uses descriptor set and binding group + 1,
+	// so blocks stay the same across stages and shaders. Returns the number of moved uniforms.
+	unsigned groupUniforms(SpirVModule& module, const UniformGroups& groups, bool byPrefix);
+}
@@ -0,0 +1,99 @@
+#include "UniformLayout.h"
+#include <SPIRV/spirv.hpp>
+#include <algorithm>
+
+using namespace krafix;
+using namespace spv;
+
+void krafix::addLayoutType(LayoutTypes& types, std::map<unsigned, unsigned>& constants, unsigned opcode, const unsigned* operands, unsigned length) {
+	LayoutType t;
+	t.opcode = opcode;
+	switch (opcode) {
+	case OpTypeBool:
+		t.count = 32;
+		types[operands[0]] = t;
+		break;
+	case OpTypeInt:
+	case OpTypeFloat:
+		t.count = operands[1];
+		types[operands[0]] = t;
+		break;
+	case OpTypeVector:
+	case OpTypeMatrix:
+		t.component = operands[1];
+		t.count = operands[2];
+		types[operands[0]] = t;
+		break;
+	case OpTypeArray:
+		t.component = operands[1];
+		t.count = constants[operands[2]];
+		types[operands[0]] = t;
+		break;
+	case OpTypeStruct:
+		for (unsigned i = 1; i < length; ++i) t.members.push_back(operands[i]);
+		types[operands[0]] = t;
+		break;
+	case OpConstant:
+		constants[operands[1]] = operands[2];
+		break;
+	}
+}
+
+unsigned krafix::roundUp(unsigned value, unsigned alignment) {
+	return (value + alignment - 1) / alignment * alignment;
+}
+
+unsigned krafix::arrayStride(LayoutTypes& types, unsigned type, bool std430) {
+	Layout element = typeLayout(types, types[type].component, std430);
+	unsigned stride = roundUp(element.size, element.alignment);
+	return std430 ? stride : roundUp(stride, 16);
+}
+
+unsigned krafix::matrixStride(LayoutTypes& types, unsigned type, bool std430) {
+	Layout column = typeLayout(types, types[type].component, std430);
+	return std430 ? column.alignment : roundUp(column.alignment, 16);
+}
+
+Layout krafix::typeLayout(LayoutTypes& types, unsigned type, bool std430) {
+	LayoutType& t = types[type];
+	Layout layout;
+	switch (t.opcode) {
+	case OpTypeVector: {
+		Layout component = typeLayout(types, t.component, std430);
+		layout.size = component.size * t.count;
+		layout.alignment = component.size * (t.count == 3 ? 4 : t.count);
+		break;
+	}
+	case OpTypeMatrix:
+		layout.alignment = matrixStride(types, type, std430);
+		layout.size = layout.alignment * t.count;
+		break;
+	case OpTypeArray: {
+		Layout element = typeLayout(types, t.component, std430);
+		layout.alignment = std430 ? element.alignment : roundUp(element.alignment, 16);
+		layout.size = arrayStride(types, type, std430) * t.count;
+		break;
+	}
+	case OpTypeStruct: {
+		unsigned offset = 0;
+		layout.alignment = 4;
+		for (unsigned member : t.members) {
+			Layout memberLayout = typeLayout(types, member, std430);
+			offset = roundUp(offset, memberLayout.alignment) + memberLayout.size;
+			layout.alignment = std::max(layout.alignment, memberLayout.alignment);
+		}
+		if (!std430) layout.alignment = roundUp(layout.alignment, 16);
+		layout.size = roundUp(offset, layout.alignment);
+		break;
+	}
+	default:
+		layout.alignment = layout.size = t.count == 64 ? 8 : 4;
+		break;
+	}
+	return layout;
+}
+
+unsigned krafix::innermostType(LayoutTypes& types, unsigned type) {
+	while (types[type].opcode == OpTypeArray) type = types[type].component;
+	return type;
+}
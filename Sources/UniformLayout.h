@@ -0,0 +1,37 @@
+#pragma once
+
+#include <map>
+#include <vector>
+
+namespace krafix {
+	struct LayoutType {
+		unsigned opcode;
+		// Component type of vectors, column type of matrices and element type of arrays
+		unsigned component;
+		// Vector size, matrix columns, array length or scalar width
+		unsigned count;
+		std::vector<unsigned> members;
+
+		LayoutType() : opcode(0), component(0), count(0) {}
+	};
+
+	struct Layout {
+		unsigned alignment;
+		unsigned size;
+	};
+
+	typedef std::map<unsigned, LayoutType> LayoutTypes;
+
+	// Records the types uniform layouts are made of, has to see every type and constant declaration in order
+	void addLayoutType(LayoutTypes& types, std::map<unsigned, unsigned>& constants, unsigned opcode, const unsigned* operands, unsigned length);
+
+	unsigned roundUp(unsigned value, unsigned alignment);
+
+	// Base alignment and size following the std140 or std430 rules
+	Layout typeLayout(LayoutTypes& types, unsigned type, bool std430);
+	unsigned arrayStride(LayoutTypes& types, unsigned type, bool std430);
+	unsigned matrixStride(LayoutTypes& types, unsigned type, bool std430);
+
+	// Element type of possibly nested arrays
+	unsigned innermostType(LayoutTypes& types, unsigned type);
+}
@@ -0,0 +1,119 @@
+#include "UniformSharing.h"
+#include <SPIRV/spirv.hpp>
+
+using namespace krafix;
+
+namespace {
+	using namespace spv;
+
+	struct Uniforms {
+		Uniforms(SpirVModule& module) {
+			std::map<unsigned, std::string> names = module.names();
+			std::map<unsigned, unsigned> pointees;
+			unsigned functionsStart = module.functionsStart();
+			for (unsigned i = 0; i < functionsStart; ++i) {
+				SpirVInstruction& inst = module.instructions[i];
+				if (SpirVModule::hasResultType(inst.opcode)) definitions.insert(std::make_pair(inst.operands[1], inst));
+				else if (inst.opcode >= OpTypeVoid && inst.opcode <= OpTypePipe) definitions.insert(std::make_pair(inst.operands[0], inst));
+				if (inst.opcode == OpTypePointer) pointees[inst.operands[0]] = inst.operands[2];
+				if (inst.opcode == OpVariable && inst.operands[2] == StorageClassUniformConstant && names.find(inst.operands[1]) != names.end()) {
+					unsigned type = pointees[inst.operands[0]];
+					if (!isOpaque(type)) variables[names[inst.operands[1]]] = type;
+				}
+			}
+			for (auto name : names) {
+				auto definition = definitions.find(name.first);
+				if (definition != definitions.end() && definition->second.opcode == OpTypeStruct) typeNames[name.first] = name.second;
+			}
+		}
+
+		bool isOpaque(unsigned type) {
+			SpirVInstruction& inst = definitions.at(type);
+			if (inst.opcode == OpTypeArray || inst.opcode == OpTypeRuntimeArray) return isOpaque(inst.operands[1]);
+			return inst.opcode == OpTypeImage || inst.opcode == OpTypeSampler || inst.opcode == OpTypeSampledImage;
+		}
+
+		// Types and constants by id
+		std::map<unsigned, SpirVInstruction> definitions;
+		std::map<unsigned, std::string> typeNames;
+		// Uniforms by name, mapped to the types they point to
+		std::map<std::string, unsigned> variables;
+	};
+
+	// Finds or declares the types and constants of one module in another one
+	class TypeCopier {
+	public:
+		TypeCopier(SpirVModule& to, Uniforms& from) : to(to), from(from) {}
+
+		unsigned copy(unsigned id) {
+			if (copied.find(id) != copied.end()) return copied[id];
+			SpirVInstruction inst = from.definitions.at(id);
+			unsigned result = SpirVModule::hasResultType(inst.opcode) ? 1 : 0;
+			if (result == 1) inst.operands[0] = copy(inst.operands[0]);
+			switch (inst.opcode) {
+			case OpTypeVector:
+			case OpTypeMatrix:
+				inst.operands[1] = copy(inst.operands[1]);
+				break;
+			case OpTypeArray:
+				inst.operands[1] = copy(inst.operands[1]);
+				inst.operands[2] = copy(inst.operands[2]);
+				break;
+			case OpTypeStruct:
+				for (unsigned i = 1; i < inst.operands.size(); ++i) inst.operands[i] = copy(inst.operands[i]);
+				break;
+			}
+
+			// Structs are always declared anew, their names and decorations can differ
+			if (inst.opcode != OpTypeStruct) {
+				unsigned existing = find(inst, result);
+				if (existing != 0) return copied[id] = existing;
+			}
+
+			inst.operands[result] = to.newId();
+			to.addGlobal(inst);
+			if (from.typeNames.find(id) != from.typeNames.end()) to.addName(inst.operands[result], from.typeNames[id]);
+			return copied[id] = inst.operands[result];
+		}
+
+	private:
+		unsigned find(const SpirVInstruction& inst, unsigned result) {
+			unsigned functionsStart = to.functionsStart();
+			for (unsigned i = 0; i < functionsStart; ++i) {
+				SpirVInstruction& existing = to.instructions[i];
+				if (existing.opcode != inst.opcode || existing.operands.size() != inst.operands.size()) continue;
+				bool equal = true;
+				for (unsigned i2 = 0; i2 < inst.operands.size(); ++i2) {
+					if (i2 != result && existing.operands[i2] != inst.operands[i2]) equal = false;
+				}
+				if (equal) return existing.operands[result];
+			}
+			return 0;
+		}
+
+		SpirVModule& to;
+		Uniforms& from;
+		std::map<unsigned, unsigned> copied;
+	};
+
+	unsigned addMissingUniforms(SpirVModule& to, SpirVModule& from) {
+		Uniforms existing(to);
+		Uniforms missing(from);
+		TypeCopier copier(to, missing);
+		unsigned count = 0;
+		for (auto uniform : missing.variables) {
+			if (existing.variables.find(uniform.first) != existing.variables.end()) continue;
+			unsigned pointer = to.pointerType(StorageClassUniformConstant, copier.copy(uniform.second));
+			unsigned variable = to.newId();
+			to.addGlobal(SpirVInstruction(OpVariable, { pointer, variable, StorageClassUniformConstant }));
+			to.addName(variable, uniform.first);
+			++count;
+		}
+		return count;
+	}
+}
+
+unsigned krafix::shareUniforms(SpirVModule& vertex, SpirVModule& fragment) {
+	unsigned count = addMissingUniforms(vertex, fragment);
+	return count + addMissingUniforms(fragment, vertex);
+}
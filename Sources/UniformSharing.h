@@ -0,0 +1,10 @@
+#pragma once
+
+#include "SpirVModule.h"
+
+namespace krafix {
+	// Declares the loose uniforms of each stage in the other stage as well, so both stages
+	// end up with the same set of uniforms and thereby with the same uniform buffer layout.
+	// Samplers and images are not shared. Returns the number of added uniforms.
+	unsigned shareUniforms(SpirVModule& vertex, SpirVModule& fragment);
+}
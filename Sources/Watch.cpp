@@ -0,0 +1,122 @@
+#include "Watch.h"
+#include <algorithm>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+using namespace krafix;
+
+namespace {
+	// Editors write files in several steps, this long a pause ends a batch of changes
+	const int settleMilliseconds = 50;
+}
+
+#ifdef __linux__
+
+FileWatcher::FileWatcher() {
+	fd = inotify_init1(IN_CLOEXEC);
+}
+
+FileWatcher::~FileWatcher() {
+	if (fd >= 0) close(fd);
+}
+
+bool FileWatcher::valid() {
+	return fd >= 0;
+}
+
+void FileWatcher::watchDirectory(const std::string& directory) {
+	std::string path = realPath(directory.empty() ? "." : directory);
+	for (auto& watched : directories) {
+		if (watched.second == path) return;
+	}
+	int wd = inotify_add_watch(fd, path.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+	if (wd >= 0) directories[wd] = path;
+}
+
+std::vector<std::string> FileWatcher::wait() {
+	std::vector<std::string> changed;
+	char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	pollfd pfd = { fd, POLLIN, 0 };
+	int timeout = -1;
+	while (poll(&pfd, 1, timeout) > 0) {
+		ssize_t length = read(fd, buffer, sizeof(buffer));
+		if (length <= 0) break;
+		for (char* event = buffer; event < buffer + length; event += sizeof(inotify_event) + ((inotify_event*)event)->len) {
+			inotify_event* e = (inotify_event*)event;
+			if (e->len == 0 || directories.find(e->wd) == directories.end()) continue;
+			std::string path = directories[e->wd] + "/" + e->name;
+			if (std::find(changed.begin(), changed.end(), path) == changed.end()) changed.push_back(path);
+		}
+		timeout = settleMilliseconds;
+	}
+	return changed;
+}
+
+std::string krafix::realPath(const std::string& path) {
+	char resolved[PATH_MAX];
+	if (realpath(path.c_str(), resolved) == nullptr) return path;
+	return resolved;
+}
+
+std::vector<std::string> krafix::listDirectory(const std::string& directory) {
+	std::vector<std::string> files;
+	DIR* dir = opendir(directory.c_str());
+	if (dir == nullptr) return files;
+	while (dirent* entry = readdir(dir)) {
+		if (entry->d_name[0] != '.') files.push_back(entry->d_name);
+	}
+	closedir(dir);
+	std::sort(files.begin(), files.end());
+	return files;
+}
+
+#else
+
+FileWatcher::FileWatcher() : fd(-1) {}
+
+FileWatcher::~FileWatcher() {}
+
+bool FileWatcher::valid() {
+	return false;
+}
+
+void FileWatcher::watchDirectory(const std::string& directory) {}
+
+std::vector<std::string> FileWatcher::wait() {
+	return std::vector<std::string>();
+}
+
+std::string krafix::realPath(const std::string& path) {
+	return path;
+}
+
+std::vector<std::string> krafix::listDirectory(const std::string& directory) {
+	return std::vector<std::string>();
+}
+
+#endif
+
+std::string krafix::directoryOf(const std::string& path) {
+	size_t split = path.find_last_of("/\\");
+	if (split == std::string::npos) return "";
+	return path.substr(0, split + 1);
+}
+
+void IncludeGraph::setDependencies(unsigned shader, const std::set<std::string>& files) {
+	for (auto& file : dependencies[shader]) dependents[file].erase(shader);
+	dependencies[shader] = files;
+	for (auto& file : files) dependents[file].insert(shader);
+}
+
+std::set<unsigned> IncludeGraph::affected(const std::string& file) const {
+	auto shaders = dependents.find(file);
+	if (shaders == dependents.end()) return std::set<unsigned>();
+	return shaders->second;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace krafix {
+	// Reports files which were written to or moved into watched directories.
+	// Directories are watched instead of files, as editors often save by replacing files.
+	// Only implemented with inotify on Linux, valid() is false elsewhere.
+	class FileWatcher {
+	public:
+		FileWatcher();
+		~FileWatcher();
+		bool valid();
+		void watchDirectory(const std::string& directory);
+		// Blocks until something changed and returns the real paths of the changed files,
+		// changes which follow shortly after are collected into the same call
+		std::vector<std::string> wait();
+
+	private:
+		int fd;
+		std::map<int, std::string> directories;
+	};
+
+	// Which shaders read which files, for finding the shaders a change affects
+	class IncludeGraph {
+	public:
+		void setDependencies(unsigned shader, const std::set<std::string>& files);
+		std::set<unsigned> affected(const std::string& file) const;
+
+	private:
+		std::map<std::string, std::set<unsigned>> dependents;
+		std::map<unsigned, std::set<std::string>> dependencies;
+	};
+
+	// The canonical absolute path of an existing file, otherwise the path itself
+	std::string realPath(const std::string& path);
+
+	// The directory part of a path including the last separator, "" for plain filenames
+	std::string directoryOf(const std::string& path);
+
+	std::vector<std::string> listDirectory(const std::string& directory);
+}
@@ -0,0 +1,228 @@
+#include "WorkerPool.h"
+#include <deque>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+using namespace krafix;
+
+namespace {
+	// A job is retried in a new worker when its first worker crashed
+	const unsigned maxAttempts = 2;
+}
+
+#ifndef _WIN32
+
+namespace {
+	bool writeAll(int fd, const char* data, size_t size) {
+		while (size > 0) {
+			ssize_t written = write(fd, data, size);
+			if (written < 0 && errno == EINTR) continue;
+			if (written <= 0) return false;
+			data += written;
+			size -= written;
+		}
+		return true;
+	}
+
+	bool readAll(int fd, char* data, size_t size) {
+		while (size > 0) {
+			ssize_t count = read(fd, data, size);
+			if (count < 0 && errno == EINTR) continue;
+			if (count <= 0) return false;
+			data += count;
+			size -= count;
+		}
+		return true;
+	}
+
+	// Messages are a 32 bit length followed by the data
+	bool send(int fd, const std::string& message) {
+		uint32_t length = (uint32_t)message.size();
+		return writeAll(fd, (const char*)&length, sizeof(length)) && writeAll(fd, message.data(), message.size());
+	}
+
+	bool receive(int fd, std::string& message) {
+		uint32_t length;
+		if (!readAll(fd, (char*)&length, sizeof(length))) return false;
+		message.resize(length);
+		return length == 0 || readAll(fd, &message[0], length);
+	}
+}
+
+WorkerPool::WorkerPool(unsigned count, Handler handler) : handler(handler) {
+	// Writing to a crashed worker has to fail instead of ending krafix
+	signal(SIGPIPE, SIG_IGN);
+	for (unsigned i = 0; i < count; ++i) {
+		Worker worker;
+		if (!start(worker)) break;
+		workers.push_back(worker);
+	}
+}
+
+WorkerPool::~WorkerPool() {
+	for (auto& worker : workers) stop(worker);
+}
+
+bool WorkerPool::valid() {
+	return workers.size() > 0;
+}
+
+bool WorkerPool::start(Worker& worker) {
+	int jobs[2], results[2];
+	if (pipe(jobs) != 0) return false;
+	if (pipe(results) != 0) {
+		close(jobs[0]);
+		close(jobs[1]);
+		return false;
+	}
+	// Buffered output would otherwise be written by both processes
+	fflush(nullptr);
+	pid_t pid = fork();
+	if (pid < 0) {
+		close(jobs[0]);
+		close(jobs[1]);
+		close(results[0]);
+		close(results[1]);
+		return false;
+	}
+	if (pid == 0) {
+		// Other workers have to see the end of their job pipes when the pool closes them
+		for (auto& other : workers) {
+			if (&other == &worker || other.pid < 0) continue;
+			close(other.jobs);
+			close(other.results);
+		}
+		close(jobs[1]);
+		close(results[0]);
+		std::string job;
+		while (receive(jobs[0], job)) {
+			std::string result = handler(job);
+			fflush(nullptr);
+			if (!send(results[1], result)) break;
+		}
+		_exit(0);
+	}
+	close(jobs[0]);
+	close(results[1]);
+	worker.pid = pid;
+	worker.jobs = jobs[1];
+	worker.results = results[0];
+	worker.job = -1;
+	return true;
+}
+
+void WorkerPool::stop(Worker& worker) {
+	if (worker.pid < 0) return;
+	close(worker.jobs);
+	close(worker.results);
+	waitpid(worker.pid, nullptr, 0);
+}
+
+std::vector<std::string> WorkerPool::run(const std::vector<std::string>& jobs, std::vector<bool>& failed) {
+	std::vector<std::string> results(jobs.size());
+	std::vector<unsigned> attempts(jobs.size(), 0);
+	failed.assign(jobs.size(), false);
+	std::deque<int> queue;
+	for (size_t i = 0; i < jobs.size(); ++i) queue.push_back((int)i);
+	size_t remaining = jobs.size();
+
+	auto crashed = [&](Worker& worker) {
+		int job = worker.job;
+		worker.job = -1;
+		printf("Warning: A krafix worker crashed, starting a new one.\n");
+		stop(worker);
+		if (!start(worker)) worker.pid = -1;
+		if (++attempts[job] < maxAttempts) {
+			queue.push_front(job);
+		}
+		else {
+			failed[job] = true;
+			--remaining;
+		}
+	};
+
+	while (remaining > 0) {
+		for (auto& worker : workers) {
+			if (worker.pid < 0 || worker.job >= 0 || queue.empty()) continue;
+			worker.job = queue.front();
+			queue.pop_front();
+			if (!send(worker.jobs, jobs[worker.job])) crashed(worker);
+		}
+
+		std::vector<pollfd> fds;
+		std::vector<Worker*> busy;
+		for (auto& worker : workers) {
+			if (worker.pid < 0 || worker.job < 0) continue;
+			pollfd fd = { worker.results, POLLIN, 0 };
+			fds.push_back(fd);
+			busy.push_back(&worker);
+		}
+		if (fds.empty()) {
+			// Every worker failed to restart, the remaining jobs can not run
+			while (!queue.empty()) {
+				failed[queue.front()] = true;
+				queue.pop_front();
+			}
+			break;
+		}
+		if (poll(fds.data(), fds.size(), -1) < 0 && errno != EINTR) {
+			// The results can not be waited for anymore, the running and remaining jobs fail.
+			// Busy workers are replaced so their late results can not be mistaken for later jobs.
+			for (auto worker : busy) {
+				failed[worker->job] = true;
+				worker->job = -1;
+				stop(*worker);
+				if (!start(*worker)) worker->pid = -1;
+			}
+			while (!queue.empty()) {
+				failed[queue.front()] = true;
+				queue.pop_front();
+			}
+			break;
+		}
+		for (size_t i = 0; i < fds.size(); ++i) {
+			if (fds[i].revents == 0) continue;
+			Worker& worker = *busy[i];
+			if (receive(worker.results, results[worker.job])) {
+				--remaining;
+			}
+			else {
+				results[worker.job].clear();
+				crashed(worker);
+			}
+			worker.job = -1;
+		}
+	}
+	return results;
+}
+
+#else
+
+WorkerPool::WorkerPool(unsigned count, Handler handler) : handler(handler) {}
+
+WorkerPool::~WorkerPool() {}
+
+bool WorkerPool::valid() {
+	return false;
+}
+
+bool WorkerPool::start(Worker& worker) {
+	return false;
+}
+
+void WorkerPool::stop(Worker& worker) {}
+
+std::vector<std::string> WorkerPool::run(const std::vector<std::string>& jobs, std::vector<bool>& failed) {
+	failed.assign(jobs.size(), true);
+	return std::vector<std::string>(jobs.size());
+}
+
+#endif
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace krafix {
+	// Worker processes forked from an initialized krafix, which get jobs over pipes and send results back.
+	// Every worker has its own copy of glslang's and krafix' global state, so jobs can not disturb each
+	// other and a crashing job only takes down its worker, which is replaced by a new fork.
+	// Only available on POSIX systems, valid() is false elsewhere.
+	class WorkerPool {
+	public:
+		// Runs in the workers and turns a job into a result
+		typedef std::string (*Handler)(const std::string& job);
+
+		WorkerPool(unsigned workers, Handler handler);
+		~WorkerPool();
+		bool valid();
+		// Returns the results in the order of the jobs. Jobs whose worker crashed are retried once in a new
+		// worker, jobs which crashed twice are marked in failed and get an empty result.
+		std::vector<std::string> run(const std::vector<std::string>& jobs, std::vector<bool>& failed);
+
+	private:
+		struct Worker {
+			int pid;
+			int jobs;
+			int results;
+			int job;
+		};
+
+		bool start(Worker& worker);
+		void stop(Worker& worker);
+
+		Handler handler;
+		std::vector<Worker> workers;
+	};
+}
@@ -51,7 +51,9 @@
 #include <cctype>
 #include <cmath>
 #include <array>
+#include <set>
 #include <sstream>
+#include <stdexcept>
 
 #include "../glslang/OSDependent/osinclude.h"
 
@@ -66,6 +68,19 @@
 #include "VarListTranslator.h"
 #include "JavaScriptTranslator.h"
 #include "JavaScriptTranslator2.h"
+#include "HalfPrecision.h"
+#include "UniformBaking.h"
+#include "Preshader.h"
+#include "InterpolationHoisting.h"
+#include "UniformSharing.h"
+#include "UniformGroups.h"
+#include "Reflection.h"
+#include "ShaderArchive.h"
+#include "OutputFile.h"
+#include "Permutations.h"
+#include "SpecConstants.h"
+#include "Watch.h"
+#include "WorkerPool.h"
 
 #include "../SPIRV-Cross/spirv_common.hpp"
 
@@ -131,6 +146,34 @@ bool LinkFailed = false;
 static bool quiet = false;
 static bool debugMode = false;
 static bool outputSpirv = false;
+static bool halfPrecision = false;
+static bool minify = false;
+static krafix::BakedUniforms bakedUniforms;
+static bool preshader = false;
+static std::string linkedShader;
+static bool interpolationHoisting = false;
+static bool agalBytecode = false;
+static bool clipSpaceFixup = true;
+static bool std430 = false;
+static bool packUniforms = false;
+static unsigned pushConstantLimit = 0;
+static bool sharedUniforms = false;
+static krafix::UniformGroups uniformGroups;
+static bool groupUniformsByPrefix = false;
+static bool writeReflectionFile = false;
+static bool shipping = false;
+static std::string archive;
+static bool compressArchive = false;
+static std::vector<krafix::PermutationAxis> axes;
+// -D defines which became specialization constants for the spirv target
+static std::vector<krafix::SpecConstant> specConstants;
+static std::vector<std::string> specConstantNames;
+// The -D arguments without the -D
+static std::vector<std::string> commandLineDefines;
+// Compiles jobs in worker processes for --jobs
+static krafix::WorkerPool* workerPool = nullptr;
+// Outputs of all successful compiles of this invocation
+static std::vector<std::string> compiledFiles;
 
 // Use to test breaking up a single shader file into multiple strings.
 // Set in ReadFileData().
@@ -616,6 +659,7 @@ public:
 
 	IncludeResult* includeLocal(const char* headerName, const char* includerName, size_t inclusionDepth) override {
 		std::string realfilename = dir + headerName;
+		included.insert(realfilename);
 		std::stringstream content;
 		std::string line;
 		std::ifstream file(realfilename);
@@ -635,8 +679,14 @@ public:
 		delete (char*)result->userData;
 		delete result;
 	}
+
+	// Every file which was included so far
+	const std::set<std::string>& includes() const {
+		return included;
+	}
 private:
 	std::string dir;
+	std::set<std::string> included;
 };
 
 class NullIncluder : public glslang::TShader::Includer {
@@ -672,9 +722,52 @@ krafix::ShaderStage shLanguageToShaderStage(EShLanguage lang) {
 	}
 }
 
+// Number of vec4 varyings every device supports for the target
+static unsigned maxVaryings(const krafix::Target& target) {
+	switch (target.lang) {
+	case krafix::GLSL:
+		if (target.es) return target.version >= 300 ? 15 : 8;
+		return target.version >= 130 ? 15 : 8;
+	case krafix::HLSL:
+		return target.version == 9 ? 8 : 32;
+	case krafix::Metal:
+		return 31;
+	case krafix::AGAL:
+		return 8;
+	default:
+		return 16;
+	}
+}
+
+static bool supportsUniformBlocks(const krafix::Target& target) {
+	switch (target.lang) {
+	case krafix::SpirV:
+	case krafix::Metal:
+		return true;
+	case krafix::GLSL:
+		return target.version >= (target.es ? 300 : 140);
+	case krafix::HLSL:
+		return target.version > 9;
+	default:
+		return false;
+	}
+}
+
+// Targets whose vertex shaders map depth to 0..1 unless --no-clipspace-fixup is given
+static bool fixesClipSpace(const krafix::Target& target) {
+	switch (target.lang) {
+	case krafix::SpirV:
+	case krafix::HLSL:
+	case krafix::Metal:
+	case krafix::AGAL:
+		return true;
+	default:
+		return false;
+	}
+}
+
 static void writeSpirv(const char* filename, std::vector<unsigned int>& words) {
-	std::ofstream out;
-	out.open(filename, std::ios::binary | std::ios::out);
+	krafix::OutputFile out(filename);
 	
 	for (unsigned i = 0; i < words.size(); ++i) {
 		out.put(words[i] & 0xff);
@@ -711,7 +804,16 @@ void CompileAndLinkShaderUnits(std::vector<ShaderCompUnit> compUnits, krafix::Ta
     for (auto it = compUnits.cbegin(); it != compUnits.cend(); ++it) {
         const auto &compUnit = *it;
         glslang::TShader* shader = new glslang::TShader(compUnit.stage);
-        shader->setStringsWithLengthsAndNames(compUnit.text, NULL, compUnit.fileNameList, 1);
+        std::string specSource;
+        const char* specText[] = { nullptr };
+        if (target.lang == krafix::SpirV && specConstants.size() > 0) {
+            specSource = krafix::insertSpecConstants(compUnit.text[0], specConstants);
+            specText[0] = specSource.c_str();
+            shader->setStringsWithLengthsAndNames(specText, NULL, compUnit.fileNameList, 1);
+        }
+        else {
+            shader->setStringsWithLengthsAndNames(compUnit.text, NULL, compUnit.fileNameList, 1);
+        }
         if (entryPointName) // HLSL todo: this needs to be tracked per compUnits
             shader->setEntryPoint(entryPointName);
         if (sourceEntryPointName)
@@ -791,13 +893,74 @@ void CompileAndLinkShaderUnits(std::vector<ShaderCompUnit> compUnits, krafix::Ta
         if (CompileFailed || LinkFailed)
             printf("SPIR-V is not generated for failed compile or link\n");
         else {
+            std::vector<unsigned int> spirvs[EShLangCount];
             for (int stage = 0; stage < EShLangCount; ++stage) {
                 if (program.getIntermediate((EShLanguage)stage)) {
-                    std::vector<unsigned int> spirv;
+                    std::vector<unsigned int>& spirv = spirvs[stage];
                     std::string warningsErrors;
                     spv::SpvBuildLogger logger;
                     glslang::GlslangToSpv(*program.getIntermediate((EShLanguage)stage), spirv, &logger);
 
+					if (bakedUniforms.size() > 0) {
+						krafix::SpirVModule module(spirv);
+						krafix::bakeUniforms(module, bakedUniforms);
+						module.write(spirv);
+					}
+
+					if (preshader && filename != nullptr) {
+						std::string name = removeExtension(extractFilename(sourcefilename != nullptr ? sourcefilename : filename));
+						for (size_t i = 0; i < name.size(); ++i) {
+							if (name[i] == '.' || name[i] == '-') name[i] = '_';
+						}
+						bool javaScript = target.system == krafix::HTML5 || target.lang == krafix::JavaScript;
+						krafix::SpirVModule module(spirv);
+						std::string code = krafix::extractPreshader(module, shLanguageToShaderStage((EShLanguage)stage), name + "_preshader", javaScript);
+						if (code.size() > 0) {
+							module.write(spirv);
+							if (stage == compUnits[0].stage) {
+								krafix::OutputFile file(std::string(filename) + (javaScript ? ".preshader.js" : ".preshader.h"));
+								file << code;
+							}
+						}
+					}
+				}
+			}
+
+			// Varyings can only use 16 bit types when both linked stages lower them
+			std::set<std::string> halfVaryings;
+			if (spirvs[EShLangVertex].size() > 0 && spirvs[EShLangFragment].size() > 0) {
+				krafix::SpirVModule vertex(spirvs[EShLangVertex]);
+				krafix::SpirVModule fragment(spirvs[EShLangFragment]);
+				unsigned changes = 0;
+				if (interpolationHoisting) changes += krafix::hoistInterpolation(vertex, fragment, maxVaryings(target));
+				if (sharedUniforms && target.lang == krafix::SpirV) changes += krafix::shareUniforms(vertex, fragment);
+				if (changes > 0) {
+					vertex.write(spirvs[EShLangVertex]);
+					fragment.write(spirvs[EShLangFragment]);
+				}
+				if (halfPrecision) halfVaryings = krafix::halfVaryings(vertex, fragment);
+
+				std::map<std::string, int> noAttributes;
+				krafix::ShaderReflection vertexReflection;
+				krafix::ShaderReflection fragmentReflection;
+				krafix::reflect(spirvs[EShLangVertex], krafix::StageVertex, noAttributes, vertexReflection);
+				krafix::reflect(spirvs[EShLangFragment], krafix::StageFragment, noAttributes, fragmentReflection);
+				std::string error;
+				if (!krafix::compatibleStages(vertexReflection, fragmentReflection, error)) {
+					printf("Warning: The linked shaders do not match, %s.\n", error.c_str());
+				}
+			}
+
+			for (int stage = 0; stage < EShLangCount; ++stage) {
+				// Linked stages only shape the interface, every shader file is written by its own invocation
+				if (stage == compUnits[0].stage && spirvs[stage].size() > 0) {
+					std::vector<unsigned int>& spirv = spirvs[stage];
+
+					if ((uniformGroups.size() > 0 || groupUniformsByPrefix) && supportsUniformBlocks(target)) {
+						krafix::SpirVModule module(spirv);
+						if (krafix::groupUniforms(module, uniformGroups, groupUniformsByPrefix) > 0) module.write(spirv);
+					}
+
 					if (outputSpirv) {
 						std::string filename = std::string(tempdir) + "/" + removeExtension(extractFilename(sourcefilename)) + ".spirv";
 						writeSpirv(filename.c_str(), spirv);
@@ -814,19 +977,19 @@ void CompileAndLinkShaderUnits(std::vector<ShaderCompUnit> compUnits, krafix::Ta
 					std::map<std::string, int> attributes;
 					switch (target.lang) {
 					case krafix::SpirV:
-						translator = new krafix::SpirVTranslator(spirv, shLanguageToShaderStage((EShLanguage)stage));
+						translator = new krafix::SpirVTranslator(spirv, shLanguageToShaderStage((EShLanguage)stage), clipSpaceFixup, std430, packUniforms, pushConstantLimit, sharedUniforms && linkedShader.size() > 0, shipping);
 						break;
 					case krafix::GLSL:
-						translator = new krafix::GlslTranslator2(spirv, shLanguageToShaderStage((EShLanguage)stage), relax);
+						translator = new krafix::GlslTranslator2(spirv, shLanguageToShaderStage((EShLanguage)stage), relax, minify);
 						break;
 					case krafix::HLSL:
-						translator = new krafix::HlslTranslator2(spirv, shLanguageToShaderStage((EShLanguage)stage));
+						translator = new krafix::HlslTranslator2(spirv, shLanguageToShaderStage((EShLanguage)stage), halfPrecision, halfVaryings, clipSpaceFixup);
 						break;
 					case krafix::Metal:
-						translator = new krafix::MetalTranslator2(spirv, shLanguageToShaderStage((EShLanguage)stage));
+						translator = new krafix::MetalTranslator2(spirv, shLanguageToShaderStage((EShLanguage)stage), halfPrecision, halfVaryings, clipSpaceFixup);
 						break;
 					case krafix::AGAL:
-						translator = new krafix::AgalTranslator(spirv, shLanguageToShaderStage((EShLanguage)stage));
+						translator = new krafix::AgalTranslator(spirv, shLanguageToShaderStage((EShLanguage)stage), agalBytecode, clipSpaceFixup);
 						break;
 					case krafix::VarList:
 						translator = new krafix::VarListTranslator(spirv, shLanguageToShaderStage((EShLanguage)stage));
@@ -860,11 +1023,24 @@ void CompileAndLinkShaderUnits(std::vector<ShaderCompUnit> compUnits, krafix::Ta
 								*length = strlen(output);
 							}
 						}
+
+						if (writeReflectionFile && filename != nullptr && output == nullptr && !CompileFailed) {
+							krafix::ShaderReflection reflection;
+							krafix::reflect(translator->interfaceSpirv(), shLanguageToShaderStage((EShLanguage)stage), attributes, reflection);
+							if (stage == EShLangVertex && !clipSpaceFixup && fixesClipSpace(target)) reflection.projection = krafix::ReflectedProjectionHalfDepth;
+							if (!krafix::writeReflection((std::string(filename) + ".reflect").c_str(), reflection)) {
+								printf("Warning: Could not write the reflection of %s.\n", filename);
+							}
+						}
 					}
 					catch (spirv_cross::CompilerError& error) {
 						printf("Error compiling to %s: %s\n", target.string().c_str(), error.what());
 						CompileFailed = true;
 					}
+					catch (std::runtime_error& error) {
+						printf("Error compiling to %s: %s\n", target.string().c_str(), error.what());
+						CompileFailed = true;
+					}
 
 					delete translator;
                     
@@ -962,90 +1138,98 @@ void CompileAndLinkShaderFiles(krafix::Target target, const char* sourcefilename
 	}
 }
 
-int compile(const char* targetlang, const char* from, std::string to, const char* tempdir, const char* source, char* output, int* length, const char* system,
-	glslang::TShader::Includer& includer, std::string defines, int version, bool relax) {
-	CompileFailed = false;
-
-	//Options |= EOptionHumanReadableSpv;
-	Options |= EOptionSpv;
-	Options |= EOptionLinkProgram;
-	//Options |= EOptionSuppressInfolog;
-
-	NumWorkItems = 1;
-	Work = new glslang::TWorkItem*[NumWorkItems];
-	Work[0] = 0;
-
-	if (from) {
-		std::string name(from);
-		if (!SetConfigFile(name)) {
-			Work[0] = new glslang::TWorkItem(name);
-			Worklist.add(Work[0]);
-		}
-	}
-	else {
-		std::string name = std::string("nothing.") + to;
-		Work[0] = new glslang::TWorkItem(name);
-		Worklist.add(Work[0]);
-	}
-
-	glslang::InitializeProcess();
-
-	krafix::Target target;
+// Sets up the target for a target language and adds the define which tells shaders about it
+static bool selectTarget(const char* targetlang, const char* from, const char* system, int version, krafix::Target& target, std::string& defines) {
 	target.system = getSystem(system);
 	target.es = false;
 	if (strcmp(targetlang, "spirv") == 0) {
 		target.lang = krafix::SpirV;
 		target.version = version > 0 ? version : 1;
 		defines += "#define SPIRV " + std::to_string(target.version) + "\n";
-		CompileAndLinkShaderFiles(target, from, to.c_str(), tempdir, source, output, length, includer, defines.c_str(), relax);
 	}
 	else if (strcmp(targetlang, "d3d9") == 0) {
 		target.lang = krafix::HLSL;
 		target.version = version > 0 ? version : 9;
 		defines += "#define HLSL " + std::to_string(target.version) + "\n";
-		CompileAndLinkShaderFiles(target, from, to.c_str(), tempdir, source, output, length, includer, defines.c_str(), relax);
 	}
 	else if (strcmp(targetlang, "d3d11") == 0) {
 		target.lang = krafix::HLSL;
 		target.version = version > 0 ? version : 11;
 		defines += "#define HLSL " + std::to_string(target.version) + "\n";
-		CompileAndLinkShaderFiles(target, from, to.c_str(), tempdir, source, output, length, includer, defines.c_str(), relax);
 	}
 	else if (strcmp(targetlang, "glsl") == 0) {
 		target.lang = krafix::GLSL;
 		if (target.system == krafix::Linux && (FindLanguage(from) == EShLangVertex || FindLanguage(from) == EShLangFragment)) target.version = version > 0 ? version : 110;
 		else target.version = version > 0 ? version : 330;
 		defines += "#define GLSL " + std::to_string(target.version) + "\n";
-		CompileAndLinkShaderFiles(target, from, to.c_str(), tempdir, source, output, length, includer, defines.c_str(), relax);
 	}
 	else if (strcmp(targetlang, "essl") == 0) {
 		target.lang = krafix::GLSL;
 		target.version = version > 0 ? version : 100;
 		target.es = true;
 		defines += "#define GLSL " + std::to_string(target.version) + "\n";
-		CompileAndLinkShaderFiles(target, from, to.c_str(), tempdir, source, output, length, includer, defines.c_str(), relax);
 	}
 	else if (strcmp(targetlang, "agal") == 0) {
 		target.lang = krafix::AGAL;
 		target.version = version > 0 ? version : 100;
 		target.es = true;
 		defines += "#define AGAL " + std::to_string(target.version) + "\n";
-		CompileAndLinkShaderFiles(target, from, to.c_str(), tempdir, source, output, length, includer, defines.c_str(), relax);
 	}
 	else if (strcmp(targetlang, "metal") == 0) {
 		target.lang = krafix::Metal;
 		target.version = version > 0 ? version : 1;
 		defines += "#define METAL " + std::to_string(target.version) + "\n";
-		CompileAndLinkShaderFiles(target, from, to.c_str(), tempdir, source, output, length, includer, defines.c_str(), relax);
 	}
 	else if (strcmp(targetlang, "varlist") == 0) {
 		target.lang = krafix::VarList;
 		target.version = version > 0 ? version : 1;
-		CompileAndLinkShaderFiles(target, from, to.c_str(), tempdir, source, output, length, includer, defines.c_str(), relax);
 	}
 	else if (strcmp(targetlang, "js") == 0 || strcmp(targetlang, "javascript") == 0) {
 		target.lang = krafix::JavaScript;
 		target.version = version > 0 ? version : 1;
+	}
+	else {
+		return false;
+	}
+	return true;
+}
+
+int compile(const char* targetlang, const char* from, std::string to, const char* tempdir, const char* source, char* output, int* length, const char* system,
+	glslang::TShader::Includer& includer, std::string defines, int version, bool relax) {
+	CompileFailed = false;
+	LinkFailed = false;
+
+	//Options |= EOptionHumanReadableSpv;
+	Options |= EOptionSpv;
+	Options |= EOptionLinkProgram;
+	//Options |= EOptionSuppressInfolog;
+
+	NumWorkItems = 2;
+	Work = new glslang::TWorkItem*[NumWorkItems];
+	Work[0] = 0;
+	Work[1] = 0;
+
+	if (from) {
+		std::string name(from);
+		if (!SetConfigFile(name)) {
+			Work[0] = new glslang::TWorkItem(name);
+			Worklist.add(Work[0]);
+			if (linkedShader.size() > 0) {
+				Work[1] = new glslang::TWorkItem(linkedShader);
+				Worklist.add(Work[1]);
+			}
+		}
+	}
+	else {
+		std::string name = std::string("nothing.") + to;
+		Work[0] = new glslang::TWorkItem(name);
+		Worklist.add(Work[0]);
+	}
+
+	glslang::InitializeProcess();
+
+	krafix::Target target;
+	if (selectTarget(targetlang, from, system, version, target, defines)) {
 		CompileAndLinkShaderFiles(target, from, to.c_str(), tempdir, source, output, length, includer, defines.c_str(), relax);
 	}
 	else {
@@ -1055,6 +1239,12 @@ int compile(const char* targetlang, const char* from, std::string to, const char
 	if (!CompileFailed && !quiet) {
 		std::cerr << "#file:" << to << std::endl;
 	}
+	if (!CompileFailed && !LinkFailed && output == nullptr) {
+		if (target.lang == krafix::SpirV && specConstants.size() > 0 && !krafix::writeSpecConstantTable((to + ".spec.json").c_str(), specConstants)) {
+			std::cout << "Could not write the specialization constants of " << to << std::endl;
+		}
+		compiledFiles.push_back(to);
+	}
 
 	glslang::FinalizeProcess();
 
@@ -1062,67 +1252,361 @@ int compile(const char* targetlang, const char* from, std::string to, const char
 	else return 0;
 }
 
-int compileOptionallyRelaxed(const char* targetlang, const char* from, std::string to, std::string ext, const char* tempdir, const char* source, char* output, int* length, const char* system,
-	glslang::TShader::Includer& includer, std::string defines, int version, bool relax) {
-	int regularErrors = 0, relaxErrors = 0, es3Errors = 0;
-	
-	if (strcmp(system, "html5") == 0 || strcmp(system, "debug-html5") == 0 || strcmp(system, "html5worker") == 0) {
-		if (version == 300) { // -webgl2 only
-			es3Errors = compile(targetlang, from, to + "-webgl2" + ext, tempdir, source, output, length, system, includer, defines, 300, false);
-			return es3Errors;
+// Runs only the preprocessor with the defines of a compile, which tells which variants
+// produce the same token stream and thereby the same shader. Linked shaders are included,
+// as they are compiled with the same defines.
+static bool preprocessFile(const char* targetlang, const char* from, const char* system, int version, glslang::TShader::Includer& includer, std::string defines, std::string& preprocessed) {
+	krafix::Target target;
+	if (!selectTarget(targetlang, from, system, version, target, defines)) return false;
+
+	EShMessages messages = EShMsgDefault;
+	SetMessageOptions(messages);
+	const int defaultVersion = Options & EOptionDefaultDesktop ? 110 : 100;
+	std::vector<std::string> files(1, from);
+	if (linkedShader.size() > 0) files.push_back(linkedShader);
+	bool success = true;
+	glslang::InitializeProcess();
+	for (size_t i = 0; success && i < files.size(); ++i) {
+		char** text = ReadFileData(files[i].c_str());
+		const char* names[] = { files[i].c_str() };
+		std::string stage;
+		{
+			glslang::TShader shader(FindLanguage(files[i]));
+			shader.setStringsWithLengthsAndNames(text, NULL, names, 1);
+			shader.setPreamble(defines.c_str());
+			success = shader.preprocess(&Resources, defaultVersion, ENoProfile, false, false, messages, &stage, includer);
 		}
-		else {
-			regularErrors = compile(targetlang, from, to + ext, tempdir, source, output, length, system, includer, defines, version, false);
-			es3Errors = compile(targetlang, from, to + "-webgl2" + ext, tempdir, source, output, length, system, includer, defines, 300, false);
-			if (relax) {
-				relaxErrors = compile(targetlang, from, to + "-relaxed" + ext, tempdir, source, output, length, system, includer, defines, version, true);
-				return std::min(regularErrors, std::min(relaxErrors, es3Errors));
-			}
-			else {
-				return std::min(regularErrors, es3Errors);
-			}
+		FreeFileData(text);
+		preprocessed += stage;
+	}
+	glslang::FinalizeProcess();
+	return success;
+}
+
+// Shaders which fail to preprocess count as depending on the define, the compile reports the actual errors
+static bool affectsOutput(const char* targetlang, const char* from, const char* system, int version, glslang::TShader::Includer& includer, const std::string& defines, const std::string& define) {
+	std::string without, with;
+	return !preprocessFile(targetlang, from, system, version, includer, defines, without) || !preprocessFile(targetlang, from, system, version, includer, defines + define, with) || with != without;
+}
+
+static std::string textureUnitsDefine(int texcount) {
+	return "#define MAX_TEXTURE_UNITS=" + std::to_string(texcount) + "\n";
+}
+
+static const char* instancedDefine = "#define INSTANCED_RENDERING\n";
+
+// Copies the outputs of the variant "from" to the variant "to" of a shader which compiles to the same code.
+// files are the outputs of "from", written everything its compile wrote like reflection or AGAL bytecode.
+static void aliasOutputs(const std::string& from, const std::string& to, const std::vector<std::string>& files, const std::vector<krafix::WrittenOutput>& written) {
+	for (auto& output : written) {
+		const std::string& file = output.filename;
+		if (file.compare(0, from.size(), from) != 0) continue;
+		std::ifstream in(file, std::ios::binary);
+		if (!in.is_open()) continue;
+		std::stringstream data;
+		data << in.rdbuf();
+		krafix::writeOutput(to + file.substr(from.size()), data.str());
+	}
+	for (auto file : files) {
+		if (file.compare(0, from.size(), from) != 0) continue;
+		std::string alias = to + file.substr(from.size());
+		if (!quiet) {
+			std::cerr << "#file:" << alias << std::endl;
 		}
+		compiledFiles.push_back(alias);
 	}
-	else {
-		regularErrors = compile(targetlang, from, to + ext, tempdir, source, output, length, system, includer, defines, version, false);
-		if (relax) {
-			relaxErrors = compile(targetlang, from, to + "-relaxed" + ext, tempdir, source, output, length, system, includer, defines, version, true);
-			return std::min(regularErrors, relaxErrors);
+}
+
+// A compile for a worker process. Kinds are "compile", which compiles one variant to to,
+// "variants", which compiles the texture unit, instancing and relaxed variants of to + ext,
+// and "shader", which runs compileShaderVariants. The current specialization constants are
+// passed along as "name:id:bool:value" words.
+static std::string encodeJob(const std::string& kind, const std::string& from, const std::string& to, const std::string& ext, const std::string& linked, const std::string& defines,
+	int version, bool relax) {
+	std::string constants;
+	for (auto& constant : specConstants) {
+		constants += constant.name + ":" + std::to_string(constant.id) + ":" + (constant.boolean ? "1" : "0") + ":" + std::to_string(constant.value) + " ";
+	}
+	return kind + "\n" + from + "\n" + to + "\n" + ext + "\n" + linked + "\n" + constants + "\n" + std::to_string(version) + " " + (relax ? "1" : "0") + "\n" + defines;
+}
+
+// Adds the outputs of a job to compiledFiles, everything it wrote to writtenOutputs
+// and its includes to includes and returns its errors
+static int collectJob(const std::string& job, const std::string& result, bool failed, std::set<std::string>* includes) {
+	if (failed) {
+		std::string from = job.substr(job.find('\n') + 1);
+		std::cout << "Compiling " << from.substr(0, from.find('\n')) << " crashed" << std::endl;
+		return 1;
+	}
+	std::istringstream lines(result);
+	std::string line;
+	getline(lines, line);
+	int errors = atoi(line.c_str());
+	while (getline(lines, line)) {
+		if (line.compare(0, 5, "file:") == 0) compiledFiles.push_back(line.substr(5));
+		else if (line.compare(0, 8, "written:") == 0 || line.compare(0, 10, "unchanged:") == 0) {
+			krafix::WrittenOutput output = { line.substr(line.find(':') + 1), line[0] == 'w' };
+			krafix::writtenOutputs().push_back(output);
 		}
-		else {
-			return regularErrors;
+		else if (line.compare(0, 8, "include:") == 0 && includes != nullptr) includes->insert(line.substr(8));
+	}
+	return errors;
+}
+
+// One compile of a shader variant to an output file
+struct VariantCompile {
+	std::string to;
+	int version;
+	bool relax;
+};
+
+// The compiles of to + ext for the system: WebGL 2 versions for html5 and relaxed versions for --relax
+static std::vector<VariantCompile> relaxedCompiles(std::string to, std::string ext, const char* system, int version, bool relax) {
+	std::vector<VariantCompile> compiles;
+	if (strcmp(system, "html5") == 0 || strcmp(system, "debug-html5") == 0 || strcmp(system, "html5worker") == 0) {
+		if (version == 300) { // -webgl2 only
+			compiles.push_back({ to + "-webgl2" + ext, 300, false });
+			return compiles;
 		}
+		compiles.push_back({ to + ext, version, false });
+		compiles.push_back({ to + "-webgl2" + ext, 300, false });
+	}
+	else {
+		compiles.push_back({ to + ext, version, false });
 	}
+	if (relax) {
+		compiles.push_back({ to + "-relaxed" + ext, version, true });
+	}
+	return compiles;
 }
 
-int compileOptionallyInstanced(const char* targetlang, const char* from, std::string to, std::string ext, const char* tempdir, const char* source, char* output, int* length, const char* system,
-	glslang::TShader::Includer& includer, std::string defines, int version, bool instanced, bool relax) {
+// A shader variant is good when any of its compiles succeeded
+int compileOptionallyRelaxed(const char* targetlang, const char* from, std::string to, std::string ext, const char* tempdir, const char* source, char* output, int* length, const char* system,
+	glslang::TShader::Includer& includer, std::string defines, int version, bool relax) {
+	std::vector<VariantCompile> compiles = relaxedCompiles(to, ext, system, version, relax);
 	int errors = 0;
+	for (size_t i = 0; i < compiles.size(); ++i) {
+		int compileErrors = compile(targetlang, from, compiles[i].to, tempdir, source, output, length, system, includer, defines, compiles[i].version, compiles[i].relax);
+		errors = i == 0 ? compileErrors : std::min(errors, compileErrors);
+	}
+	return errors;
+}
+
+// The defines of a texture unit and instancing variant, compiled like compileOptionallyRelaxed or,
+// when it preprocesses to the same text as an earlier variant, copied from that one
+struct ShaderVariant {
+	std::string to;
+	std::string defines;
+	// Index of the variant whose outputs are copied, -1 when it is compiled
+	int representative;
+	std::vector<std::string> files;
+	std::vector<krafix::WrittenOutput> written;
+	int errors;
+};
+
+static void addInstancedVariants(std::vector<ShaderVariant>& variants, const std::string& to, const std::string& defines, bool instanced) {
+	ShaderVariant variant;
+	variant.representative = -1;
+	variant.errors = 0;
 	if (instanced) {
-		errors += compileOptionallyRelaxed(targetlang, from, to + "-noinst", ext, tempdir, source, output, length, system, includer, defines, version, relax);
-		errors += compileOptionallyRelaxed(targetlang, from, to + "-inst", ext, tempdir, source, output, length, system, includer, defines + "#define INSTANCED_RENDERING\n", version, relax);
+		variant.to = to + "-noinst";
+		variant.defines = defines;
+		variants.push_back(variant);
+		variant.to = to + "-inst";
+		variant.defines = defines + instancedDefine;
+		variants.push_back(variant);
 	}
 	else {
-		errors += compileOptionallyRelaxed(targetlang, from, to, ext, tempdir, source, output, length, system, includer, defines, version, relax);
+		variant.to = to;
+		variant.defines = defines;
+		variants.push_back(variant);
 	}
-	return errors;
 }
 
+// Compiles the texture unit, instancing and relaxed variants. Texture unit variants which preprocess
+// to the same text as an earlier variant become copies. With --jobs every compile is a job for the
+// worker pool, the results are collected in the order of the variants.
 int compileWithTextureUnits(const char* targetlang, const char* from, std::string to, std::string ext, const char* tempdir, const char* source, char* output, int* length, const char* system,
 	glslang::TShader::Includer& includer, std::string defines, int version, const std::vector<int>& textureUnitCounts, bool usesTextureUnitsCount, bool instanced, bool relax) {
-	int errors = 0;
-	if (usesTextureUnitsCount && textureUnitCounts.size() > 0) {
+	std::vector<ShaderVariant> variants;
+	bool shared = usesTextureUnitsCount && textureUnitCounts.size() > 0;
+	if (shared) {
 		for (size_t i = 0; i < textureUnitCounts.size(); ++i) {
 			int texcount = textureUnitCounts[i];
 			std::stringstream toto;
 			toto << to << "-tex" << texcount << ext;
-			std::stringstream definesplustex;
-			definesplustex << defines << "#define MAX_TEXTURE_UNITS=" << texcount << "\n";
-			errors += compileOptionallyInstanced(targetlang, from, toto.str(), ext, tempdir, source, output, length, system, includer, definesplustex.str(), version, instanced, relax);
+			addInstancedVariants(variants, toto.str(), defines + textureUnitsDefine(texcount), instanced);
 		}
 	}
 	else {
-		errors += compileOptionallyInstanced(targetlang, from, to, ext, tempdir, source, output, length, system, includer, defines, version, instanced, relax);
+		addInstancedVariants(variants, to, defines, instanced);
+	}
+
+	bool writesFiles = from != nullptr && output == nullptr;
+	if (shared && writesFiles) {
+		std::map<std::string, int> representatives;
+		for (size_t i = 0; i < variants.size(); ++i) {
+			std::string preprocessed;
+			if (!preprocessFile(targetlang, from, system, version, includer, variants[i].defines, preprocessed)) continue;
+			auto representative = representatives.find(preprocessed);
+			if (representative != representatives.end()) variants[i].representative = representative->second;
+			else representatives[preprocessed] = (int)i;
+		}
+	}
+
+	std::vector<std::string> jobs;
+	std::vector<std::string> results;
+	std::vector<bool> failed;
+	if (workerPool != nullptr && writesFiles) {
+		for (auto& variant : variants) {
+			if (variant.representative >= 0) continue;
+			for (auto& variantCompile : relaxedCompiles(variant.to, ext, system, version, relax)) {
+				jobs.push_back(encodeJob("compile", from, variantCompile.to, "", linkedShader, variant.defines, variantCompile.version, variantCompile.relax));
+			}
+		}
+		results = workerPool->run(jobs, failed);
+	}
+
+	int errors = 0;
+	size_t job = 0;
+	for (auto& variant : variants) {
+		if (variant.representative >= 0) {
+			ShaderVariant& representative = variants[variant.representative];
+			aliasOutputs(representative.to, variant.to, representative.files, representative.written);
+			errors += representative.errors;
+			continue;
+		}
+		size_t firstFile = compiledFiles.size();
+		size_t firstWritten = krafix::writtenOutputs().size();
+		if (jobs.size() > 0) {
+			std::vector<VariantCompile> compiles = relaxedCompiles(variant.to, ext, system, version, relax);
+			for (size_t i = 0; i < compiles.size(); ++i, ++job) {
+				int compileErrors = collectJob(jobs[job], results[job], failed[job], nullptr);
+				variant.errors = i == 0 ? compileErrors : std::min(variant.errors, compileErrors);
+			}
+		}
+		else {
+			variant.errors = compileOptionallyRelaxed(targetlang, from, variant.to, ext, tempdir, source, output, length, system, includer, variant.defines, version, relax);
+		}
+		variant.files.assign(compiledFiles.begin() + firstFile, compiledFiles.end());
+		variant.written.assign(krafix::writtenOutputs().begin() + firstWritten, krafix::writtenOutputs().end());
+		errors += variant.errors;
+	}
+	return errors;
+}
+
+static std::string joinDefines(const std::vector<std::string>& commandLineDefines) {
+	std::string defines;
+	for (auto define : commandLineDefines) defines += "#define " + define + "\n";
+	return defines;
+}
+
+// Turns the -D defines named by --spec-constant into specialization constants for the spirv target and
+// returns the remaining defines. Defines which preprocessor directives depend on stay defines, as
+// specializing the module could not change what the preprocessor removed.
+static std::string lowerSpecConstants(const char* from, const char* system, int version, glslang::TShader::Includer& includer,
+	const std::vector<std::string>& commandLineDefines, const std::vector<std::string>& names) {
+	specConstants.clear();
+	std::vector<std::string> remaining = commandLineDefines;
+	for (size_t id = 0; id < names.size(); ++id) {
+		const std::string& name = names[id];
+		size_t index = 0;
+		while (index < remaining.size() && remaining[index].substr(0, remaining[index].find('=')) != name) ++index;
+		if (index == remaining.size()) {
+			printf("Warning: %s has no -D define and can not become a specialization constant.\n", name.c_str());
+			continue;
+		}
+		krafix::SpecConstant constant;
+		if (!krafix::parseSpecConstant(remaining[index], constant)) {
+			printf("Warning: %s has no bool or int value and stays a define.\n", name.c_str());
+			continue;
+		}
+		constant.id = (unsigned)id;
+
+		std::vector<std::string> others = remaining;
+		others.erase(others.begin() + index);
+		std::string otherDefines = joinDefines(others);
+		std::string lowered, zero, one;
+		if (!preprocessFile("spirv", from, system, version, includer, otherDefines, lowered)
+			|| !preprocessFile("spirv", from, system, version, includer, otherDefines + "#define " + name + " 0\n", zero)
+			|| !preprocessFile("spirv", from, system, version, includer, otherDefines + "#define " + name + " 1\n", one)
+			|| krafix::replaceIdentifier(lowered, name, "0") != zero || krafix::replaceIdentifier(lowered, name, "1") != one) {
+			printf("Warning: %s is used by preprocessor directives and stays a define.\n", name.c_str());
+			continue;
+		}
+		remaining = others;
+		specConstants.push_back(constant);
+	}
+	return joinDefines(remaining);
+}
+
+// Variants are only built for defines which change the preprocessed shader
+static void detectVariants(const char* targetlang, const char* from, const char* system, int version, glslang::TShader::Includer& includer, const std::string& defines,
+	const std::vector<int>& textureUnitCounts, bool instancedoptional, bool& usesTextureUnitsCount, bool& usesInstancedoptional) {
+	usesTextureUnitsCount = false;
+	usesInstancedoptional = false;
+	for (int texcount : textureUnitCounts) {
+		if (affectsOutput(targetlang, from, system, version, includer, defines, textureUnitsDefine(texcount))) {
+			usesTextureUnitsCount = true;
+			break;
+		}
+	}
+	if (instancedoptional) {
+		usesInstancedoptional = affectsOutput(targetlang, from, system, version, includer, defines, instancedDefine);
+		for (size_t i = 0; usesTextureUnitsCount && !usesInstancedoptional && i < textureUnitCounts.size(); ++i) {
+			usesInstancedoptional = affectsOutput(targetlang, from, system, version, includer, defines + textureUnitsDefine(textureUnitCounts[i]), instancedDefine);
+		}
+	}
+}
+
+// Compiles every permutation of the --axis defines which preprocesses to a new text once, to
+// <to>-<hash of the preprocessed text><ext>, and writes <to><ext>.permutations.json which maps
+// every permutation to its output. Texture unit, instancing and relaxed variants are added to
+// each output like to regular outputs.
+static int compilePermutations(const char* targetlang, const char* from, std::string to, std::string ext, const char* tempdir, const char* system,
+	glslang::TShader::Includer& includer, std::string defines, int version, const std::vector<int>& textureUnitCounts, bool instancedoptional, bool relax) {
+	int errors = 0;
+	std::map<std::string, std::string> outputs;
+	std::vector<krafix::PermutationOutput> manifest;
+	std::vector<std::string> jobs;
+	for (auto& permutation : krafix::permutations(axes)) {
+		std::string permutationdefines = defines + krafix::permutationDefines(axes, permutation);
+		std::string preprocessed;
+		if (!preprocessFile(targetlang, from, system, version, includer, permutationdefines, preprocessed)) {
+			// Not shared with other permutations, the compile reports the errors
+			preprocessed = "#error\n" + permutationdefines;
+		}
+		auto output = outputs.find(preprocessed);
+		if (output == outputs.end()) {
+			std::string permutationto = to + "-" + krafix::permutationHash(preprocessed);
+			output = outputs.insert(std::make_pair(preprocessed, permutationto)).first;
+			jobs.push_back(encodeJob("variants", from, permutationto, ext, linkedShader, permutationdefines, version, relax));
+			if (workerPool == nullptr) {
+				bool usesTextureUnitsCount, usesInstancedoptional;
+				detectVariants(targetlang, from, system, version, includer, permutationdefines, textureUnitCounts, instancedoptional, usesTextureUnitsCount, usesInstancedoptional);
+				int length = 0;
+				errors += compileWithTextureUnits(targetlang, from, permutationto, ext, tempdir, nullptr, nullptr, &length, system, includer, permutationdefines, version, textureUnitCounts, usesTextureUnitsCount, usesInstancedoptional, relax);
+			}
+		}
+		krafix::PermutationOutput entry;
+		entry.permutation = permutation;
+		entry.file = extractFilename(output->second) + ext;
+		manifest.push_back(entry);
+	}
+	if (workerPool != nullptr) {
+		std::vector<bool> failed;
+		std::vector<std::string> results = workerPool->run(jobs, failed);
+		for (size_t i = 0; i < jobs.size(); ++i) {
+			errors += collectJob(jobs[i], results[i], failed[i], nullptr);
+		}
+	}
+	if (!quiet) {
+		std::cerr << "Compiled " << outputs.size() << " of " << manifest.size() << " permutations." << std::endl;
+	}
+	std::string manifestfile = to + ext + ".permutations.json";
+	if (!krafix::writePermutationManifest(manifestfile.c_str(), axes, manifest)) {
+		std::cout << "Could not write the permutation manifest " << manifestfile << std::endl;
+		++errors;
 	}
 	return errors;
 }
@@ -1177,6 +1661,294 @@ void krafix_compile(const char* source, char* output, int* length, const char* t
 
 // d3d11 in/basic.vert.glsl test.d3d11 temp windows
 #ifndef KRAFIX_LIBRARY
+static void splitOutput(const std::string& to, std::string& towithoutext, std::string& ext) {
+	size_t split1 = to.find_last_of('/');
+	size_t split2 = to.find_last_of('\\');
+	size_t split;
+	if (split1 == std::string::npos && split2 == std::string::npos) {
+		split = 0;
+	}
+	else if (split1 == std::string::npos || split2 == std::string::npos) {
+		split = std::min(split1, split2);
+	}
+	else {
+		split = std::max(split1, split2);
+	}
+	towithoutext = to.substr(0, to.find_first_of('.', split));
+	ext = to.substr(to.find_first_of('.', split));
+}
+
+// Compiles a shader with all its variants into compiledFiles
+static int compileShaderVariants(const char* targetlang, const char* from, std::string to, const char* tempdir, const char* system, KrafixIncluder& includer,
+	std::string defines, int version, const std::vector<int>& textureUnitCounts, bool instancedoptional, bool relax) {
+	if (specConstantNames.size() > 0 && strcmp(targetlang, "spirv") == 0) {
+		defines = lowerSpecConstants(from, system, version, includer, commandLineDefines, specConstantNames);
+	}
+	
+	bool usesTextureUnitsCount = false;
+	bool usesInstancedoptional = false;
+	
+	if (strcmp(targetlang, "varlist") != 0 && axes.size() == 0) {
+		detectVariants(targetlang, from, system, version, includer, defines, textureUnitCounts, instancedoptional, usesTextureUnitsCount, usesInstancedoptional);
+	}
+	
+	std::string towithoutext, ext;
+	splitOutput(to, towithoutext, ext);
+
+	compiledFiles.clear();
+	krafix::writtenOutputs().clear();
+	int errors = 0;
+	if (strcmp(targetlang, "varlist") == 0) {
+		int length = 0;
+		compile(targetlang, from, to, tempdir, nullptr, nullptr, &length, system, includer, defines, version, false);
+		if (CompileFailed || LinkFailed) ++errors;
+	}
+	else if (axes.size() > 0) {
+		errors = compilePermutations(targetlang, from, towithoutext, ext, tempdir, system, includer, defines, version, textureUnitCounts, instancedoptional, relax);
+	}
+	else {
+		int length = 0;
+		errors = compileWithTextureUnits(targetlang, from, towithoutext, ext, tempdir, nullptr, nullptr, &length, system, includer, defines, version, textureUnitCounts, usesTextureUnitsCount, instancedoptional && usesInstancedoptional, relax);
+	}
+	return errors;
+}
+
+// Adds the compiledFiles of the shader compiled to "to" to the archive
+static int archiveCompiledFiles(const char* targetlang, const std::string& to) {
+	std::string towithoutext, ext;
+	splitOutput(to, towithoutext, ext);
+	int errors = 0;
+	if (archive.size() > 0 && compiledFiles.size() > 0) {
+		std::vector<krafix::ArchiveInput> inputs;
+		for (auto file : compiledFiles) {
+			if (file.size() < towithoutext.size() + ext.size() || file.compare(0, towithoutext.size(), towithoutext) != 0) continue;
+			krafix::ArchiveInput input;
+			input.shader = extractFilename(towithoutext) + ext;
+			input.variant = file.substr(towithoutext.size(), file.size() - towithoutext.size() - ext.size());
+			input.filename = file;
+			inputs.push_back(input);
+		}
+		if (!krafix::addToArchive(archive.c_str(), targetlang, inputs, compressArchive)) {
+			std::cout << "Could not write the archive " << archive << std::endl;
+			++errors;
+		}
+	}
+	return errors;
+}
+
+// Compiles a shader with all its variants and adds the outputs to the archive
+static int compileShader(const char* targetlang, const char* from, std::string to, const char* tempdir, const char* system, KrafixIncluder& includer,
+	std::string defines, int version, const std::vector<int>& textureUnitCounts, bool instancedoptional, bool relax) {
+	int errors = compileShaderVariants(targetlang, from, to, tempdir, system, includer, defines, version, textureUnitCounts, instancedoptional, relax);
+	return errors + archiveCompiledFiles(targetlang, to);
+}
+
+// The command line settings which jobs in worker processes compile with
+struct JobSettings {
+	std::string targetlang;
+	std::string tempdir;
+	std::string system;
+	std::vector<int> textureUnitCounts;
+	bool instancedoptional;
+};
+
+static JobSettings jobSettings;
+
+// Runs in the worker processes, the result is the number of errors followed by "file:" lines for
+// the outputs, "written:" and "unchanged:" lines for all files it wrote or --write-if-changed left
+// alone and "include:" lines for the included files
+static std::string runJob(const std::string& job) {
+	// Workers compile by themselves
+	workerPool = nullptr;
+	// Workers run many jobs, a failure must not carry over to the next one
+	CompileFailed = false;
+	LinkFailed = false;
+	std::vector<std::string> fields;
+	size_t position = 0;
+	for (int i = 0; i < 7; ++i) {
+		size_t end = job.find('\n', position);
+		fields.push_back(job.substr(position, end - position));
+		position = end + 1;
+	}
+	std::string defines = job.substr(position);
+	specConstants.clear();
+	std::istringstream constants(fields[5]);
+	std::string word;
+	while (constants >> word) {
+		krafix::SpecConstant constant;
+		size_t first = word.find(':'), second = word.find(':', first + 1), third = word.find(':', second + 1);
+		constant.name = word.substr(0, first);
+		constant.id = atoi(word.c_str() + first + 1);
+		constant.boolean = word[second + 1] == '1';
+		constant.value = atoi(word.c_str() + third + 1);
+		specConstants.push_back(constant);
+	}
+	int version = atoi(fields[6].c_str());
+	bool relax = fields[6].substr(fields[6].find(' ') + 1) == "1";
+	const char* targetlang = jobSettings.targetlang.c_str();
+	const char* from = fields[1].c_str();
+	const char* tempdir = jobSettings.tempdir.c_str();
+	const char* system = jobSettings.system.c_str();
+	linkedShader = fields[4];
+	KrafixIncluder includer(fields[1]);
+	compiledFiles.clear();
+	krafix::writtenOutputs().clear();
+	int errors;
+	if (fields[0] == "compile") {
+		int length = 0;
+		errors = compile(targetlang, from, fields[2], tempdir, nullptr, nullptr, &length, system, includer, defines, version, relax);
+	}
+	else if (fields[0] == "variants") {
+		bool usesTextureUnitsCount, usesInstancedoptional;
+		detectVariants(targetlang, from, system, version, includer, defines, jobSettings.textureUnitCounts, jobSettings.instancedoptional, usesTextureUnitsCount, usesInstancedoptional);
+		int length = 0;
+		errors = compileWithTextureUnits(targetlang, from, fields[2], fields[3], tempdir, nullptr, nullptr, &length, system, includer, defines, version,
+			jobSettings.textureUnitCounts, usesTextureUnitsCount, usesInstancedoptional, relax);
+	}
+	else {
+		errors = compileShaderVariants(targetlang, from, fields[2], tempdir, system, includer, defines, version, jobSettings.textureUnitCounts, jobSettings.instancedoptional, relax);
+	}
+	std::string result = std::to_string(errors) + "\n";
+	for (auto file : compiledFiles) result += "file:" + file + "\n";
+	for (auto& output : krafix::writtenOutputs()) result += (output.changed ? "written:" : "unchanged:") + output.filename + "\n";
+	for (auto file : includer.includes()) result += "include:" + file + "\n";
+	return result;
+}
+
+static bool isShaderSource(const std::string& filename) {
+	std::string name = filename;
+	if (name.size() > 5 && name.compare(name.size() - 5, 5, ".glsl") == 0) name = name.substr(0, name.size() - 5);
+	const char* stages[] = { ".vert", ".frag", ".geom", ".tesc", ".tese", ".comp" };
+	for (auto stage : stages) {
+		size_t length = strlen(stage);
+		if (name.size() > length && name.compare(name.size() - length, length, stage) == 0) return true;
+	}
+	return false;
+}
+
+struct WatchedShader {
+	std::string from;
+	std::string to;
+	std::string linked;
+};
+
+// The shader itself, its linked shader and everything it included
+static std::set<std::string> dependencies(const WatchedShader& shader, const std::set<std::string>& includes) {
+	std::set<std::string> files;
+	files.insert(krafix::realPath(shader.from));
+	if (shader.linked.size() > 0) files.insert(krafix::realPath(shader.linked));
+	for (auto& file : includes) files.insert(krafix::realPath(file));
+	return files;
+}
+
+// Keeps recompiling the shader given on the command line and all shaders in a directory whenever they
+// or one of their includes change. Shaders of the directory are compiled to the directory of the
+// command line output, named like the source with the extension of the command line output.
+// glslang stays initialized between compiles and every output whose contents changed is reported in
+// a #updated: line.
+static int watch(const std::string& directory, const char* targetlang, const char* from, const std::string& to, const char* tempdir, const char* system,
+	const std::string& defines, int version, const std::vector<int>& textureUnitCounts, bool instancedoptional, bool relax) {
+	krafix::FileWatcher watcher;
+	if (!watcher.valid()) {
+		std::cout << "Could not watch " << directory << ", --watch is only available on Linux" << std::endl;
+		return 1;
+	}
+
+	std::string outputdir = krafix::directoryOf(to);
+	std::string toname = extractFilename(to);
+	std::string outputext = toname.substr(toname.find_last_of('.'));
+	std::string sourcedir = directory;
+	if (sourcedir.size() > 0 && sourcedir[sourcedir.size() - 1] != '/' && sourcedir[sourcedir.size() - 1] != '\\') sourcedir += '/';
+
+	std::vector<WatchedShader> shaders;
+	WatchedShader commandLineShader = { from, to, linkedShader };
+	shaders.push_back(commandLineShader);
+	std::set<std::string> known;
+	known.insert(krafix::realPath(from));
+
+	krafix::IncludeGraph graph;
+	auto addDependencies = [&](unsigned index, const std::set<std::string>& includes) {
+		std::set<std::string> files = dependencies(shaders[index], includes);
+		graph.setDependencies(index, files);
+		for (auto& file : files) watcher.watchDirectory(krafix::directoryOf(file));
+	};
+	auto addShader = [&](const std::string& filename) {
+		std::string source = sourcedir + filename;
+		std::string name = filename.size() > 5 && filename.compare(filename.size() - 5, 5, ".glsl") == 0 ? filename.substr(0, filename.size() - 5) : filename;
+		WatchedShader shader = { source, outputdir + name + outputext, "" };
+		known.insert(krafix::realPath(source));
+		shaders.push_back(shader);
+		return (unsigned)shaders.size() - 1;
+	};
+
+	// The command line shader was just compiled, the others only need their includes
+	for (unsigned i = 0; i < shaders.size(); ++i) {
+		linkedShader = shaders[i].linked;
+		KrafixIncluder includer(shaders[i].from);
+		std::string preprocessed;
+		preprocessFile(targetlang, shaders[i].from.c_str(), system, version, includer, defines, preprocessed);
+		addDependencies(i, includer.includes());
+	}
+	for (auto& filename : krafix::listDirectory(sourcedir)) {
+		if (!isShaderSource(filename) || known.find(krafix::realPath(sourcedir + filename)) != known.end()) continue;
+		unsigned index = addShader(filename);
+		linkedShader = "";
+		KrafixIncluder includer(shaders[index].from);
+		std::string preprocessed;
+		preprocessFile(targetlang, shaders[index].from.c_str(), system, version, includer, defines, preprocessed);
+		addDependencies(index, includer.includes());
+	}
+	watcher.watchDirectory(sourcedir);
+	std::cout << "Watching " << shaders.size() << " shaders." << std::endl;
+
+	std::string realsourcedir = krafix::realPath(sourcedir);
+	for (;;) {
+		std::set<unsigned> affected;
+		for (auto& file : watcher.wait()) {
+			std::set<unsigned> shadersOfFile = graph.affected(file);
+			affected.insert(shadersOfFile.begin(), shadersOfFile.end());
+			if (krafix::directoryOf(file) == realsourcedir + "/" && isShaderSource(extractFilename(file)) && known.find(file) == known.end()) {
+				affected.insert(addShader(extractFilename(file)));
+			}
+		}
+		std::vector<std::string> jobs;
+		std::vector<std::string> results;
+		std::vector<bool> failed;
+		if (workerPool != nullptr) {
+			for (unsigned index : affected) jobs.push_back(encodeJob("shader", shaders[index].from, shaders[index].to, "", shaders[index].linked, defines, version, relax));
+			results = workerPool->run(jobs, failed);
+		}
+		unsigned job = 0;
+		for (unsigned index : affected) {
+			WatchedShader& shader = shaders[index];
+			std::set<std::string> includes;
+			if (workerPool != nullptr) {
+				compiledFiles.clear();
+				krafix::writtenOutputs().clear();
+				collectJob(jobs[job], results[job], failed[job], &includes);
+				archiveCompiledFiles(targetlang, shader.to);
+				++job;
+			}
+			else {
+				linkedShader = shader.linked;
+				KrafixIncluder includer(shader.from);
+				compileShader(targetlang, shader.from.c_str(), shader.to, tempdir, system, includer, defines, version, textureUnitCounts, instancedoptional, relax);
+				includes = includer.includes();
+			}
+			std::set<std::string> unchanged;
+			for (auto& output : krafix::writtenOutputs()) {
+				if (output.changed) unchanged.erase(output.filename);
+				else unchanged.insert(output.filename);
+			}
+			for (auto& file : compiledFiles) {
+				if (unchanged.find(file) == unchanged.end()) std::cout << "#updated:" << file << std::endl;
+			}
+			addDependencies(index, includes);
+		}
+	}
+	return 0;
+}
+
 int C_DECL main(int argc, char* argv[]) {
 	if (argc < 6) {
 		usage();
@@ -1190,6 +1962,18 @@ int C_DECL main(int argc, char* argv[]) {
 	bool instancedoptional = false;
 	int version = -1;
 	bool getversion = false;
+	bool getbakeuniforms = false;
+	bool getlink = false;
+	bool getpushconstantlimit = false;
+	bool getuniformgroups = false;
+	bool getarchive = false;
+	bool getaxis = false;
+	bool getspecconstant = false;
+	bool getwatch = false;
+	std::string watchDirectory;
+	bool getjobs = false;
+	unsigned jobs = 1;
+	std::string isolation = "process";
 	bool relax = false;
 
 	for (int i = 6; i < argc; ++i) {
@@ -1198,8 +1982,56 @@ int C_DECL main(int argc, char* argv[]) {
 			version = atoi(argv[i]);
 			getversion = false;
 		}
+		else if (getpushconstantlimit) {
+			pushConstantLimit = atoi(argv[i]);
+			getpushconstantlimit = false;
+		}
+		else if (getlink) {
+			linkedShader = argv[i];
+			getlink = false;
+		}
+		else if (getarchive) {
+			archive = argv[i];
+			getarchive = false;
+		}
+		else if (getaxis) {
+			krafix::PermutationAxis axis;
+			if (!krafix::parseAxis(argv[i], axis)) {
+				std::cout << "Could not parse the axis " << argv[i] << std::endl;
+				return 1;
+			}
+			axes.push_back(axis);
+			getaxis = false;
+		}
+		else if (getjobs) {
+			jobs = atoi(argv[i]);
+			getjobs = false;
+		}
+		else if (getwatch) {
+			watchDirectory = argv[i];
+			getwatch = false;
+		}
+		else if (getspecconstant) {
+			specConstantNames.push_back(argv[i]);
+			getspecconstant = false;
+		}
+		else if (getuniformgroups) {
+			if (!krafix::readUniformGroups(argv[i], uniformGroups)) {
+				std::cout << "Could not read uniform groups from " << argv[i] << std::endl;
+				return 1;
+			}
+			getuniformgroups = false;
+		}
+		else if (getbakeuniforms) {
+			if (!krafix::readBakedUniforms(argv[i], bakedUniforms)) {
+				std::cout << "Could not read baked uniforms from " << argv[i] << std::endl;
+				return 1;
+			}
+			getbakeuniforms = false;
+		}
 		else if (arg.substr(0, 2) == "-D") {
 			defines += "#define " + arg.substr(2) + "\n";
+			commandLineDefines.push_back(arg.substr(2));
 		}
 		else if (arg.substr(0, 2) == "-T") {
 			textureUnitCounts.push_back(atoi(arg.substr(2).c_str()));
@@ -1219,9 +2051,84 @@ int C_DECL main(int argc, char* argv[]) {
 		else if (arg == "--relax") {
 			relax = true;
 		}
+		else if (arg == "--minify") {
+			minify = true;
+		}
 		else if (arg == "--outputintermediatespirv") {
 			outputSpirv = true;
 		}
+		else if (arg == "--half") {
+			halfPrecision = true;
+		}
+		else if (arg == "--bake-uniforms") {
+			getbakeuniforms = true;
+		}
+		else if (arg == "--preshader") {
+			preshader = true;
+		}
+		else if (arg == "--link") {
+			getlink = true;
+		}
+		else if (arg == "--hoist-interpolation") {
+			interpolationHoisting = true;
+		}
+		else if (arg == "--agal-bytecode") {
+			agalBytecode = true;
+		}
+		else if (arg == "--no-clipspace-fixup") {
+			clipSpaceFixup = false;
+		}
+		else if (arg == "--std430") {
+			std430 = true;
+		}
+		else if (arg == "--pack-uniforms") {
+			packUniforms = true;
+		}
+		else if (arg == "--push-constants") {
+			if (pushConstantLimit == 0) pushConstantLimit = 128;
+		}
+		else if (arg == "--push-constant-limit") {
+			getpushconstantlimit = true;
+		}
+		else if (arg == "--shared-uniforms") {
+			sharedUniforms = true;
+		}
+		else if (arg == "--uniform-groups") {
+			getuniformgroups = true;
+		}
+		else if (arg == "--group-uniforms") {
+			groupUniformsByPrefix = true;
+		}
+		else if (arg == "--shipping") {
+			shipping = true;
+		}
+		else if (arg == "--reflection") {
+			writeReflectionFile = true;
+		}
+		else if (arg == "--archive") {
+			getarchive = true;
+		}
+		else if (arg == "--jobs") {
+			getjobs = true;
+		}
+		else if (arg.substr(0, 12) == "--isolation=") {
+			isolation = arg.substr(12);
+		}
+		else if (arg == "--watch") {
+			getwatch = true;
+		}
+		else if (arg == "--spec-constant") {
+			getspecconstant = true;
+		}
+		else if (arg == "--axis") {
+			getaxis = true;
+		}
+		else if (arg == "--archive-compress") {
+			compressArchive = true;
+		}
+		else if (arg == "--write-if-changed") {
+			krafix::setWriteIfChanged(true);
+		}
 	}
 
 	const char* targetlang = argv[1];
@@ -1231,58 +2138,40 @@ int C_DECL main(int argc, char* argv[]) {
 
 	ProcessConfigFile();
 
-	//glslang::InitializeProcess();
-	
-	KrafixIncluder includer(from);
-	
-	bool usesTextureUnitsCount = false;
-	bool usesInstancedoptional = false;
-	
-	if (textureUnitCounts.size() > 0 || instancedoptional) {
-		std::stringstream filecontentstream;
-		std::string line;
-		std::ifstream file(from);
-		if (file.is_open()) {
-			while (getline (file, line)) {
-				filecontentstream << line << '\n';
-			}
-			file.close();
-		}
-		std::string filecontent = filecontentstream.str();
-		
-		if (filecontent.find("MAX_TEXTURE_UNITS") != std::string::npos) {
-			usesTextureUnitsCount = true;
-		}
-		if (filecontent.find("INSTANCED_RENDERING") != std::string::npos) {
-			usesInstancedoptional = true;
+	// glslang parses the built-in declarations of every stage, version and profile into shared
+	// symbol tables, which it frees when its last client finalizes. Staying initialized for the
+	// whole run lets all variants, permutations, preprocessing passes and --watch recompiles reuse
+	// them, and worker processes are forked with the tables glslang already set up.
+	glslang::InitializeProcess();
+
+	// Threads would share glslang's and krafix' global state, so parallel compiles run in processes
+	if (isolation != "process") {
+		std::cout << "Unknown isolation " << isolation << ", only --isolation=process is supported" << std::endl;
+		return 1;
+	}
+	if (jobs > 1) {
+		jobSettings.targetlang = targetlang;
+		jobSettings.tempdir = tempdir;
+		jobSettings.system = system;
+		jobSettings.textureUnitCounts = textureUnitCounts;
+		jobSettings.instancedoptional = instancedoptional;
+		workerPool = new krafix::WorkerPool(jobs, runJob);
+		if (!workerPool->valid()) {
+			printf("Warning: Could not start worker processes, compiling in one process.\n");
+			delete workerPool;
+			workerPool = nullptr;
 		}
 	}
 	
-	size_t split1 = to.find_last_of('/');
-	size_t split2 = to.find_last_of('\\');
-	size_t split;
-	if (split1 == std::string::npos && split2 == std::string::npos) {
-		split = 0;
-	}
-	else if (split1 == std::string::npos || split2 == std::string::npos) {
-		split = std::min(split1, split2);
-	}
-	else {
-		split = std::max(split1, split2);
+	KrafixIncluder includer(from);
+	
+	int errors = compileShader(targetlang, from, to, tempdir, system, includer, defines, version, textureUnitCounts, instancedoptional, relax);
+	if (watchDirectory.size() > 0) {
+		errors = watch(watchDirectory, targetlang, from, to, tempdir, system, defines, version, textureUnitCounts, instancedoptional, relax);
 	}
-	std::string towithoutext = to.substr(0, to.find_first_of('.', split));
-	std::string ext = to.substr(to.find_first_of('.', split));
 
-	int errors = 0;
-	if (strcmp(targetlang, "varlist") == 0) {
-		int length = 0;
-		compile(targetlang, from, to, tempdir, nullptr, nullptr, &length, system, includer, defines, version, false);
-		if (CompileFailed || LinkFailed) ++errors;
-	}
-	else {
-		int length = 0;
-		errors = compileWithTextureUnits(targetlang, from, towithoutext, ext, tempdir, nullptr, nullptr, &length, system, includer, defines, version, textureUnitCounts, usesTextureUnitsCount, instancedoptional && usesInstancedoptional, relax);
-	}
+	delete workerPool;
+	glslang::FinalizeProcess();
 	return errors;
 }
 #endif